@@ -0,0 +1,460 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "ws_pool.h"
+#include "batch_read.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+static void
+_read_file(batch_file_t *file)
+{
+    struct stat st;
+    ssize_t ret;
+    size_t got = 0;
+    int fd;
+
+    fd = open(file->path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+    file->buf = malloc(st.st_size ? st.st_size : 1);
+    if (file->buf == NULL) {
+        close(fd);
+        return;
+    }
+    while (got < (size_t)st.st_size) {
+#if !defined(_WIN32)
+        ret = pread(fd, file->buf + got, st.st_size - got, got);
+#else
+        ret = read(fd, file->buf + got, st.st_size - got);
+#endif
+        if (ret <= 0) {
+            break;
+        }
+        got += ret;
+    }
+    close(fd);
+    file->len = got;
+}
+
+static void
+_read_task(void *handle, void *arg, int worker)
+{
+    _read_file(arg);
+}
+
+static void
+_read_threads(batch_file_t *file, int count, int threads)
+{
+    ws_pool_t *pool = NULL;
+    int ii;
+
+    if (threads > 1 && count > 1) {
+        pool = ws_pool_create(threads < count ? threads : count, _read_task, NULL);
+    }
+    for (ii = 0; ii < count; ii++) {
+        if (file[ii].buf != NULL) {
+            continue;
+        }
+        if (pool != NULL) {
+            ws_pool_push(pool, -1, &file[ii]);
+        } else {
+            _read_file(&file[ii]);
+        }
+    }
+    if (pool != NULL) {
+        ws_pool_wait(pool);
+        ws_pool_destroy(pool);
+    }
+}
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+int
+batch_locate(const char *path, batch_loc_t *loc)
+{
+    struct stat st;
+    int fd;
+#if defined(__linux__)
+    union {
+        struct fiemap fm;
+        uint8_t       buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } map;
+#endif
+
+    loc->phys = 0;
+    loc->ino = 0;
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) == 0) {
+        loc->ino = st.st_ino;
+    }
+#if defined(__linux__)
+    // Only the first extent, playlists are small enough to be in one
+    memset(&map, 0, sizeof(map));
+    map.fm.fm_length = FIEMAP_MAX_OFFSET;
+    map.fm.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &map.fm) == 0 && map.fm.fm_mapped_extents > 0 &&
+        !(map.fm.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+        loc->phys = map.fm.fm_extents[0].fe_physical;
+    }
+#endif
+    close(fd);
+    return 0;
+}
+
+#if defined(HAVE_IO_URING)
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Files per batch, a batch takes two ring entries per file
+#define RING_FILES      128
+#define RING_ENTRIES    (2 * RING_FILES)
+
+// The user_data of a request, file index and operation
+#define OP_OPEN     0
+#define OP_STATX    1
+#define OP_READ     2
+#define OP_CLOSE    3
+#define RING_DATA(idx, op)  ((uint64_t)(idx) << 2 | (op))
+
+typedef struct {
+    int          fd;
+    int          failed;
+    struct statx stx;
+} ring_file_t;
+
+typedef struct {
+    int                  fd;
+    unsigned             entries;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ptr;
+    void                *cq_ptr;
+    size_t               sq_size;
+    size_t               cq_size;
+    unsigned             queued;
+    int                  lost;      // requests may still be in flight
+    ring_file_t          file[RING_FILES];
+} ring_t;
+
+static void
+_ring_free(ring_t *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    close(ring->fd);
+}
+
+static int
+_ring_init(ring_t *ring)
+{
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->entries = p.sq_entries;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        _ring_free(ring);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            _ring_free(ring);
+            return -1;
+        }
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        _ring_free(ring);
+        return -1;
+    }
+
+    sq = ring->sq_ptr;
+    cq = ring->cq_ptr;
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// Only this thread fills the submission queue, the kernel reads the tail
+static struct io_uring_sqe*
+_ring_sqe(ring_t *ring, int opcode, int idx, int op)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, slot;
+
+    tail = *ring->sq_tail;
+    slot = tail & *ring->sq_mask;
+    sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = RING_DATA(idx, op);
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return sqe;
+}
+
+// Submits the queued requests and waits for all of them, the results
+// go to the files of the batch starting at "first".  Returns -1 when the
+// ring itself fails.  The requests submitted by then are still waited
+// for, unless waiting fails too, which sets "lost".
+static int
+_ring_run(ring_t *ring, batch_file_t *file, int first)
+{
+    struct io_uring_cqe *cqe;
+    ring_file_t *rf = ring->file;
+    unsigned head, tail, pending = ring->queued, submit = ring->queued;
+    int ret, idx, res, status = 0;
+
+    ring->queued = 0;
+    while (pending > 0) {
+        ret = syscall(__NR_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            if (submit == 0) {
+                ring->lost = 1;
+                return -1;
+            }
+            // The rest of the queue is never submitted, the ring is not
+            // used again
+            pending -= submit;
+            submit = 0;
+            status = -1;
+            continue;
+        }
+        submit -= ret;
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            idx = cqe->user_data >> 2;
+            res = cqe->res;
+            switch (cqe->user_data & 3) {
+                case OP_OPEN:
+                    rf[idx].fd = res;
+                    if (res < 0) {
+                        rf[idx].failed = 1;
+                    }
+                    break;
+
+                case OP_STATX:
+                    if (res < 0 || !S_ISREG(rf[idx].stx.stx_mode) ||
+                        rf[idx].stx.stx_size > INT32_MAX) {
+                        rf[idx].failed = 1;
+                    }
+                    break;
+
+                case OP_READ:
+                    if (res < 0) {
+                        rf[idx].failed = 1;
+                    } else {
+                        file[first + idx].len = res;
+                    }
+                    break;
+
+                case OP_CLOSE:
+                    rf[idx].fd = -1;
+                    break;
+            }
+            pending--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return status;
+}
+
+// One batch of up to RING_FILES files: opens and statx, then the reads,
+// then the closes, each as a single submission
+static int
+_ring_batch(ring_t *ring, batch_file_t *file, int count, int first)
+{
+    ring_file_t *rf = ring->file;
+    struct io_uring_sqe *sqe;
+    int ii, ret;
+
+    for (ii = 0; ii < count; ii++) {
+        rf[ii].fd = -1;
+        rf[ii].failed = 0;
+        sqe = _ring_sqe(ring, IORING_OP_OPENAT, ii, OP_OPEN);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)file[first + ii].path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe = _ring_sqe(ring, IORING_OP_STATX, ii, OP_STATX);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)file[first + ii].path;
+        sqe->len = STATX_TYPE | STATX_SIZE;
+        sqe->off = (uintptr_t)&rf[ii].stx;
+    }
+    ret = _ring_run(ring, file, first);
+
+    for (ii = 0; ii < count && ret == 0; ii++) {
+        if (rf[ii].failed) {
+            continue;
+        }
+        file[first + ii].buf = malloc(rf[ii].stx.stx_size ? rf[ii].stx.stx_size : 1);
+        if (file[first + ii].buf == NULL) {
+            rf[ii].failed = 1;
+            continue;
+        }
+        sqe = _ring_sqe(ring, IORING_OP_READ, ii, OP_READ);
+        sqe->fd = rf[ii].fd;
+        sqe->addr = (uintptr_t)file[first + ii].buf;
+        sqe->len = rf[ii].stx.stx_size;
+        sqe->off = 0;
+    }
+    if (ret == 0) {
+        ret = _ring_run(ring, file, first);
+    }
+
+    // The kernel may still write to the buffers, they are left to it and
+    // the files read again
+    if (ring->lost) {
+        for (ii = 0; ii < count; ii++) {
+            file[first + ii].buf = NULL;
+            file[first + ii].len = 0;
+        }
+        return -1;
+    }
+
+    // Anything that went wrong is read again the plain way, which also
+    // covers kernels that lack one of the operations
+    for (ii = 0; ii < count; ii++) {
+        if (rf[ii].failed || ret < 0) {
+            X_FREE(file[first + ii].buf);
+            file[first + ii].buf = NULL;
+            file[first + ii].len = 0;
+        }
+        if (rf[ii].fd >= 0 && ret == 0) {
+            sqe = _ring_sqe(ring, IORING_OP_CLOSE, ii, OP_CLOSE);
+            sqe->fd = rf[ii].fd;
+        }
+    }
+    if (ret == 0) {
+        ret = _ring_run(ring, file, first);
+    }
+    // Whatever the ring did not close
+    for (ii = 0; ii < count && !ring->lost; ii++) {
+        if (rf[ii].fd >= 0) {
+            close(rf[ii].fd);
+        }
+    }
+    return ret;
+}
+
+static int
+_read_ring(batch_file_t *file, int count)
+{
+    ring_t *ring;
+    int ii, n;
+
+    // On the heap, a lost ring keeps the statx results it may write
+    ring = malloc(sizeof(*ring));
+    if (ring == NULL) {
+        return -1;
+    }
+    if (_ring_init(ring) < 0) {
+        free(ring);
+        return -1;
+    }
+    for (ii = 0; ii < count; ii += n) {
+        n = count - ii < RING_FILES ? count - ii : RING_FILES;
+        if (_ring_batch(ring, file, n, ii) < 0) {
+            break;
+        }
+    }
+    _ring_free(ring);
+    if (!ring->lost) {
+        free(ring);
+    }
+    return 0;
+}
+
+#endif // HAVE_IO_URING
+
+void
+batch_read(batch_file_t *file, int count, int threads)
+{
+    int ii;
+
+    for (ii = 0; ii < count; ii++) {
+        file[ii].buf = NULL;
+        file[ii].len = 0;
+    }
+#if defined(HAVE_IO_URING)
+    _read_ring(file, count);
+#endif
+    // Whatever the ring did not read
+    _read_threads(file, count, threads);
+}
@@ -0,0 +1,33 @@
+#if !defined(_BATCH_READ_H_)
+#define _BATCH_READ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Whole file reads for many small files at once.  On Linux the opens,
+// statx and reads of all the files go to io_uring as a few batches, so
+// the round trips to slow storage overlap instead of adding up.  Where
+// io_uring is missing or refused, the files are read with open, fstat
+// and pread by "threads" threads.
+typedef struct
+{
+    const char *path;
+    uint8_t    *buf;    // malloc'd contents, NULL when the read failed
+    size_t      len;
+} batch_file_t;
+
+void batch_read(batch_file_t *file, int count, int threads);
+
+// Where a file lies on the disk, to read files in that order and spare
+// the seeks.  "phys" is the byte offset of its first extent from FIEMAP
+// (Linux), 0 where the file system does not map extents or the data is
+// kept in the inode, which the inode number then stands in for.
+typedef struct
+{
+    uint64_t    phys;
+    uint64_t    ino;
+} batch_loc_t;
+
+int batch_locate(const char *path, batch_loc_t *loc);
+
+#endif // _BATCH_READ_H_
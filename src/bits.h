@@ -25,14 +25,29 @@
 #define BD_BITS_H 1
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
 /**
  * \file
  * This file defines functions, structures for handling streams of bits
  */
 
-#define BF_BUF_SIZE   (1024*32)
+/* How the BITSTREAM buffer was obtained, decides what bs_close() releases */
+#define BS_BUF_USER   0
+#define BS_BUF_MMAP   1
+#define BS_BUF_HEAP   2
 
 typedef struct {
     uint8_t *p_start;
@@ -42,13 +57,16 @@ typedef struct {
     ssize_t  i_left;    /* i_count number of available bits */
 } BITBUFFER;
 
+/*
+ * A BITSTREAM always covers the whole file.  It is read in one go when
+ * opened, or mapped, so reads, skips and seeks never go back to the file
+ * and every field is decoded straight from memory.
+ */
 typedef struct {
-    FILE      *fp;
-    uint8_t    buf[BF_BUF_SIZE];
+    uint8_t   *buf;
     BITBUFFER  bb;
-    off_t      pos;
     off_t      end;
-    int        size;
+    int        buf_type;
 } BITSTREAM;
 
 static inline void bb_init( BITBUFFER *bb, const void *p_data, size_t i_data )
@@ -59,14 +77,124 @@ static inline void bb_init( BITBUFFER *bb, const void *p_data, size_t i_data )
     bb->i_left  = 8;
 }
 
-static inline void bs_init( BITSTREAM *bs, FILE *fp )
+static inline void bs_init_buf( BITSTREAM *bs, const uint8_t *data, size_t size )
+{
+    bs->buf      = (uint8_t *)data;
+    bs->end      = size;
+    bs->buf_type = BS_BUF_USER;
+    bb_init(&bs->bb, bs->buf, size);
+}
+
+/* Reads or maps the whole of an open file, "fd" stays open */
+static inline int _bs_open_fd( BITSTREAM *bs, int fd, int map )
+{
+    struct stat st;
+    uint8_t    *buf = NULL;
+    int         buf_type = BS_BUF_USER;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    if (st.st_size > 0) {
+#if !defined(_WIN32)
+        /* Private writable mapping so bs_write() never reaches the file */
+        if (map) {
+            buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (buf == MAP_FAILED) {
+                buf = NULL;
+            } else {
+                buf_type = BS_BUF_MMAP;
+            }
+        }
+#endif
+        if (buf == NULL) {
+            off_t got = 0;
+            ssize_t ret;
+
+            buf = malloc(st.st_size);
+            if (buf == NULL) {
+                return -1;
+            }
+            buf_type = BS_BUF_HEAP;
+            if (lseek(fd, 0, SEEK_SET) != 0) {
+                st.st_size = 0;
+            }
+            while (got < st.st_size) {
+                ret = read(fd, buf + got, st.st_size - got);
+                if (ret <= 0) {
+                    break;
+                }
+                got += ret;
+            }
+            st.st_size = got;
+        }
+    }
+
+    bs_init_buf(bs, buf, st.st_size);
+    bs->buf_type = buf_type;
+    return 0;
+}
+
+static inline int _bs_open( BITSTREAM *bs, const char *path, int map )
+{
+    int fd, ret;
+
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return -1;
+    }
+    ret = _bs_open_fd(bs, fd, map);
+    close(fd);
+    return ret;
+}
+
+/*
+ * Input files are read: a mapping of a file that another process
+ * truncates, like a rip still being written, faults on the next access
+ * past the new end.
+ */
+static inline int bs_open( BITSTREAM *bs, const char *path )
+{
+    return _bs_open(bs, path, 0);
+}
+
+/*
+ * Mapping, with bs_open() as the fallback, for the files of this tool
+ * that are only ever appended to or replaced through a rename
+ */
+static inline int bs_map( BITSTREAM *bs, const char *path )
+{
+    return _bs_open(bs, path, 1);
+}
+
+/*
+ * Same through a file the caller holds open, which keeps the POSIX
+ * record locks it took on it: closing any other descriptor of the file
+ * would release them.
+ */
+static inline int bs_map_fd( BITSTREAM *bs, int fd )
 {
-    bs->fp = fp;
-    bs->pos = 0;
-    fseek(fp, 0, SEEK_END);
-    bs->end = ftell(fp);
-    bs->size = fread(bs->buf, 1, BF_BUF_SIZE, fp);
-    bb_init(&bs->bb, bs->buf, bs->size);
+    return _bs_open_fd(bs, fd, 1);
+}
+
+static inline void bs_close( BITSTREAM *bs )
+{
+    switch (bs->buf_type) {
+#if !defined(_WIN32)
+        case BS_BUF_MMAP:
+            munmap(bs->buf, bs->end);
+            break;
+#endif
+        case BS_BUF_HEAP:
+            free(bs->buf);
+            break;
+        default:
+            break;
+    }
+    bs->buf = NULL;
+    bs->end = 0;
+    bs->buf_type = BS_BUF_USER;
+    bb_init(&bs->bb, NULL, 0);
 }
 
 static inline int bb_pos( const BITBUFFER *bb )
@@ -76,7 +204,7 @@ static inline int bb_pos( const BITBUFFER *bb )
 
 static inline int bs_pos( const BITSTREAM *bs )
 {
-    return bs->pos * 8 + bb_pos(&bs->bb);
+    return bb_pos(&bs->bb);
 }
 
 static inline int bb_eof( const BITBUFFER *bb )
@@ -86,7 +214,7 @@ static inline int bb_eof( const BITBUFFER *bb )
 
 static inline int bs_eof( const BITSTREAM *bs )
 {
-    return feof(bs->fp) && bb_eof(&bs->bb);
+    return bb_eof(&bs->bb);
 }
 
 static inline void bb_seek( BITBUFFER *bb, off_t off, int whence)
@@ -111,11 +239,9 @@ static inline void bb_seek( BITBUFFER *bb, off_t off, int whence)
 
 static inline void bs_seek( BITSTREAM *bs, off_t off, int whence)
 {
-    off_t b;
-
     switch (whence) {
         case SEEK_CUR:
-            off = bs->pos * 8 + (bs->bb.p - bs->bb.p_start) + off;
+            off = bs_pos(bs) + off;
             break;
         case SEEK_END:
             off = bs->end * 8 - off;
@@ -124,29 +250,13 @@ static inline void bs_seek( BITSTREAM *bs, off_t off, int whence)
         default:
             break;
     }
-    b = off >> 3;
-    if (b >= bs->end)
-    {
-        if (BF_BUF_SIZE < bs->end) {
-            bs->pos = bs->end - BF_BUF_SIZE;
-            fseek(bs->fp, BF_BUF_SIZE, SEEK_END);
-        } else {
-            bs->pos = 0;
-            fseek(bs->fp, 0, SEEK_SET);
-        }
-        bs->size = fread(bs->buf, 1, BF_BUF_SIZE, bs->fp);
-        bb_init(&bs->bb, bs->buf, bs->size);
-        bs->bb.p = bs->bb.p_end;
-    } else if (b < bs->pos || b >= (bs->pos + BF_BUF_SIZE)) {
-        fseek(bs->fp, b, SEEK_SET);
-        bs->pos = b;
-        bs->size = fread(bs->buf, 1, BF_BUF_SIZE, bs->fp);
-        bb_init(&bs->bb, bs->buf, bs->size);
-    } else {
-        b -= bs->pos;
-        bs->bb.p = &bs->bb.p_start[b];
-        bs->bb.i_left = 8 - (off & 0x07);
+    if (off < 0) {
+        off = 0;
+    } else if (off > bs->end * 8) {
+        off = bs->end * 8;
     }
+    bs->bb.p = &bs->bb.p_start[off >> 3];
+    bs->bb.i_left = 8 - (off & 0x07);
 }
 
 static inline void bb_seek_byte( BITBUFFER *bb, off_t off)
@@ -159,7 +269,40 @@ static inline void bs_seek_byte( BITSTREAM *s, off_t off)
     bs_seek(s, off << 3, SEEK_SET);
 }
 
-static inline uint32_t bb_read( BITBUFFER *bb, int i_count )
+/* Big endian loads from a possibly unaligned pointer.  memcpy keeps them
+ * legal on any alignment and compiles down to a single load. */
+static inline uint64_t _bb_load_be64( const uint8_t *p )
+{
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#elif !defined(__BYTE_ORDER__)
+    v = (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 | (uint64_t)p[2] << 40 |
+        (uint64_t)p[3] << 32 | (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16 |
+        (uint64_t)p[6] << 8  | (uint64_t)p[7];
+#endif
+    return v;
+}
+
+static inline uint32_t _bb_load_be32( const uint8_t *p )
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap32(v);
+#elif !defined(__BYTE_ORDER__)
+    v = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+#endif
+    return v;
+}
+
+/* Bit by bit reader, only used for the last few bytes of the buffer where
+ * a whole word can not be loaded.  Stops at the end of the buffer, the
+ * missing low bits read as zero. */
+static inline uint32_t _bb_read_slow( BITBUFFER *bb, int i_count )
 {
     static const uint32_t i_mask[33] = {  
         0x00,
@@ -203,19 +346,45 @@ static inline uint32_t bb_read( BITBUFFER *bb, int i_count )
     return( i_result );
 }
 
-static inline uint32_t bs_read( BITSTREAM *bs, int i_count )
+static inline uint32_t bb_read( BITBUFFER *bb, int i_count )
 {
-    int left;
-    int bytes = (i_count + 7) >> 3;
-
-    if (bs->bb.p + bytes >= bs->bb.p_end) {
-        bs->pos = bs->pos + (bs->bb.p - bs->bb.p_start);
-        left = bs->bb.i_left;
-        fseek(bs->fp, bs->pos, SEEK_SET);
-        bs->size = fread(bs->buf, 1, BF_BUF_SIZE, bs->fp);
-        bb_init(&bs->bb, bs->buf, bs->size);
-        bs->bb.i_left = left;
+    uint64_t w;
+    int      i_used;
+
+    if( i_count <= 0 ) {
+        return 0;
+    }
+    if( bb->p_end - bb->p < 8 ) {
+        return _bb_read_slow( bb, i_count );
     }
+
+    /* Byte aligned fields are the common case in every BD structure */
+    if( bb->i_left == 8 ) {
+        switch( i_count ) {
+            case 8:
+                return *bb->p++;
+            case 16:
+                bb->p += 2;
+                return (uint32_t)bb->p[-2] << 8 | bb->p[-1];
+            case 32:
+                bb->p += 4;
+                return _bb_load_be32( bb->p - 4 );
+            default:
+                break;
+        }
+    }
+
+    /* At most 7 + 32 bits are needed, one 64 bit word always holds them */
+    i_used = 8 - bb->i_left;
+    w = _bb_load_be64( bb->p ) << i_used;
+    i_used += i_count;
+    bb->p += i_used >> 3;
+    bb->i_left = 8 - ( i_used & 0x07 );
+    return (uint32_t)( w >> ( 64 - i_count ) );
+}
+
+static inline uint32_t bs_read( BITSTREAM *bs, int i_count )
+{
     return bb_read(&bs->bb, i_count);
 }
 
@@ -223,6 +392,11 @@ static inline void bb_read_bytes( BITBUFFER *bb, uint8_t *buf, int i_count )
 {
     int ii;
 
+    if( bb->i_left == 8 && i_count > 0 && bb->p_end - bb->p >= i_count ) {
+        memcpy( buf, bb->p, i_count );
+        bb->p += i_count;
+        return;
+    }
     for (ii = 0; ii < i_count; ii++) {
         buf[ii] = bb_read(bb, 8);
     }
@@ -230,11 +404,7 @@ static inline void bb_read_bytes( BITBUFFER *bb, uint8_t *buf, int i_count )
 
 static inline void bs_read_bytes( BITSTREAM *s, uint8_t *buf, int i_count )
 {
-    int ii;
-
-    for (ii = 0; ii < i_count; ii++) {
-        buf[ii] = bs_read(s, 8);
-    }
+    bb_read_bytes(&s->bb, buf, i_count);
 }
 
 static inline uint32_t bb_show( BITBUFFER *bb, int i_count )
@@ -257,17 +427,6 @@ static inline void bb_skip( BITBUFFER *bb, ssize_t i_count )
 
 static inline void bs_skip( BITSTREAM *bs, ssize_t i_count )
 {
-    int left;
-    int bytes = i_count >> 3;
-
-    if (bs->bb.p + bytes >= bs->bb.p_end) {
-        bs->pos = bs->pos + (bs->bb.p - bs->bb.p_start);
-        left = bs->bb.i_left;
-        fseek(bs->fp, bs->pos, SEEK_SET);
-        bs->size = fread(bs->buf, 1, BF_BUF_SIZE, bs->fp);
-        bb_init(&bs->bb, bs->buf, bs->size);
-        bs->bb.i_left = left;
-    }
     bb_skip(&bs->bb, i_count);
 }
 
@@ -301,17 +460,6 @@ static inline void bb_write( BITBUFFER *bb, int i_count, uint32_t i_bits )
 
 static inline void bs_write( BITSTREAM *bs, int i_count, uint32_t i_bits )
 {
-    int left;
-    int bytes = (i_count + 7) >> 3;
-
-    if (bs->bb.p + bytes >= bs->bb.p_end) {
-        bs->pos = bs->pos + (bs->bb.p - bs->bb.p_start);
-        left = bs->bb.i_left;
-        fseek(bs->fp, bs->pos, SEEK_SET);
-        bs->size = fread(bs->buf, 1, BF_BUF_SIZE, bs->fp);
-        bb_init(&bs->bb, bs->buf, bs->size);
-        bs->bb.i_left = left;
-    }
     bb_write(&bs->bb, i_count, i_bits);
 }
 
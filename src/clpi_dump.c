@@ -0,0 +1,155 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "util.h"
+#include "clpi_parse.h"
+
+static int verbose;
+static int show_ep = 0;
+static double seek_seconds = -1.0;
+
+static void
+_show_clip(CLPI_CL *cl)
+{
+    int ii, jj;
+
+    indent_printf(0, "Clip Info:");
+    indent_printf(1, "Stream Type: %d", cl->clip.clip_stream_type);
+    indent_printf(1, "Application Type: %d", cl->clip.application_type);
+    indent_printf(1, "ATC Delta: %d", cl->clip.is_atc_delta);
+    indent_printf(1, "TS Recording Rate: %u", cl->clip.ts_recording_rate);
+    indent_printf(1, "Number Source Packets: %u", cl->clip.num_source_packets);
+    indent_printf(1, "Format Identifier: %.4s", cl->clip.format_id);
+
+    indent_printf(0, "Sequence Info:");
+    for (ii = 0; ii < cl->sequence.num_atc_seq; ii++) {
+        CLPI_ATC_SEQ *atc = &cl->sequence.atc_seq[ii];
+
+        indent_printf(1, "ATC Sequence %d: SPN start %u", ii, atc->spn_atc_start);
+        for (jj = 0; jj < atc->num_stc_seq; jj++) {
+            CLPI_STC_SEQ *stc = &atc->stc_seq[jj];
+
+            indent_printf(2, "STC Sequence %d: PCR PID %04x, SPN start %u, "
+                          "time %u - %u", jj + atc->offset_stc_id, stc->pcr_pid,
+                          stc->spn_stc_start, stc->presentation_start_time,
+                          stc->presentation_end_time);
+        }
+    }
+
+    indent_printf(0, "Program Info:");
+    for (ii = 0; ii < cl->program.num_prog; ii++) {
+        CLPI_PROG *prog = &cl->program.progs[ii];
+
+        indent_printf(1, "Program %d: SPN start %u, PMT PID %04x",
+                      ii, prog->spn_program_sequence_start, prog->program_map_pid);
+        for (jj = 0; jj < prog->num_streams; jj++) {
+            CLPI_PROG_STREAM *ss = &prog->streams[jj];
+
+            indent_printf(2, "PID %04x: coding %02x, format %d, rate %d, lang %.3s",
+                          ss->pid, ss->coding_type, ss->format, ss->rate,
+                          ss->lang[0] ? (char*)ss->lang : "---");
+        }
+    }
+}
+
+static void
+_show_cpi(CLPI_CL *cl)
+{
+    int ii;
+    uint32_t jj;
+
+    indent_printf(0, "CPI: type %d", cl->cpi.type);
+    for (ii = 0; ii < cl->cpi.num_stream_pid; ii++) {
+        CLPI_EP_MAP *ep = &cl->cpi.entry[ii];
+
+        indent_printf(1, "EP Map PID %04x: type %d, %u entries",
+                      ep->pid, ep->ep_stream_type, ep->num_ep);
+        if (seek_seconds >= 0.0) {
+            int idx = clpi_ep_find(ep, (uint64_t)(seek_seconds * 90000));
+
+            if (idx < 0) {
+                indent_printf(2, "%.3fs: before first entry", seek_seconds);
+            } else {
+                indent_printf(2, "%.3fs: entry %d, PTS %llu, SPN %u, byte %llu",
+                              seek_seconds, idx, (unsigned long long)ep->pts[idx],
+                              ep->spn[idx], (unsigned long long)ep->spn[idx] * 192);
+            }
+        }
+        if (show_ep) {
+            for (jj = 0; jj < ep->num_ep; jj++) {
+                indent_printf(2, "%6u: PTS %10llu (%10.3fs) SPN %u", jj,
+                              (unsigned long long)ep->pts[jj],
+                              ep->pts[jj] / 90000.0, ep->spn[jj]);
+            }
+        }
+    }
+}
+
+static void
+_usage(char *cmd)
+{
+    fprintf(stderr,
+"Usage: %s -vet <clpi file> [<clpi file> ...]\n"
+"With no options, produces clip, sequence and program info\n"
+"Options:\n"
+"    v             - Verbose output.\n"
+"    e             - List EP map entries\n"
+"    t <seconds>   - Show the EP map entry at or before <seconds>\n"
+, cmd);
+
+    exit(EXIT_FAILURE);
+}
+
+#define OPTS "vet:"
+
+int
+main(int argc, char *argv[])
+{
+    CLPI_CL *cl;
+    int opt;
+    int ii;
+
+    do {
+        opt = getopt(argc, argv, OPTS);
+        switch (opt) {
+            case -1:
+                break;
+
+            case 'v':
+                verbose = 1;
+                break;
+
+            case 'e':
+                show_ep = 1;
+                break;
+
+            case 't':
+                seek_seconds = atof(optarg);
+                break;
+
+            default:
+                _usage(argv[0]);
+                break;
+        }
+    } while (opt != -1);
+
+    if (optind >= argc) {
+        _usage(argv[0]);
+    }
+
+    for (ii = optind; ii < argc; ii++) {
+        cl = clpi_parse(argv[ii], verbose);
+        if (cl == NULL) {
+            fprintf(stderr, "Parse failed: %s\n", argv[ii]);
+            continue;
+        }
+        printf("%s:\n", argv[ii]);
+        _show_clip(cl);
+        _show_cpi(cl);
+        clpi_free(&cl);
+    }
+    return 0;
+}
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "util.h"
+#include "bits.h"
+#include "clpi_parse.h"
+
+#define CLPI_SIG1  ('H' << 24 | 'D' << 16 | 'M' << 8 | 'V')
+#define CLPI_SIG3  ('0' << 24 | '3' << 16 | '0' << 8 | '0')
+#define CLPI_SIG2A ('0' << 24 | '2' << 16 | '0' << 8 | '0')
+#define CLPI_SIG2B ('0' << 24 | '1' << 16 | '0' << 8 | '0')
+
+static void
+_human_readable_sig(char *sig, uint32_t s1, uint32_t s2)
+{
+    sig[0] = (s1 >> 24) & 0xFF;
+    sig[1] = (s1 >> 16) & 0xFF;
+    sig[2] = (s1 >>  8) & 0xFF;
+    sig[3] = (s1      ) & 0xFF;
+    sig[4] = (s2 >> 24) & 0xFF;
+    sig[5] = (s2 >> 16) & 0xFF;
+    sig[6] = (s2 >>  8) & 0xFF;
+    sig[7] = (s2      ) & 0xFF;
+    sig[8] = 0;
+}
+
+static int
+_parse_header(BITSTREAM *bits, CLPI_CL *cl)
+{
+    cl->type_indicator  = bs_read(bits, 32);
+    cl->type_indicator2 = bs_read(bits, 32);
+    if (cl->type_indicator != CLPI_SIG1 ||
+        (cl->type_indicator2 != CLPI_SIG2A &&
+         cl->type_indicator2 != CLPI_SIG2B &&
+         cl->type_indicator2 != CLPI_SIG3)) {
+
+        char sig[9];
+        char expect[9];
+
+        _human_readable_sig(sig, cl->type_indicator, cl->type_indicator2);
+        _human_readable_sig(expect, CLPI_SIG1, CLPI_SIG2A);
+        fprintf(stderr, "failed signature match, expected (%s) got (%s)\n",
+                expect, sig);
+        return 0;
+    }
+    cl->sequence_info_start_addr = bs_read(bits, 32);
+    cl->program_info_start_addr  = bs_read(bits, 32);
+    cl->cpi_start_addr           = bs_read(bits, 32);
+    cl->clip_mark_start_addr     = bs_read(bits, 32);
+    cl->ext_data_start_addr      = bs_read(bits, 32);
+    return 1;
+}
+
+static int
+_parse_clipinfo(BITSTREAM *bits, CLPI_CL *cl)
+{
+    int len;
+
+    // ClipInfo follows the 40 byte header
+    bs_seek_byte(bits, 40);
+    // Skip the length field and 2 reserved bytes
+    bs_skip(bits, 32 + 16);
+    cl->clip.clip_stream_type = bs_read(bits, 8);
+    cl->clip.application_type = bs_read(bits, 8);
+    // Skip reserved 31 bits
+    bs_skip(bits, 31);
+    cl->clip.is_atc_delta       = bs_read(bits, 1);
+    cl->clip.ts_recording_rate  = bs_read(bits, 32);
+    cl->clip.num_source_packets = bs_read(bits, 32);
+    // Skip 128 reserved bytes
+    bs_skip(bits, 128 * 8);
+
+    // TS_type_info_block, only the format identifier is of interest
+    len = bs_read(bits, 16);
+    if (len >= 5) {
+        // Skip validity flags
+        bs_skip(bits, 8);
+        bs_read_bytes(bits, cl->clip.format_id, 4);
+    }
+    return 1;
+}
+
+static int
+_parse_sequence(BITSTREAM *bits, CLPI_CL *cl)
+{
+    int ii, jj;
+    CLPI_ATC_SEQ *atc;
+
+    bs_seek_byte(bits, cl->sequence_info_start_addr);
+    // Skip the length field and a reserved byte
+    bs_skip(bits, 5 * 8);
+    cl->sequence.num_atc_seq = bs_read(bits, 8);
+
+    atc = calloc(cl->sequence.num_atc_seq, sizeof(CLPI_ATC_SEQ));
+    cl->sequence.atc_seq = atc;
+    for (ii = 0; ii < cl->sequence.num_atc_seq; ii++) {
+        atc[ii].spn_atc_start = bs_read(bits, 32);
+        atc[ii].num_stc_seq   = bs_read(bits, 8);
+        atc[ii].offset_stc_id = bs_read(bits, 8);
+
+        atc[ii].stc_seq = calloc(atc[ii].num_stc_seq, sizeof(CLPI_STC_SEQ));
+        for (jj = 0; jj < atc[ii].num_stc_seq; jj++) {
+            CLPI_STC_SEQ *stc = &atc[ii].stc_seq[jj];
+
+            stc->pcr_pid                 = bs_read(bits, 16);
+            stc->spn_stc_start           = bs_read(bits, 32);
+            stc->presentation_start_time = bs_read(bits, 32);
+            stc->presentation_end_time   = bs_read(bits, 32);
+        }
+    }
+    return 1;
+}
+
+static int
+_parse_stream_attr(BITSTREAM *bits, CLPI_PROG_STREAM *ss)
+{
+    int len;
+    int pos;
+
+    if (!bs_is_align(bits, 0x07)) {
+        fprintf(stderr, "_parse_stream_attr: Stream alignment error\n");
+    }
+    len = bs_read(bits, 8);
+    pos = bs_pos(bits) >> 3;
+
+    ss->coding_type = bs_read(bits, 8);
+    switch (ss->coding_type) {
+        case 0x01:
+        case 0x02:
+        case 0xea:
+        case 0x1b:
+        case 0x20:
+        case 0x24:
+            ss->format  = bs_read(bits, 4);
+            ss->rate    = bs_read(bits, 4);
+            ss->aspect  = bs_read(bits, 4);
+            bs_skip(bits, 2);
+            ss->oc_flag = bs_read(bits, 1);
+            break;
+
+        case 0x03:
+        case 0x04:
+        case 0x80:
+        case 0x81:
+        case 0x82:
+        case 0x83:
+        case 0x84:
+        case 0x85:
+        case 0x86:
+        case 0xa1:
+        case 0xa2:
+            ss->format = bs_read(bits, 4);
+            ss->rate   = bs_read(bits, 4);
+            bs_read_bytes(bits, ss->lang, 3);
+            break;
+
+        case 0x90:
+        case 0x91:
+        case 0xa0:
+            bs_read_bytes(bits, ss->lang, 3);
+            break;
+
+        case 0x92:
+            ss->char_code = bs_read(bits, 8);
+            bs_read_bytes(bits, ss->lang, 3);
+            break;
+
+        default:
+            fprintf(stderr, "unrecognized coding type %02x\n", ss->coding_type);
+            break;
+    };
+
+    bs_seek_byte(bits, pos + len);
+    return 1;
+}
+
+static int
+_parse_program(BITSTREAM *bits, CLPI_CL *cl)
+{
+    int ii, jj;
+    CLPI_PROG *progs;
+
+    bs_seek_byte(bits, cl->program_info_start_addr);
+    // Skip the length field and a reserved byte
+    bs_skip(bits, 5 * 8);
+    cl->program.num_prog = bs_read(bits, 8);
+
+    progs = calloc(cl->program.num_prog, sizeof(CLPI_PROG));
+    cl->program.progs = progs;
+    for (ii = 0; ii < cl->program.num_prog; ii++) {
+        progs[ii].spn_program_sequence_start = bs_read(bits, 32);
+        progs[ii].program_map_pid            = bs_read(bits, 16);
+        progs[ii].num_streams                = bs_read(bits, 8);
+        progs[ii].num_groups                 = bs_read(bits, 8);
+
+        progs[ii].streams = calloc(progs[ii].num_streams, sizeof(CLPI_PROG_STREAM));
+        for (jj = 0; jj < progs[ii].num_streams; jj++) {
+            progs[ii].streams[jj].pid = bs_read(bits, 16);
+            if (!_parse_stream_attr(bits, &progs[ii].streams[jj])) {
+                fprintf(stderr, "error parsing program stream\n");
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+typedef struct
+{
+    uint32_t        ref_ep_fine_id;
+    uint32_t        pts_ep;
+    uint32_t        spn_ep;
+} CLPI_EP_COARSE;
+
+static int
+_parse_ep_map_stream(BITSTREAM *bits, CLPI_EP_MAP *ep, uint32_t start,
+                     int num_coarse, int num_fine)
+{
+    CLPI_EP_COARSE *coarse;
+    uint32_t fine_start;
+    int ii, cc;
+
+    bs_seek_byte(bits, start);
+    fine_start = bs_read(bits, 32);
+
+    coarse = calloc(num_coarse ? num_coarse : 1, sizeof(CLPI_EP_COARSE));
+    for (ii = 0; ii < num_coarse; ii++) {
+        coarse[ii].ref_ep_fine_id = bs_read(bits, 18);
+        coarse[ii].pts_ep         = bs_read(bits, 14);
+        coarse[ii].spn_ep         = bs_read(bits, 32);
+    }
+
+    // Merge each fine entry with the coarse entry it hangs off
+    bs_seek_byte(bits, start + fine_start);
+    ep->num_ep = num_fine;
+    ep->pts = malloc(num_fine * sizeof(uint64_t));
+    ep->spn = malloc(num_fine * sizeof(uint32_t));
+    for (ii = 0, cc = 0; ii < num_fine; ii++) {
+        uint32_t pts_ep, spn_ep;
+
+        // Skip is_angle_change_point and I_end_position_offset
+        bs_skip(bits, 4);
+        pts_ep = bs_read(bits, 11);
+        spn_ep = bs_read(bits, 17);
+
+        while (cc + 1 < num_coarse && coarse[cc + 1].ref_ep_fine_id <= (uint32_t)ii) {
+            cc++;
+        }
+        ep->pts[ii] = ((uint64_t)(coarse[cc].pts_ep & ~0x01) << 19) +
+                      ((uint64_t)pts_ep << 9);
+        ep->spn[ii] = (coarse[cc].spn_ep & ~0x1FFFF) + spn_ep;
+    }
+    X_FREE(coarse);
+    return 1;
+}
+
+static int
+_parse_cpi(BITSTREAM *bits, CLPI_CL *cl)
+{
+    int ii;
+    uint32_t len, ep_map_pos;
+    uint32_t *start;
+    int *num_coarse, *num_fine;
+    CLPI_EP_MAP *entry;
+
+    bs_seek_byte(bits, cl->cpi_start_addr);
+    len = bs_read(bits, 32);
+    if (len == 0) {
+        return 1;
+    }
+    // Skip reserved 12 bits
+    bs_skip(bits, 12);
+    cl->cpi.type = bs_read(bits, 4);
+    ep_map_pos = bs_pos(bits) >> 3;
+
+    // EP_map starts here, skip a reserved byte
+    bs_skip(bits, 8);
+    cl->cpi.num_stream_pid = bs_read(bits, 8);
+
+    entry = calloc(cl->cpi.num_stream_pid, sizeof(CLPI_EP_MAP));
+    start = calloc(cl->cpi.num_stream_pid + 1, sizeof(uint32_t));
+    num_coarse = calloc(cl->cpi.num_stream_pid + 1, sizeof(int));
+    num_fine = calloc(cl->cpi.num_stream_pid + 1, sizeof(int));
+    cl->cpi.entry = entry;
+    for (ii = 0; ii < cl->cpi.num_stream_pid; ii++) {
+        entry[ii].pid = bs_read(bits, 16);
+        // Skip reserved 10 bits
+        bs_skip(bits, 10);
+        entry[ii].ep_stream_type = bs_read(bits, 4);
+        num_coarse[ii] = bs_read(bits, 16);
+        num_fine[ii]   = bs_read(bits, 18);
+        start[ii]      = bs_read(bits, 32) + ep_map_pos;
+    }
+    for (ii = 0; ii < cl->cpi.num_stream_pid; ii++) {
+        _parse_ep_map_stream(bits, &entry[ii], start[ii], num_coarse[ii], num_fine[ii]);
+    }
+    X_FREE(start);
+    X_FREE(num_coarse);
+    X_FREE(num_fine);
+    return 1;
+}
+
+// Index of the last EP entry at or before "pts" (90 kHz), -1 if "pts"
+// precedes the first entry.  Assumes a single STC sequence, for clips
+// with several restrict the search to the sequence's SPN range.
+int
+clpi_ep_find(const CLPI_EP_MAP *ep, uint64_t pts)
+{
+    int lo = 0, hi = ep->num_ep;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (ep->pts[mid] <= pts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+void
+clpi_free(CLPI_CL **p_cl)
+{
+    int ii;
+    CLPI_CL *cl = *p_cl;
+
+    if (cl == NULL) {
+        return;
+    }
+    for (ii = 0; ii < cl->sequence.num_atc_seq && cl->sequence.atc_seq; ii++) {
+        X_FREE(cl->sequence.atc_seq[ii].stc_seq);
+    }
+    X_FREE(cl->sequence.atc_seq);
+
+    for (ii = 0; ii < cl->program.num_prog && cl->program.progs; ii++) {
+        X_FREE(cl->program.progs[ii].streams);
+    }
+    X_FREE(cl->program.progs);
+
+    for (ii = 0; ii < cl->cpi.num_stream_pid && cl->cpi.entry; ii++) {
+        X_FREE(cl->cpi.entry[ii].pts);
+        X_FREE(cl->cpi.entry[ii].spn);
+    }
+    X_FREE(cl->cpi.entry);
+
+    X_FREE(*p_cl);
+}
+
+CLPI_CL*
+clpi_parse(char *path, int verbose)
+{
+    BITSTREAM  bits;
+    CLPI_CL   *cl;
+
+    cl = calloc(1, sizeof(CLPI_CL));
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    if (bs_open(&bits, path) < 0) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        X_FREE(cl);
+        return NULL;
+    }
+
+    if (!_parse_header(&bits, cl) ||
+        !_parse_clipinfo(&bits, cl) ||
+        !_parse_sequence(&bits, cl) ||
+        !_parse_program(&bits, cl) ||
+        !_parse_cpi(&bits, cl)) {
+
+        bs_close(&bits);
+        clpi_free(&cl);
+        return NULL;
+    }
+    if (verbose && cl->cpi.type != 1) {
+        fprintf(stderr, "CPI type %d is not an EP map\n", cl->cpi.type);
+    }
+    bs_close(&bits);
+    return cl;
+}
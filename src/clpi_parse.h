@@ -0,0 +1,105 @@
+#if !defined(_CLPI_PARSE_H_)
+#define _CLPI_PARSE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+typedef struct
+{
+    uint16_t        pcr_pid;
+    uint32_t        spn_stc_start;
+    uint32_t        presentation_start_time;
+    uint32_t        presentation_end_time;
+} CLPI_STC_SEQ;
+
+typedef struct
+{
+    uint32_t        spn_atc_start;
+    uint8_t         num_stc_seq;
+    uint8_t         offset_stc_id;
+    CLPI_STC_SEQ   *stc_seq;
+} CLPI_ATC_SEQ;
+
+typedef struct
+{
+    uint8_t         num_atc_seq;
+    CLPI_ATC_SEQ   *atc_seq;
+} CLPI_SEQ_INFO;
+
+typedef struct
+{
+    uint16_t        pid;
+    uint8_t         coding_type;
+    uint8_t         format;
+    uint8_t         rate;
+    uint8_t         aspect;
+    uint8_t         oc_flag;
+    uint8_t         char_code;
+    uint8_t         lang[3];
+} CLPI_PROG_STREAM;
+
+typedef struct
+{
+    uint32_t          spn_program_sequence_start;
+    uint16_t          program_map_pid;
+    uint8_t           num_streams;
+    uint8_t           num_groups;
+    CLPI_PROG_STREAM *streams;
+} CLPI_PROG;
+
+typedef struct
+{
+    uint8_t         num_prog;
+    CLPI_PROG      *progs;
+} CLPI_PROG_INFO;
+
+// EP map of one elementary stream, flattened from the coarse/fine tables.
+// Entries are in SPN order, which is also PTS order inside one STC
+// sequence, so time to byte offset lookups are a binary search.
+typedef struct
+{
+    uint16_t        pid;
+    uint8_t         ep_stream_type;
+    uint32_t        num_ep;
+    uint64_t       *pts;        // 90 kHz, 33 bits
+    uint32_t       *spn;        // source packet number, 192 bytes each
+} CLPI_EP_MAP;
+
+typedef struct
+{
+    uint8_t         type;
+    uint8_t         num_stream_pid;
+    CLPI_EP_MAP    *entry;
+} CLPI_CPI;
+
+typedef struct
+{
+    uint8_t         clip_stream_type;
+    uint8_t         application_type;
+    uint8_t         is_atc_delta;
+    uint32_t        ts_recording_rate;
+    uint32_t        num_source_packets;
+    uint8_t         format_id[4];
+} CLPI_CLIP_INFO;
+
+typedef struct
+{
+    uint32_t        type_indicator;
+    uint32_t        type_indicator2;
+    uint32_t        sequence_info_start_addr;
+    uint32_t        program_info_start_addr;
+    uint32_t        cpi_start_addr;
+    uint32_t        clip_mark_start_addr;
+    uint32_t        ext_data_start_addr;
+    CLPI_CLIP_INFO  clip;
+    CLPI_SEQ_INFO   sequence;
+    CLPI_PROG_INFO  program;
+    CLPI_CPI        cpi;
+} CLPI_CL;
+
+
+CLPI_CL* clpi_parse(char *path, int verbose);
+void clpi_free(CLPI_CL **cl);
+int clpi_ep_find(const CLPI_EP_MAP *ep, uint64_t pts);
+
+#endif // _CLPI_PARSE_H_
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "bits.h"
+#include "index_parse.h"
+
+#define INDX_SIG1  ('I' << 24 | 'N' << 16 | 'D' << 8 | 'X')
+#define INDX_SIG2A ('0' << 24 | '1' << 16 | '0' << 8 | '0')
+#define INDX_SIG2B ('0' << 24 | '2' << 16 | '0' << 8 | '0')
+#define INDX_SIG3  ('0' << 24 | '3' << 16 | '0' << 8 | '0')
+
+// Size of one first play, top menu or title entry
+#define INDX_OBJ_SIZE  12
+
+static int
+_parse_header(BITSTREAM *bits, INDX_ROOT *index)
+{
+    index->type_indicator  = bs_read(bits, 32);
+    index->type_indicator2 = bs_read(bits, 32);
+    if (index->type_indicator != INDX_SIG1 ||
+        (index->type_indicator2 != INDX_SIG2A &&
+         index->type_indicator2 != INDX_SIG2B &&
+         index->type_indicator2 != INDX_SIG3)) {
+        return 0;
+    }
+    index->indexes_start_addr  = bs_read(bits, 32);
+    index->ext_data_start_addr = bs_read(bits, 32);
+    return 1;
+}
+
+// The part after the 32 bits of object type and flags
+static void
+_parse_obj(BITSTREAM *bits, INDX_OBJ *obj)
+{
+    obj->playback_type = bs_read(bits, 2);
+    bs_skip(bits, 14);
+    switch (obj->object_type) {
+        case INDX_OBJECT_HDMV:
+            obj->id_ref = bs_read(bits, 16);
+            bs_skip(bits, 32);
+            break;
+
+        case INDX_OBJECT_BDJ:
+            bs_read_bytes(bits, (uint8_t*)obj->bdj_name, 5);
+            obj->bdj_name[5] = 0;
+            bs_skip(bits, 8);
+            break;
+
+        default:
+            bs_skip(bits, 48);
+            break;
+    }
+}
+
+static int
+_parse_index(BITSTREAM *bits, INDX_ROOT *index)
+{
+    uint32_t len;
+    int ii;
+
+    if (index->indexes_start_addr + 4 > (uint32_t)bits->end) {
+        return 0;
+    }
+    bs_seek_byte(bits, index->indexes_start_addr);
+    len = bs_read(bits, 32);
+    if (len < 2 * INDX_OBJ_SIZE + 2 || len > bits->end - index->indexes_start_addr - 4) {
+        return 0;
+    }
+
+    index->first_play.object_type = bs_read(bits, 2);
+    bs_skip(bits, 30);
+    _parse_obj(bits, &index->first_play);
+    index->top_menu.object_type = bs_read(bits, 2);
+    bs_skip(bits, 30);
+    _parse_obj(bits, &index->top_menu);
+
+    index->num_titles = bs_read(bits, 16);
+    if ((uint32_t)index->num_titles * INDX_OBJ_SIZE > len - 2 * INDX_OBJ_SIZE - 2) {
+        return 0;
+    }
+    index->titles = calloc(index->num_titles ? index->num_titles : 1, sizeof(INDX_OBJ));
+    if (index->titles == NULL) {
+        return 0;
+    }
+    for (ii = 0; ii < index->num_titles; ii++) {
+        index->titles[ii].object_type = bs_read(bits, 2);
+        index->titles[ii].access_type = bs_read(bits, 2);
+        bs_skip(bits, 28);
+        _parse_obj(bits, &index->titles[ii]);
+    }
+    return 1;
+}
+
+void
+indx_free(INDX_ROOT **p_index)
+{
+    INDX_ROOT *index = *p_index;
+
+    if (index == NULL) {
+        return;
+    }
+    X_FREE(index->titles);
+    X_FREE(*p_index);
+}
+
+static INDX_ROOT*
+_indx_parse(BITSTREAM *bits)
+{
+    INDX_ROOT *index;
+
+    index = calloc(1, sizeof(INDX_ROOT));
+    if (index == NULL) {
+        return NULL;
+    }
+    if (bits->end < 16 ||
+        !_parse_header(bits, index) ||
+        !_parse_index(bits, index)) {
+        indx_free(&index);
+        return NULL;
+    }
+    return index;
+}
+
+INDX_ROOT*
+indx_parse_buffer(const uint8_t *buf, size_t len)
+{
+    BITSTREAM bits;
+
+    bs_init_buf(&bits, buf, len);
+    return _indx_parse(&bits);
+}
+
+INDX_ROOT*
+indx_parse(const char *path)
+{
+    BITSTREAM  bits;
+    INDX_ROOT *index;
+
+    if (bs_open(&bits, path) < 0) {
+        return NULL;
+    }
+    index = _indx_parse(&bits);
+    bs_close(&bits);
+    return index;
+}
@@ -0,0 +1,36 @@
+#if !defined(_INDEX_PARSE_H_)
+#define _INDEX_PARSE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Object types of the index.bdmv entries
+#define INDX_OBJECT_HDMV    1
+#define INDX_OBJECT_BDJ     2
+
+typedef struct
+{
+    uint8_t         object_type;
+    uint8_t         access_type;    // titles only
+    uint8_t         playback_type;
+    uint16_t        id_ref;         // HDMV: MovieObject.bdmv object number
+    char            bdj_name[6];    // BD-J: BDJO file name
+} INDX_OBJ;
+
+typedef struct
+{
+    uint32_t        type_indicator;
+    uint32_t        type_indicator2;
+    uint32_t        indexes_start_addr;
+    uint32_t        ext_data_start_addr;
+    INDX_OBJ        first_play;
+    INDX_OBJ        top_menu;
+    uint16_t        num_titles;
+    INDX_OBJ       *titles;
+} INDX_ROOT;
+
+INDX_ROOT* indx_parse(const char *path);
+INDX_ROOT* indx_parse_buffer(const uint8_t *buf, size_t len);
+void indx_free(INDX_ROOT **index);
+
+#endif // _INDEX_PARSE_H_
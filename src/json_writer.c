@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "util.h"
+#include "json_writer.h"
+
+int
+json_init(json_writer_t *jw, FILE *fp, size_t size)
+{
+    memset(jw, 0, sizeof(*jw));
+    jw->buf = malloc(size);
+    if (jw->buf == NULL) {
+        return -1;
+    }
+    jw->fp = fp;
+    jw->alloc = size;
+    return 0;
+}
+
+void
+json_flush(json_writer_t *jw)
+{
+    if (jw->len) {
+        fwrite(jw->buf, 1, jw->len, jw->fp);
+        jw->len = 0;
+    }
+    fflush(jw->fp);
+}
+
+void
+json_free(json_writer_t *jw)
+{
+    if (jw->buf != NULL) {
+        json_flush(jw);
+    }
+    X_FREE(jw->buf);
+    jw->buf = NULL;
+    jw->len = 0;
+    jw->alloc = 0;
+}
+
+// Makes room for "len" more bytes, flushing the buffer when it is full
+static char*
+_reserve(json_writer_t *jw, size_t len)
+{
+    if (jw->len + len > jw->alloc) {
+        fwrite(jw->buf, 1, jw->len, jw->fp);
+        jw->len = 0;
+        if (len > jw->alloc) {
+            char *buf = realloc(jw->buf, len);
+            if (buf == NULL) {
+                return NULL;
+            }
+            jw->buf = buf;
+            jw->alloc = len;
+        }
+    }
+    return jw->buf + jw->len;
+}
+
+static void
+_put(json_writer_t *jw, const char *str, size_t len)
+{
+    char *p = _reserve(jw, len);
+
+    if (p != NULL) {
+        memcpy(p, str, len);
+        jw->len += len;
+    }
+}
+
+// Length of the well formed UTF-8 sequence at "s", 0 when there is none:
+// no overlong forms, surrogates or code points past U+10FFFF
+static size_t
+_utf8_len(const uint8_t *s, size_t left)
+{
+    size_t len, ii;
+    uint32_t cp;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        len = 2;
+        cp = s[0] & 0x1f;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        len = 3;
+        cp = s[0] & 0x0f;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        len = 4;
+        cp = s[0] & 0x07;
+    } else {
+        return 0;
+    }
+    if (len > left) {
+        return 0;
+    }
+    for (ii = 1; ii < len; ii++) {
+        if ((s[ii] & 0xc0) != 0x80) {
+            return 0;
+        }
+        cp = cp << 6 | (s[ii] & 0x3f);
+    }
+    if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000) ||
+        (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+        return 0;
+    }
+    return len;
+}
+
+// Names from Latin-1 or Shift JIS rips are not UTF-8, their stray bytes
+// are escaped as the Latin-1 character of the same value so the line
+// stays valid JSON
+static void
+_put_quoted(json_writer_t *jw, const char *str, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    // Worst case every byte becomes \u00XX
+    char *p = _reserve(jw, len * 6 + 2);
+    char *start = p;
+    size_t ii, seq;
+
+    if (p == NULL) {
+        return;
+    }
+    *p++ = '"';
+    for (ii = 0; ii < len; ii++) {
+        uint8_t c = str[ii];
+
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c >= 0x80 && (seq = _utf8_len((const uint8_t*)str + ii, len - ii)) > 0) {
+            memcpy(p, str + ii, seq);
+            p += seq;
+            ii += seq - 1;
+        } else if (c < 0x20 || c >= 0x80) {
+            *p++ = '\\';
+            *p++ = 'u';
+            *p++ = '0';
+            *p++ = '0';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 0x0f];
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+    jw->len += p - start;
+}
+
+// Separator and member name in front of every value
+static void
+_begin_value(json_writer_t *jw, const char *key)
+{
+    if (jw->has_items[jw->depth]) {
+        _put(jw, ",", 1);
+    }
+    jw->has_items[jw->depth] = 1;
+    if (key != NULL) {
+        _put_quoted(jw, key, strlen(key));
+        _put(jw, ":", 1);
+    }
+}
+
+static void
+_open(json_writer_t *jw, const char *key, const char *bracket)
+{
+    _begin_value(jw, key);
+    _put(jw, bracket, 1);
+    if (jw->depth < JSON_MAX_DEPTH - 1) {
+        jw->depth++;
+    }
+    jw->has_items[jw->depth] = 0;
+}
+
+static void
+_close(json_writer_t *jw, const char *bracket)
+{
+    if (jw->depth > 0) {
+        jw->depth--;
+    }
+    _put(jw, bracket, 1);
+}
+
+void
+json_object_begin(json_writer_t *jw, const char *key)
+{
+    _open(jw, key, "{");
+}
+
+void
+json_object_end(json_writer_t *jw)
+{
+    _close(jw, "}");
+}
+
+void
+json_array_begin(json_writer_t *jw, const char *key)
+{
+    _open(jw, key, "[");
+}
+
+void
+json_array_end(json_writer_t *jw)
+{
+    _close(jw, "]");
+}
+
+void
+json_stringn(json_writer_t *jw, const char *key, const char *val, size_t len)
+{
+    _begin_value(jw, key);
+    _put_quoted(jw, val, len);
+}
+
+void
+json_string(json_writer_t *jw, const char *key, const char *val)
+{
+    if (val == NULL) {
+        json_null(jw, key);
+        return;
+    }
+    json_stringn(jw, key, val, strlen(val));
+}
+
+void
+json_int(json_writer_t *jw, const char *key, int64_t val)
+{
+    char num[24];
+
+    _begin_value(jw, key);
+    _put(jw, num, snprintf(num, sizeof(num), "%lld", (long long)val));
+}
+
+void
+json_uint(json_writer_t *jw, const char *key, uint64_t val)
+{
+    char num[24];
+
+    _begin_value(jw, key);
+    _put(jw, num, snprintf(num, sizeof(num), "%llu", (unsigned long long)val));
+}
+
+void
+json_fixed(json_writer_t *jw, const char *key, double val, int decimals)
+{
+    char num[64];
+    int len;
+
+    _begin_value(jw, key);
+    len = snprintf(num, sizeof(num), "%.*f", decimals, val);
+    if (!isfinite(val) || len < 0 || len >= (int)sizeof(num)) {
+        _put(jw, "null", 4);
+        return;
+    }
+    _put(jw, num, len);
+}
+
+void
+json_bool(json_writer_t *jw, const char *key, int val)
+{
+    _begin_value(jw, key);
+    if (val) {
+        _put(jw, "true", 4);
+    } else {
+        _put(jw, "false", 5);
+    }
+}
+
+void
+json_null(json_writer_t *jw, const char *key)
+{
+    _begin_value(jw, key);
+    _put(jw, "null", 4);
+}
+
+// Terminates a top level value, one record per line
+void
+json_end_record(json_writer_t *jw)
+{
+    _put(jw, "\n", 1);
+    jw->depth = 0;
+    jw->has_items[0] = 0;
+}
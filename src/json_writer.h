@@ -0,0 +1,40 @@
+#if !defined(_JSON_WRITER_H_)
+#define _JSON_WRITER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define JSON_MAX_DEPTH  16
+
+// Streaming JSON writer.  Output is collected in one large buffer and
+// only written to "fp" when the buffer fills up or on json_flush(), so
+// a record costs no more than a memcpy per value.  "key" is the member
+// name inside objects and NULL inside arrays and at the top level.
+typedef struct
+{
+    FILE           *fp;
+    char           *buf;
+    size_t          len;
+    size_t          alloc;
+    int             depth;
+    uint8_t         has_items[JSON_MAX_DEPTH];
+} json_writer_t;
+
+int json_init(json_writer_t *jw, FILE *fp, size_t size);
+void json_flush(json_writer_t *jw);
+void json_free(json_writer_t *jw);
+
+void json_object_begin(json_writer_t *jw, const char *key);
+void json_object_end(json_writer_t *jw);
+void json_array_begin(json_writer_t *jw, const char *key);
+void json_array_end(json_writer_t *jw);
+void json_string(json_writer_t *jw, const char *key, const char *val);
+void json_stringn(json_writer_t *jw, const char *key, const char *val, size_t len);
+void json_int(json_writer_t *jw, const char *key, int64_t val);
+void json_uint(json_writer_t *jw, const char *key, uint64_t val);
+void json_fixed(json_writer_t *jw, const char *key, double val, int decimals);
+void json_bool(json_writer_t *jw, const char *key, int val);
+void json_null(json_writer_t *jw, const char *key);
+void json_end_record(json_writer_t *jw);
+
+#endif // _JSON_WRITER_H_
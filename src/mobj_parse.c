@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "bits.h"
+#include "mobj_parse.h"
+
+#define MOBJ_SIG1  ('M' << 24 | 'O' << 16 | 'B' << 8 | 'J')
+#define MOBJ_SIG2A ('0' << 24 | '1' << 16 | '0' << 8 | '0')
+#define MOBJ_SIG2B ('0' << 24 | '2' << 16 | '0' << 8 | '0')
+#define MOBJ_SIG3  ('0' << 24 | '3' << 16 | '0' << 8 | '0')
+
+#define MOBJ_CMD_SIZE  12
+
+// Fields of the instruction word
+#define INSN_GROUP(i)       (((i) >> 27) & 0x03)
+#define INSN_SUB_GROUP(i)   (((i) >> 24) & 0x07)
+#define INSN_IMM_OP1(i)     (((i) >> 23) & 0x01)
+#define INSN_IMM_OP2(i)     (((i) >> 22) & 0x01)
+#define INSN_BRANCH_OPT(i)  (((i) >> 16) & 0x0f)
+#define INSN_SET_OPT(i)     ((i) & 0x1f)
+
+#define GROUP_BRANCH        0
+#define GROUP_SET           2
+
+#define BRANCH_JUMP         1
+#define BRANCH_PLAY         2
+#define SET_SET             0
+
+#define JUMP_OBJECT         0
+#define JUMP_TITLE          1
+#define CALL_OBJECT         2
+#define CALL_TITLE          3
+#define PLAY_PL             0
+#define PLAY_PL_PI          1
+#define PLAY_PL_PM          2
+#define SET_MOVE            1
+#define SET_SWAP            2
+
+// A register operand, PSRs have the top bit set
+#define REG_PSR             0x80000000
+#define NUM_GPR             4096
+
+// Titles 1..n, plus the two special title numbers of JumpTitle
+#define TITLE_TOP_MENU      0
+#define TITLE_FIRST_PLAY    0xffff
+
+// Playlist numbers are five digits
+#define MAX_PLAYLIST        99999
+
+// What an operand refers to
+#define REACH_OBJECT        0
+#define REACH_TITLE         1
+#define REACH_PLAYLIST      2
+
+static int
+_parse_header(BITSTREAM *bits, MOBJ_OBJECTS *mobj)
+{
+    mobj->type_indicator  = bs_read(bits, 32);
+    mobj->type_indicator2 = bs_read(bits, 32);
+    if (mobj->type_indicator != MOBJ_SIG1 ||
+        (mobj->type_indicator2 != MOBJ_SIG2A &&
+         mobj->type_indicator2 != MOBJ_SIG2B &&
+         mobj->type_indicator2 != MOBJ_SIG3)) {
+        return 0;
+    }
+    return 1;
+}
+
+static int
+_parse_objects(BITSTREAM *bits, MOBJ_OBJECTS *mobj)
+{
+    MOBJ_OBJECT *obj;
+    uint32_t len;
+    int ii, jj;
+
+    if (bits->end < 50) {
+        return 0;
+    }
+    bs_seek_byte(bits, 40);
+    len = bs_read(bits, 32);
+    if (len < 6 || len > bits->end - 44) {
+        return 0;
+    }
+    bs_skip(bits, 32);
+    mobj->num_objects = bs_read(bits, 16);
+    mobj->objects = calloc(mobj->num_objects ? mobj->num_objects : 1, sizeof(MOBJ_OBJECT));
+    if (mobj->objects == NULL) {
+        return 0;
+    }
+    for (ii = 0; ii < mobj->num_objects; ii++) {
+        obj = &mobj->objects[ii];
+        obj->resume_intention_flag = bs_read(bits, 1);
+        obj->menu_call_mask        = bs_read(bits, 1);
+        obj->title_search_mask     = bs_read(bits, 1);
+        bs_skip(bits, 13);
+        obj->num_cmds = bs_read(bits, 16);
+        if (bits->end - (bs_pos(bits) >> 3) < (off_t)obj->num_cmds * MOBJ_CMD_SIZE) {
+            return 0;
+        }
+        obj->cmds = calloc(obj->num_cmds ? obj->num_cmds : 1, sizeof(MOBJ_CMD));
+        if (obj->cmds == NULL) {
+            return 0;
+        }
+        for (jj = 0; jj < obj->num_cmds; jj++) {
+            obj->cmds[jj].insn = bs_read(bits, 32);
+            obj->cmds[jj].dst  = bs_read(bits, 32);
+            obj->cmds[jj].src  = bs_read(bits, 32);
+        }
+    }
+    return 1;
+}
+
+void
+mobj_free(MOBJ_OBJECTS **p_mobj)
+{
+    MOBJ_OBJECTS *mobj = *p_mobj;
+    int ii;
+
+    if (mobj == NULL) {
+        return;
+    }
+    for (ii = 0; ii < mobj->num_objects && mobj->objects; ii++) {
+        X_FREE(mobj->objects[ii].cmds);
+    }
+    X_FREE(mobj->objects);
+    X_FREE(*p_mobj);
+}
+
+static MOBJ_OBJECTS*
+_mobj_parse(BITSTREAM *bits)
+{
+    MOBJ_OBJECTS *mobj;
+
+    mobj = calloc(1, sizeof(MOBJ_OBJECTS));
+    if (mobj == NULL) {
+        return NULL;
+    }
+    if (!_parse_header(bits, mobj) ||
+        !_parse_objects(bits, mobj)) {
+        mobj_free(&mobj);
+        return NULL;
+    }
+    return mobj;
+}
+
+MOBJ_OBJECTS*
+mobj_parse_buffer(const uint8_t *buf, size_t len)
+{
+    BITSTREAM bits;
+
+    bs_init_buf(&bits, buf, len);
+    return _mobj_parse(&bits);
+}
+
+MOBJ_OBJECTS*
+mobj_parse(const char *path)
+{
+    BITSTREAM     bits;
+    MOBJ_OBJECTS *mobj;
+
+    if (bs_open(&bits, path) < 0) {
+        return NULL;
+    }
+    mobj = _mobj_parse(&bits);
+    bs_close(&bits);
+    return mobj;
+}
+
+typedef struct
+{
+    uint32_t       *item;
+    int             alloc;
+    int             count;
+} u32_list_t;
+
+// State of mobj_title_playlists()
+typedef struct
+{
+    const INDX_ROOT    *index;
+    const MOBJ_OBJECTS *mobj;
+    uint8_t             taint[NUM_GPR];     // written by more than immediate moves
+    u32_list_t          moves;              // GPR of each immediate move
+    u32_list_t          move_val;           // and the value moved
+    uint8_t            *seen;
+    u32_list_t          queue;
+    u32_list_t          playlists;
+    int                 failed;
+} mobj_reach_t;
+
+static void
+_list_add(mobj_reach_t *r, u32_list_t *list, uint32_t val)
+{
+    uint32_t *tmp;
+
+    if (list->count == list->alloc) {
+        tmp = realloc(list->item, (list->alloc ? 2 * list->alloc : 64) * sizeof(uint32_t));
+        if (tmp == NULL) {
+            r->failed = 1;
+            return;
+        }
+        list->item = tmp;
+        list->alloc = list->alloc ? 2 * list->alloc : 64;
+    }
+    list->item[list->count++] = val;
+}
+
+static void
+_taint(mobj_reach_t *r, uint32_t reg)
+{
+    if (!(reg & REG_PSR)) {
+        r->taint[reg % NUM_GPR] = 1;
+    }
+}
+
+// What every GPR can hold, flow insensitive over all the objects
+static void
+_collect_moves(mobj_reach_t *r)
+{
+    const MOBJ_CMD *cmd;
+    int ii, jj;
+
+    for (ii = 0; ii < r->mobj->num_objects; ii++) {
+        for (jj = 0; jj < r->mobj->objects[ii].num_cmds; jj++) {
+            cmd = &r->mobj->objects[ii].cmds[jj];
+            if (INSN_GROUP(cmd->insn) != GROUP_SET || INSN_SUB_GROUP(cmd->insn) != SET_SET) {
+                continue;
+            }
+            if (INSN_SET_OPT(cmd->insn) == SET_MOVE && INSN_IMM_OP2(cmd->insn) &&
+                !(cmd->dst & REG_PSR)) {
+                _list_add(r, &r->moves, cmd->dst % NUM_GPR);
+                _list_add(r, &r->move_val, cmd->src);
+                continue;
+            }
+            _taint(r, cmd->dst);
+            if (INSN_SET_OPT(cmd->insn) == SET_SWAP) {
+                _taint(r, cmd->src);
+            }
+        }
+    }
+}
+
+static void
+_add_object(mobj_reach_t *r, uint32_t id)
+{
+    if (id < r->mobj->num_objects && !r->seen[id]) {
+        r->seen[id] = 1;
+        _list_add(r, &r->queue, id);
+    }
+}
+
+static void
+_add_title(mobj_reach_t *r, uint32_t title)
+{
+    const INDX_OBJ *obj;
+
+    if (title == TITLE_FIRST_PLAY) {
+        obj = &r->index->first_play;
+    } else if (title == TITLE_TOP_MENU) {
+        obj = &r->index->top_menu;
+    } else if (title <= r->index->num_titles) {
+        obj = &r->index->titles[title - 1];
+    } else {
+        return;
+    }
+    if (obj->object_type == INDX_OBJECT_HDMV) {
+        _add_object(r, obj->id_ref);
+    } else if (obj->object_type == INDX_OBJECT_BDJ) {
+        r->failed = 1;
+    }
+}
+
+static void
+_add_value(mobj_reach_t *r, int kind, uint32_t val)
+{
+    switch (kind) {
+        case REACH_OBJECT:
+            _add_object(r, val);
+            break;
+
+        case REACH_TITLE:
+            _add_title(r, val);
+            break;
+
+        case REACH_PLAYLIST:
+            if (val <= MAX_PLAYLIST) {
+                _list_add(r, &r->playlists, val);
+            }
+            break;
+    }
+}
+
+// An operand is an immediate or a GPR, which stands for every immediate
+// moved into it, or for its initial zero when nothing is
+static void
+_add_operand(mobj_reach_t *r, int kind, int imm, uint32_t op)
+{
+    int ii, found = 0;
+
+    if (imm) {
+        _add_value(r, kind, op);
+        return;
+    }
+    if ((op & REG_PSR) || r->taint[op % NUM_GPR]) {
+        r->failed = 1;
+        return;
+    }
+    for (ii = 0; ii < r->moves.count; ii++) {
+        if (r->moves.item[ii] == op % NUM_GPR) {
+            _add_value(r, kind, r->move_val.item[ii]);
+            found = 1;
+        }
+    }
+    if (!found) {
+        _add_value(r, kind, 0);
+    }
+}
+
+static void
+_walk_object(mobj_reach_t *r, const MOBJ_OBJECT *obj)
+{
+    const MOBJ_CMD *cmd;
+    int ii, opt;
+
+    for (ii = 0; ii < obj->num_cmds; ii++) {
+        cmd = &obj->cmds[ii];
+        if (INSN_GROUP(cmd->insn) != GROUP_BRANCH) {
+            continue;
+        }
+        opt = INSN_BRANCH_OPT(cmd->insn);
+        switch (INSN_SUB_GROUP(cmd->insn)) {
+            case BRANCH_JUMP:
+                if (opt == JUMP_OBJECT || opt == CALL_OBJECT) {
+                    _add_operand(r, REACH_OBJECT, INSN_IMM_OP1(cmd->insn), cmd->dst);
+                } else if (opt == JUMP_TITLE || opt == CALL_TITLE) {
+                    _add_operand(r, REACH_TITLE, INSN_IMM_OP1(cmd->insn), cmd->dst);
+                }
+                break;
+
+            case BRANCH_PLAY:
+                if (opt == PLAY_PL || opt == PLAY_PL_PI || opt == PLAY_PL_PM) {
+                    _add_operand(r, REACH_PLAYLIST, INSN_IMM_OP1(cmd->insn), cmd->dst);
+                }
+                break;
+        }
+    }
+}
+
+static int
+_u32_cmp(const void *a, const void *b)
+{
+    uint32_t va = *(const uint32_t*)a, vb = *(const uint32_t*)b;
+
+    return va < vb ? -1 : va > vb;
+}
+
+int
+mobj_title_playlists(const INDX_ROOT *index, const MOBJ_OBJECTS *mobj,
+                     uint32_t **playlists)
+{
+    mobj_reach_t *r;
+    int ii, count = 0;
+
+    *playlists = NULL;
+    r = calloc(1, sizeof(mobj_reach_t));
+    if (r == NULL) {
+        return -1;
+    }
+    r->index = index;
+    r->mobj = mobj;
+    r->seen = calloc(mobj->num_objects ? mobj->num_objects : 1, 1);
+    if (r->seen == NULL) {
+        free(r);
+        return -1;
+    }
+    _collect_moves(r);
+    for (ii = 0; ii < index->num_titles; ii++) {
+        _add_title(r, ii + 1);
+    }
+    for (ii = 0; ii < r->queue.count && !r->failed; ii++) {
+        _walk_object(r, &mobj->objects[r->queue.item[ii]]);
+    }
+
+    if (!r->failed) {
+        qsort(r->playlists.item, r->playlists.count, sizeof(uint32_t), _u32_cmp);
+        for (ii = 0; ii < r->playlists.count; ii++) {
+            if (count == 0 || r->playlists.item[ii] != r->playlists.item[count - 1]) {
+                r->playlists.item[count++] = r->playlists.item[ii];
+            }
+        }
+        *playlists = r->playlists.item;
+        r->playlists.item = NULL;
+    }
+    X_FREE(r->playlists.item);
+    X_FREE(r->queue.item);
+    X_FREE(r->moves.item);
+    X_FREE(r->move_val.item);
+    free(r->seen);
+    count = r->failed ? -1 : count;
+    free(r);
+    return count;
+}
@@ -0,0 +1,47 @@
+#if !defined(_MOBJ_PARSE_H_)
+#define _MOBJ_PARSE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "index_parse.h"
+
+// One HDMV navigation command, kept as read.  The instruction word packs
+// operand count, group, sub group, immediate flags and the options.
+typedef struct
+{
+    uint32_t        insn;
+    uint32_t        dst;
+    uint32_t        src;
+} MOBJ_CMD;
+
+typedef struct
+{
+    uint8_t         resume_intention_flag;
+    uint8_t         menu_call_mask;
+    uint8_t         title_search_mask;
+    uint16_t        num_cmds;
+    MOBJ_CMD       *cmds;
+} MOBJ_OBJECT;
+
+typedef struct
+{
+    uint32_t        type_indicator;
+    uint32_t        type_indicator2;
+    uint16_t        num_objects;
+    MOBJ_OBJECT    *objects;
+} MOBJ_OBJECTS;
+
+MOBJ_OBJECTS* mobj_parse(const char *path);
+MOBJ_OBJECTS* mobj_parse_buffer(const uint8_t *buf, size_t len);
+void mobj_free(MOBJ_OBJECTS **mobj);
+
+// Numbers of the playlists the titles of "index" can play, following the
+// jumps and calls between movie objects and titles.  Playlists played
+// through a register are resolved from the immediate values moved into
+// it anywhere on the disc.  Returns the count, sorted in "playlists" to
+// be released with free(), or -1 when a title is BD-J or a playlist can
+// not be worked out without running the commands.
+int mobj_title_playlists(const INDX_ROOT *index, const MOBJ_OBJECTS *mobj,
+                         uint32_t **playlists);
+
+#endif // _MOBJ_PARSE_H_
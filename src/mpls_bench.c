@@ -0,0 +1,574 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/wait.h>
+#endif
+#include "util.h"
+#include "bits.h"
+#include "mpls_parse.h"
+#include "mpls_show.h"
+#include "mpls_gen.h"
+#include "mpls_catalog.h"
+
+#if defined(_WIN32)
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+// Benchmark stages, each one timed over the whole corpus
+#define STAGE_PARSE   0
+#define STAGE_FILTER  1
+#define STAGE_EMIT    2
+#define STAGE_FREE    3
+#define STAGE_EARLY   4
+#define STAGE_EVENTS  5
+#define STAGE_COUNT   6
+
+static const char *stage_names[STAGE_COUNT] = {
+    "parse", "filter", "emit", "free", "parse -f", "events"
+};
+
+typedef struct {
+    uint8_t *buf;
+    size_t   len;
+} corpus_file_t;
+
+typedef struct {
+    corpus_file_t *file;
+    int            count;
+    uint64_t       bytes;
+    uint64_t       items;
+    uint64_t       marks;
+} corpus_t;
+
+static double
+_now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static int
+_corpus_add(corpus_t *corpus, uint8_t *buf, size_t len)
+{
+    corpus_file_t *file;
+
+    file = realloc(corpus->file, (corpus->count + 1) * sizeof(*file));
+    if (file == NULL) {
+        return -1;
+    }
+    corpus->file = file;
+    corpus->file[corpus->count].buf = buf;
+    corpus->file[corpus->count].len = len;
+    corpus->count++;
+    corpus->bytes += len;
+    return 0;
+}
+
+// Every tenth playlist repeats the previous one so the duplicate filter
+// has something to find
+static int
+_corpus_generate(corpus_t *corpus, int count, uint32_t seed)
+{
+    MPLS_GEN gen;
+    uint8_t *buf;
+    size_t len;
+    int ii;
+
+    for (ii = 0; ii < count; ii++) {
+        if (ii % 10 != 9) {
+            mpls_gen_random(&gen, &seed);
+        }
+        len = mpls_gen_size(&gen);
+        buf = malloc(len);
+        if (buf == NULL || mpls_gen(&gen, buf, len) != len ||
+            _corpus_add(corpus, buf, len) < 0) {
+            free(buf);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+_corpus_load(corpus_t *corpus, const char *path)
+{
+    BITSTREAM bs;
+    uint8_t *buf;
+
+    if (bs_open(&bs, path) < 0) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return -1;
+    }
+    buf = malloc(bs.end ? bs.end : 1);
+    if (buf == NULL) {
+        bs_close(&bs);
+        return -1;
+    }
+    memcpy(buf, bs.buf, bs.end);
+    if (_corpus_add(corpus, buf, bs.end) < 0) {
+        free(buf);
+        bs_close(&bs);
+        return -1;
+    }
+    bs_close(&bs);
+    return 0;
+}
+
+static int
+_corpus_save(corpus_t *corpus, const char *dir)
+{
+    str_t path = {0,};
+    FILE *fp;
+    int ii;
+
+    for (ii = 0; ii < corpus->count; ii++) {
+        str_printf(&path, "%s/%05d.mpls", dir, ii);
+        fp = fopen(path.buf, "wb");
+        if (fp == NULL) {
+            fprintf(stderr, "Failed to create %s\n", path.buf);
+            str_free(&path);
+            return -1;
+        }
+        fwrite(corpus->file[ii].buf, 1, corpus->file[ii].len, fp);
+        fclose(fp);
+        str_free(&path);
+    }
+    return 0;
+}
+
+static void
+_corpus_free(corpus_t *corpus)
+{
+    int ii;
+
+    for (ii = 0; ii < corpus->count; ii++) {
+        free(corpus->file[ii].buf);
+    }
+    X_FREE(corpus->file);
+    corpus->count = 0;
+}
+
+static int
+_count_mark(void *handle, int idx, const MPLS_PLM *plm)
+{
+    uint64_t *sum = handle;
+
+    *sum += plm->abs_start;
+    return 0;
+}
+
+// One pass of every stage over the corpus, times in seconds
+static int
+_bench_round(corpus_t *corpus, FILE *out, double *elapsed, int *kept)
+{
+    dump_opts_t opts;
+    dump_ctx_t ctx;
+    MPLS_FILTER filter;
+    MPLS_EVENTS mark_events = {NULL, NULL, NULL, _count_mark, NULL};
+    uint64_t mark_sum = 0;
+    MPLS_PL **pl;
+    double start;
+    int ii, err, failed = 0;
+
+    pl = calloc(corpus->count, sizeof(MPLS_PL*));
+    if (pl == NULL) {
+        return -1;
+    }
+    dump_opts_init(&opts);
+    opts.repeats = 2;
+    opts.dups = 1;
+    opts.seconds = 120;
+    dump_ctx_init(&ctx, &opts, out, out);
+
+    start = _now();
+    for (ii = 0; ii < corpus->count; ii++) {
+        pl[ii] = mpls_parse_buffer(corpus->file[ii].buf, corpus->file[ii].len, &err);
+    }
+    elapsed[STAGE_PARSE] = _now() - start;
+
+    // Same filters as mpls_dump -f, results are only counted so every
+    // playlist goes through the emit stage below
+    *kept = 0;
+    start = _now();
+    for (ii = 0; ii < corpus->count; ii++) {
+        if (pl[ii] == NULL) {
+            continue;
+        }
+        if (dump_filter_short(pl[ii], opts.seconds) &&
+            dump_filter_repeats(pl[ii], opts.repeats) &&
+            dump_filter_dup(&ctx, pl[ii])) {
+            (*kept)++;
+        }
+    }
+    elapsed[STAGE_FILTER] = _now() - start;
+
+    start = _now();
+    for (ii = 0; ii < corpus->count; ii++) {
+        if (pl[ii] != NULL) {
+            dump_show_warnings(&ctx, "bench", pl[ii]->warnings);
+            dump_show_marks(&ctx, "bench", pl[ii]);
+        }
+    }
+    fflush(out);
+    elapsed[STAGE_EMIT] = _now() - start;
+
+    start = _now();
+    for (ii = 0; ii < corpus->count; ii++) {
+        if (pl[ii] == NULL) {
+            failed++;
+        }
+        mpls_free(&pl[ii]);
+    }
+    elapsed[STAGE_FREE] = _now() - start;
+    dump_ctx_free(&ctx);
+
+    // Parse again with the filters pushed into the parser, the way
+    // mpls_dump -f runs without a cache
+    dump_ctx_init(&ctx, &opts, out, out);
+    dump_filter_init(&ctx, &filter);
+    start = _now();
+    for (ii = 0; ii < corpus->count; ii++) {
+        pl[ii] = mpls_parse_buffer_filter(corpus->file[ii].buf, corpus->file[ii].len,
+                                          &filter, &err);
+        if (pl[ii] != NULL) {
+            dump_filter_dup(&ctx, pl[ii]);
+            mpls_free(&pl[ii]);
+        }
+    }
+    elapsed[STAGE_EARLY] = _now() - start;
+    dump_ctx_free(&ctx);
+
+    // Event parse of the marks only, nothing is allocated
+    start = _now();
+    for (ii = 0; ii < corpus->count; ii++) {
+        mpls_parse_buffer_events(corpus->file[ii].buf, corpus->file[ii].len,
+                                 &mark_events, &mark_sum);
+    }
+    elapsed[STAGE_EVENTS] = _now() - start;
+    free(pl);
+    return failed;
+}
+
+static void
+_corpus_count(corpus_t *corpus)
+{
+    MPLS_PL *pl;
+    int ii, err;
+
+    corpus->items = 0;
+    corpus->marks = 0;
+    for (ii = 0; ii < corpus->count; ii++) {
+        pl = mpls_parse_buffer(corpus->file[ii].buf, corpus->file[ii].len, &err);
+        if (pl != NULL) {
+            corpus->items += pl->list_count;
+            corpus->marks += pl->mark_count;
+            mpls_free(&pl);
+        }
+    }
+}
+
+// Differential check of the word at a time bb_read() and the memcpy in
+// bb_read_bytes() against the bit by bit reader they replaced, which is
+// still used for the end of the buffer.  Random reads, byte reads, skips
+// and seeks run on two readers over the same random buffer, values and
+// positions must stay the same, also past the end.
+static int
+_check_bits(long ops, uint32_t seed)
+{
+    uint8_t buf[256] = {0}, got[24], want[24];
+    BITBUFFER fast, slow;
+    long ii;
+    int len = 0, jj, count;
+    uint32_t a, b;
+
+    bb_init(&fast, buf, 0);
+    bb_init(&slow, buf, 0);
+    for (ii = 0; ii < ops; ii++) {
+        if (ii % 64 == 0) {
+            len = 1 + mpls_gen_rand(&seed) % sizeof(buf);
+            for (jj = 0; jj < len; jj++) {
+                buf[jj] = mpls_gen_rand(&seed);
+            }
+            bb_init(&fast, buf, len);
+            bb_init(&slow, buf, len);
+        }
+        a = b = 0;
+        switch (mpls_gen_rand(&seed) % 8) {
+            case 0:
+                count = mpls_gen_rand(&seed) % (len / 2 + 1);
+                bb_read_bytes(&fast, got, count > 24 ? 24 : count);
+                for (jj = 0; jj < count && jj < 24; jj++) {
+                    want[jj] = _bb_read_slow(&slow, 8);
+                }
+                a = memcmp(got, want, jj) != 0;
+                break;
+
+            case 1:
+                count = mpls_gen_rand(&seed) % 80;
+                bb_skip(&fast, count);
+                bb_skip(&slow, count);
+                break;
+
+            case 2:
+                count = mpls_gen_rand(&seed) % (len * 8 + 1);
+                bb_seek(&fast, count, SEEK_SET);
+                bb_seek(&slow, count, SEEK_SET);
+                break;
+
+            default:
+                // Mostly the byte aligned sizes the fast path special cases
+                count = mpls_gen_rand(&seed) % 2 ? 8 << (mpls_gen_rand(&seed) % 3) :
+                                                 1 + mpls_gen_rand(&seed) % 32;
+                a = bb_read(&fast, count);
+                b = _bb_read_slow(&slow, count);
+                break;
+        }
+        if (a != b || fast.p != slow.p || fast.i_left != slow.i_left) {
+            fprintf(stderr, "Bit reader mismatch at operation %ld\n", ii);
+            return -1;
+        }
+    }
+    printf("%ld bit reader operations checked\n", ops);
+    return 0;
+}
+
+#define CHECK_WRITERS  8
+#define CHECK_CYCLES   50
+#define CHECK_RECORDS  20
+
+// Several processes share a catalog the way separate mpls_dump runs do:
+// each one opens it, adds records and closes it, again and again.  Every
+// record must be found afterwards, none lost to another writer.
+static int
+_check_catalog(const char *path)
+{
+#if !defined(_WIN32)
+    MPLS_CATALOG *catalog;
+    MPLS_CATALOG_ENTRY entry, found;
+    char name[32];
+    int ww, cc, rr, status, failed = 0, total, count = 0;
+
+    unlink(path);
+    for (ww = 0; ww < CHECK_WRITERS; ww++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            fprintf(stderr, "Failed to start catalog writer\n");
+            failed = 1;
+            break;
+        }
+        if (pid > 0) {
+            continue;
+        }
+        for (cc = 0; cc < CHECK_CYCLES; cc++) {
+            catalog = mpls_catalog_open(path);
+            if (catalog == NULL) {
+                _exit(EXIT_FAILURE);
+            }
+            for (rr = 0; rr < CHECK_RECORDS; rr++) {
+                snprintf(name, sizeof(name), "%d_%d_%d.mpls", ww, cc, rr);
+                entry.content   = hash64(0, (uint8_t*)name, strlen(name));
+                entry.structure = entry.content;
+                entry.duration  = rr;
+                entry.disc      = "check";
+                entry.name      = name;
+                mpls_catalog_add(catalog, &entry);
+            }
+            if (mpls_catalog_close(catalog) < 0) {
+                _exit(EXIT_FAILURE);
+            }
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            failed = 1;
+        }
+    }
+
+    total = CHECK_WRITERS * CHECK_CYCLES * CHECK_RECORDS;
+    catalog = mpls_catalog_open(path);
+    for (ww = 0; catalog != NULL && ww < CHECK_WRITERS; ww++) {
+        for (cc = 0; cc < CHECK_CYCLES; cc++) {
+            for (rr = 0; rr < CHECK_RECORDS; rr++) {
+                snprintf(name, sizeof(name), "%d_%d_%d.mpls", ww, cc, rr);
+                entry.content   = hash64(0, (uint8_t*)name, strlen(name));
+                entry.structure = entry.content;
+                entry.disc      = "check";
+                entry.name      = name;
+                if (mpls_catalog_lookup(catalog, &entry, &found) == MPLS_CATALOG_SELF) {
+                    count++;
+                }
+            }
+        }
+    }
+    mpls_catalog_close(catalog);
+    unlink(path);
+    printf("%d of %d catalog records found after %d writers\n", count, total, CHECK_WRITERS);
+    return failed || count != total ? -1 : 0;
+#else
+    fprintf(stderr, "The catalog check is not available on this platform\n");
+    return -1;
+#endif
+}
+
+static void
+_usage(char *cmd)
+{
+    fprintf(stderr,
+"Usage: %s [-n <files>] [-s <seed>] [-r <rounds>] [-o <dir>] [-b <ops>] [-w <file>] [<mpls file> ...]\n"
+"Times parsing, filtering and output of a playlist corpus held in memory,\n"
+"parsing with the -f filters applied by the parser and an event parse of\n"
+"the marks.\n"
+"With no files, a synthetic corpus is generated.\n"
+"Options:\n"
+"    n <files>     - Number of synthetic playlists (default 500)\n"
+"    s <seed>      - Generator seed (default 1)\n"
+"    r <rounds>    - Passes over the corpus, the fastest is reported (default 5)\n"
+"    o <dir>       - Write the synthetic corpus to <dir> and exit\n"
+"    b <ops>       - Check the bit reader against the bit by bit one with\n"
+"                    <ops> random operations (seeded by -s) and exit\n"
+"    w <file>      - Check that writers sharing a catalog in <file> lose no\n"
+"                    record and exit, <file> is removed\n"
+, cmd);
+
+    exit(EXIT_FAILURE);
+}
+
+#define OPTS "n:s:r:o:b:w:"
+
+int
+main(int argc, char *argv[])
+{
+    corpus_t corpus = {0,};
+    double best[STAGE_COUNT], elapsed[STAGE_COUNT];
+    int count = 500, rounds = 5;
+    uint32_t seed = 1;
+    char *outdir = NULL, *check_catalog = NULL;
+    long check_ops = 0;
+    FILE *out;
+    int opt, ii, jj, kept = 0, failed = 0;
+
+    do {
+        opt = getopt(argc, argv, OPTS);
+        switch (opt) {
+            case -1:
+                break;
+
+            case 'n':
+                count = atoi(optarg);
+                break;
+
+            case 's':
+                seed = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+
+            case 'o':
+                outdir = optarg;
+                break;
+
+            case 'b':
+                check_ops = atol(optarg);
+                break;
+
+            case 'w':
+                check_catalog = optarg;
+                break;
+
+            default:
+                _usage(argv[0]);
+                break;
+        }
+    } while (opt != -1);
+
+    if (count < 1 || rounds < 1) {
+        _usage(argv[0]);
+    }
+    if (check_ops > 0) {
+        return _check_bits(check_ops, seed) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (check_catalog != NULL) {
+        return _check_catalog(check_catalog) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (optind < argc) {
+        for (ii = optind; ii < argc; ii++) {
+            if (_corpus_load(&corpus, argv[ii]) < 0) {
+                _corpus_free(&corpus);
+                return EXIT_FAILURE;
+            }
+        }
+    } else if (_corpus_generate(&corpus, count, seed) < 0) {
+        fprintf(stderr, "Failed to generate the corpus\n");
+        _corpus_free(&corpus);
+        return EXIT_FAILURE;
+    }
+
+    if (outdir != NULL) {
+        ii = _corpus_save(&corpus, outdir);
+        _corpus_free(&corpus);
+        return ii < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    out = fopen(NULL_DEVICE, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Failed to open %s\n", NULL_DEVICE);
+        _corpus_free(&corpus);
+        return EXIT_FAILURE;
+    }
+
+    _corpus_count(&corpus);
+    for (ii = 0; ii < rounds; ii++) {
+        failed = _bench_round(&corpus, out, elapsed, &kept);
+        if (failed < 0) {
+            fprintf(stderr, "Out of memory\n");
+            break;
+        }
+        for (jj = 0; jj < STAGE_COUNT; jj++) {
+            if (ii == 0 || elapsed[jj] < best[jj]) {
+                best[jj] = elapsed[jj];
+            }
+        }
+    }
+    fclose(out);
+
+    printf("Corpus: %d files, %.1f MB, %llu play items, %llu marks\n",
+           corpus.count, corpus.bytes / 1e6,
+           (unsigned long long)corpus.items, (unsigned long long)corpus.marks);
+    printf("        %d failed to parse, %d kept by -f, best of %d rounds\n",
+           failed, kept, rounds);
+    printf("%-8s %12s %10s %12s\n", "Stage", "files/s", "MB/s", "ns/item");
+    for (jj = 0; jj < STAGE_COUNT && failed >= 0; jj++) {
+        double t = best[jj] > 0.0 ? best[jj] : 1e-9;
+
+        printf("%-8s %12.0f %10.1f %12.1f\n", stage_names[jj],
+               corpus.count / t, corpus.bytes / 1e6 / t,
+               corpus.items ? t * 1e9 / corpus.items : 0.0);
+    }
+    _corpus_free(&corpus);
+    return failed < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
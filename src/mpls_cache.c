@@ -0,0 +1,578 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "util.h"
+#include "bits.h"
+#include "mpls_cache.h"
+
+/*
+ * Cache file layout.  Everything is in host byte order and every record
+ * starts on an 8 byte boundary so the file can be used straight from the
+ * mapping:
+ *
+ *   MPLS_CACHE_HDR
+ *   MPLS_CACHE_REC     record 0
+ *   MPLS_CACHE_PI      [list_count]
+ *   MPLS_PLM           [mark_count]
+ *   MPLS_STREAM        [stream_count] video, audio and pg of each item
+ *   path               NUL terminated, zero padded to a multiple of 8
+ *   MPLS_CACHE_REC     record 1
+ *   ...
+ *
+ * Records are checked when the file is loaded, a checksum covers each
+ * one, so a damaged file never leads a decode out of its record.
+ *
+ * A record is reused as is when size and mtime of the playlist match.
+ * Otherwise the playlist is read and the record is still reused when its
+ * content hash matches, only the stat data gets refreshed.
+ */
+
+#define MPLS_CACHE_MAGIC    ('M' << 24 | 'P' << 16 | 'L' << 8 | 'C')
+#define MPLS_CACHE_VERSION  3
+
+#define ALIGN8(x)           (((x) + 7) & ~(size_t)7)
+
+typedef struct
+{
+    uint32_t        magic;
+    uint16_t        version;
+    uint8_t         plm_size;
+    uint8_t         stream_size;
+} MPLS_CACHE_HDR;
+
+typedef struct
+{
+    uint32_t        rec_len;
+    uint32_t        check;          // hash of the rest of the record
+    uint16_t        path_len;
+    uint16_t        list_count;
+    uint16_t        sub_count;
+    uint16_t        mark_count;
+    uint32_t        stream_count;
+    uint32_t        reserved;
+    uint64_t        size;
+    int64_t         mtime;
+    uint64_t        hash;
+    uint64_t        duration;
+    uint32_t        type_indicator;
+    uint32_t        type_indicator2;
+    uint32_t        list_pos;
+    uint32_t        mark_pos;
+    uint32_t        ext_pos;
+    uint32_t        warnings;
+} MPLS_CACHE_REC;
+
+typedef struct
+{
+    char            clip_id[5];
+    uint8_t         connection_condition;
+    uint8_t         stc_id;
+    uint8_t         num_video;
+    uint32_t        in_time;
+    uint32_t        out_time;
+    uint32_t        abs_start;
+    uint32_t        abs_end;
+    uint8_t         num_audio;
+    uint8_t         num_pg;
+    uint8_t         num_ig;
+    uint8_t         num_secondary_audio;
+    uint8_t         num_secondary_video;
+    uint8_t         num_pip_pg;
+    uint8_t         reserved[2];
+} MPLS_CACHE_PI;
+
+typedef struct
+{
+    uint64_t        key;
+    MPLS_CACHE_REC *rec;
+} MPLS_CACHE_SLOT;
+
+struct mpls_cache_s
+{
+    char            *path;
+    BITSTREAM        file;
+
+    // Index of the current record of every path
+    MPLS_CACHE_SLOT *slot;
+    int              alloc;
+    int              count;
+
+    // Records created in this run
+    MPLS_CACHE_REC **owned;
+    int              owned_alloc;
+    int              owned_count;
+
+    int              dirty;
+    pthread_mutex_t  lock;
+};
+
+static size_t
+_rec_len(uint16_t list_count, uint16_t mark_count, uint32_t stream_count,
+         uint16_t path_len)
+{
+    return ALIGN8(sizeof(MPLS_CACHE_REC) +
+                  list_count * sizeof(MPLS_CACHE_PI) +
+                  mark_count * sizeof(MPLS_PLM) +
+                  stream_count * sizeof(MPLS_STREAM) +
+                  path_len + 1);
+}
+
+static MPLS_CACHE_PI*
+_rec_pi(MPLS_CACHE_REC *rec)
+{
+    return (MPLS_CACHE_PI*)(rec + 1);
+}
+
+static MPLS_PLM*
+_rec_plm(MPLS_CACHE_REC *rec)
+{
+    return (MPLS_PLM*)(_rec_pi(rec) + rec->list_count);
+}
+
+static MPLS_STREAM*
+_rec_stream(MPLS_CACHE_REC *rec)
+{
+    return (MPLS_STREAM*)(_rec_plm(rec) + rec->mark_count);
+}
+
+static char*
+_rec_path(MPLS_CACHE_REC *rec)
+{
+    return (char*)(_rec_stream(rec) + rec->stream_count);
+}
+
+static uint32_t
+_rec_check(MPLS_CACHE_REC *rec)
+{
+    return hash64(0, (uint8_t*)rec + 8, rec->rec_len - 8);
+}
+
+// Streams the play items of a loaded record claim, which _decode() reads
+static uint32_t
+_rec_items_streams(MPLS_CACHE_REC *rec)
+{
+    MPLS_CACHE_PI *cpi = _rec_pi(rec);
+    uint32_t stream_count = 0;
+    int ii;
+
+    for (ii = 0; ii < rec->list_count; ii++) {
+        stream_count += cpi[ii].num_video + cpi[ii].num_audio + cpi[ii].num_pg;
+    }
+    return stream_count;
+}
+
+static int64_t
+_mtime(struct stat *st)
+{
+#if defined(__linux__)
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#else
+    return (int64_t)st->st_mtime * 1000000000;
+#endif
+}
+
+static MPLS_CACHE_SLOT*
+_find_slot(MPLS_CACHE *cache, const char *path, uint64_t key)
+{
+    int mask = cache->alloc - 1;
+    int ii = (key ^ (key >> 32)) & mask;
+
+    while (cache->slot[ii].rec != NULL) {
+        if (cache->slot[ii].key == key &&
+            strcmp(_rec_path(cache->slot[ii].rec), path) == 0) {
+            break;
+        }
+        ii = (ii + 1) & mask;
+    }
+    return &cache->slot[ii];
+}
+
+static MPLS_CACHE_REC*
+_lookup(MPLS_CACHE *cache, const char *path)
+{
+    if (cache->alloc == 0) {
+        return NULL;
+    }
+    return _find_slot(cache, path, hash64(0, path, strlen(path)))->rec;
+}
+
+static void
+_insert(MPLS_CACHE *cache, MPLS_CACHE_REC *rec)
+{
+    char *path = _rec_path(rec);
+    MPLS_CACHE_SLOT *slot;
+
+    if (2 * (cache->count + 1) > cache->alloc) {
+        MPLS_CACHE_SLOT *old = cache->slot;
+        int old_alloc = cache->alloc, ii;
+
+        cache->alloc = old_alloc ? 2 * old_alloc : 256;
+        cache->slot = calloc(cache->alloc, sizeof(MPLS_CACHE_SLOT));
+        cache->count = 0;
+        for (ii = 0; ii < old_alloc; ii++) {
+            if (old[ii].rec != NULL) {
+                *_find_slot(cache, _rec_path(old[ii].rec), old[ii].key) = old[ii];
+                cache->count++;
+            }
+        }
+        X_FREE(old);
+    }
+    slot = _find_slot(cache, path, hash64(0, path, rec->path_len));
+    if (slot->rec == NULL) {
+        cache->count++;
+    }
+    slot->key = hash64(0, path, rec->path_len);
+    slot->rec = rec;
+}
+
+static void
+_own(MPLS_CACHE *cache, MPLS_CACHE_REC *rec)
+{
+    if (cache->owned_count == cache->owned_alloc) {
+        cache->owned_alloc = cache->owned_alloc ? 2 * cache->owned_alloc : 64;
+        cache->owned = realloc(cache->owned, cache->owned_alloc * sizeof(MPLS_CACHE_REC*));
+    }
+    cache->owned[cache->owned_count++] = rec;
+}
+
+static MPLS_STREAM*
+_decode_streams(MPLS_STREAM **out, MPLS_STREAM **ss, int count)
+{
+    MPLS_STREAM *streams = NULL;
+
+    if (count) {
+        streams = *out;
+        memcpy(streams, *ss, count * sizeof(MPLS_STREAM));
+        *out += count;
+        *ss += count;
+    }
+    return streams;
+}
+
+static MPLS_PL*
+_decode(MPLS_CACHE_REC *rec)
+{
+    MPLS_PL *pl;
+    MPLS_CACHE_PI *cpi = _rec_pi(rec);
+    MPLS_STREAM *ss = _rec_stream(rec);
+    MPLS_STREAM *out;
+    int ii;
+
+    pl = mpls_alloc(rec->list_count, rec->mark_count, rec->stream_count, &out);
+    if (pl == NULL) {
+        return NULL;
+    }
+    pl->type_indicator  = rec->type_indicator;
+    pl->type_indicator2 = rec->type_indicator2;
+    pl->list_pos        = rec->list_pos;
+    pl->mark_pos        = rec->mark_pos;
+    pl->ext_pos         = rec->ext_pos;
+    pl->sub_count       = rec->sub_count;
+    pl->duration        = rec->duration;
+    pl->warnings        = rec->warnings;
+
+    for (ii = 0; ii < pl->list_count; ii++) {
+        MPLS_PI *pi = &pl->play_item[ii];
+
+        memcpy(pi->clip_id, cpi[ii].clip_id, 5);
+        pi->connection_condition    = cpi[ii].connection_condition;
+        pi->stc_id                  = cpi[ii].stc_id;
+        pi->in_time                 = cpi[ii].in_time;
+        pi->out_time                = cpi[ii].out_time;
+        pi->abs_start               = cpi[ii].abs_start;
+        pi->abs_end                 = cpi[ii].abs_end;
+        pi->stn.num_video           = cpi[ii].num_video;
+        pi->stn.num_audio           = cpi[ii].num_audio;
+        pi->stn.num_pg              = cpi[ii].num_pg;
+        pi->stn.num_ig              = cpi[ii].num_ig;
+        pi->stn.num_secondary_audio = cpi[ii].num_secondary_audio;
+        pi->stn.num_secondary_video = cpi[ii].num_secondary_video;
+        pi->stn.num_pip_pg          = cpi[ii].num_pip_pg;
+        pi->stn.video = _decode_streams(&out, &ss, pi->stn.num_video);
+        pi->stn.audio = _decode_streams(&out, &ss, pi->stn.num_audio);
+        pi->stn.pg    = _decode_streams(&out, &ss, pi->stn.num_pg);
+    }
+
+    if (pl->mark_count) {
+        memcpy(pl->play_mark, _rec_plm(rec), pl->mark_count * sizeof(MPLS_PLM));
+    }
+    return pl;
+}
+
+static MPLS_CACHE_REC*
+_encode(MPLS_PL *pl, const char *path, uint64_t size, int64_t mtime, uint64_t hash)
+{
+    MPLS_CACHE_REC *rec;
+    MPLS_CACHE_PI *cpi;
+    MPLS_STREAM *ss;
+    uint32_t stream_count = 0;
+    size_t path_len = strlen(path);
+    size_t len;
+    int ii;
+
+    if (path_len > UINT16_MAX) {
+        return NULL;
+    }
+    for (ii = 0; ii < pl->list_count; ii++) {
+        MPLS_PI *pi = &pl->play_item[ii];
+        stream_count += pi->stn.num_video + pi->stn.num_audio + pi->stn.num_pg;
+    }
+    len = _rec_len(pl->list_count, pl->mark_count, stream_count, path_len);
+    rec = calloc(1, len);
+    if (rec == NULL) {
+        return NULL;
+    }
+    rec->rec_len         = len;
+    rec->path_len        = path_len;
+    rec->list_count      = pl->list_count;
+    rec->sub_count       = pl->sub_count;
+    rec->mark_count      = pl->mark_count;
+    rec->stream_count    = stream_count;
+    rec->size            = size;
+    rec->mtime           = mtime;
+    rec->hash            = hash;
+    rec->duration        = pl->duration;
+    rec->type_indicator  = pl->type_indicator;
+    rec->type_indicator2 = pl->type_indicator2;
+    rec->list_pos        = pl->list_pos;
+    rec->mark_pos        = pl->mark_pos;
+    rec->ext_pos         = pl->ext_pos;
+    rec->warnings        = pl->warnings;
+
+    cpi = _rec_pi(rec);
+    ss = _rec_stream(rec);
+    for (ii = 0; ii < pl->list_count; ii++) {
+        MPLS_PI *pi = &pl->play_item[ii];
+
+        memcpy(cpi[ii].clip_id, pi->clip_id, 5);
+        cpi[ii].connection_condition = pi->connection_condition;
+        cpi[ii].stc_id               = pi->stc_id;
+        cpi[ii].in_time              = pi->in_time;
+        cpi[ii].out_time             = pi->out_time;
+        cpi[ii].abs_start            = pi->abs_start;
+        cpi[ii].abs_end              = pi->abs_end;
+        cpi[ii].num_video            = pi->stn.num_video;
+        cpi[ii].num_audio            = pi->stn.num_audio;
+        cpi[ii].num_pg               = pi->stn.num_pg;
+        cpi[ii].num_ig               = pi->stn.num_ig;
+        cpi[ii].num_secondary_audio  = pi->stn.num_secondary_audio;
+        cpi[ii].num_secondary_video  = pi->stn.num_secondary_video;
+        cpi[ii].num_pip_pg           = pi->stn.num_pip_pg;
+        memcpy(ss, pi->stn.video, pi->stn.num_video * sizeof(MPLS_STREAM));
+        ss += pi->stn.num_video;
+        memcpy(ss, pi->stn.audio, pi->stn.num_audio * sizeof(MPLS_STREAM));
+        ss += pi->stn.num_audio;
+        memcpy(ss, pi->stn.pg, pi->stn.num_pg * sizeof(MPLS_STREAM));
+        ss += pi->stn.num_pg;
+    }
+    memcpy(_rec_plm(rec), pl->play_mark, pl->mark_count * sizeof(MPLS_PLM));
+    memcpy(_rec_path(rec), path, path_len);
+    rec->check = _rec_check(rec);
+    return rec;
+}
+
+static void
+_load(MPLS_CACHE *cache)
+{
+    MPLS_CACHE_HDR *hdr;
+    size_t off;
+
+    if (bs_map(&cache->file, cache->path) < 0) {
+        return;
+    }
+    hdr = (MPLS_CACHE_HDR*)cache->file.buf;
+    if (cache->file.end < (off_t)sizeof(MPLS_CACHE_HDR) ||
+        hdr->magic != MPLS_CACHE_MAGIC ||
+        hdr->version != MPLS_CACHE_VERSION ||
+        hdr->plm_size != sizeof(MPLS_PLM) ||
+        hdr->stream_size != sizeof(MPLS_STREAM)) {
+
+        fprintf(stderr, "Ignoring incompatible cache file %s\n", cache->path);
+        bs_close(&cache->file);
+        cache->dirty = 1;
+        return;
+    }
+
+    off = ALIGN8(sizeof(MPLS_CACHE_HDR));
+    while (off + sizeof(MPLS_CACHE_REC) <= (size_t)cache->file.end) {
+        MPLS_CACHE_REC *rec = (MPLS_CACHE_REC*)(cache->file.buf + off);
+
+        if (rec->rec_len % 8 != 0 ||
+            rec->rec_len > cache->file.end - off ||
+            rec->rec_len != _rec_len(rec->list_count, rec->mark_count,
+                                     rec->stream_count, rec->path_len) ||
+            rec->check != _rec_check(rec) ||
+            rec->stream_count != _rec_items_streams(rec) ||
+            _rec_path(rec)[rec->path_len] != 0) {
+
+            fprintf(stderr, "Truncated or damaged cache file %s\n", cache->path);
+            cache->dirty = 1;
+            break;
+        }
+        _insert(cache, rec);
+        off += rec->rec_len;
+    }
+}
+
+static int
+_save(MPLS_CACHE *cache)
+{
+    MPLS_CACHE_HDR hdr = {0,};
+    static const uint8_t pad[8] = {0,};
+    str_t tmp = {0,};
+    FILE *fp;
+    int ii, ok;
+
+    str_printf(&tmp, "%s.tmp", cache->path);
+    fp = fopen(tmp.buf, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to write cache file %s\n", tmp.buf);
+        str_free(&tmp);
+        return 0;
+    }
+
+    hdr.magic       = MPLS_CACHE_MAGIC;
+    hdr.version     = MPLS_CACHE_VERSION;
+    hdr.plm_size    = sizeof(MPLS_PLM);
+    hdr.stream_size = sizeof(MPLS_STREAM);
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    ok = ok && fwrite(pad, 1, ALIGN8(sizeof(hdr)) - sizeof(hdr), fp) ==
+               ALIGN8(sizeof(hdr)) - sizeof(hdr);
+    for (ii = 0; ok && ii < cache->alloc; ii++) {
+        MPLS_CACHE_REC *rec = cache->slot[ii].rec;
+
+        if (rec != NULL) {
+            ok = fwrite(rec, rec->rec_len, 1, fp) == 1;
+        }
+    }
+    ok = (fclose(fp) == 0) && ok;
+
+    // The old mapping has to go before the file is replaced
+    bs_close(&cache->file);
+#if defined(_WIN32)
+    remove(cache->path);
+#endif
+    if (!ok || rename(tmp.buf, cache->path) != 0) {
+        fprintf(stderr, "Failed to write cache file %s\n", cache->path);
+        remove(tmp.buf);
+        ok = 0;
+    }
+    str_free(&tmp);
+    return ok;
+}
+
+MPLS_CACHE*
+mpls_cache_open(const char *path)
+{
+    MPLS_CACHE *cache;
+
+    cache = calloc(1, sizeof(MPLS_CACHE));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->path = strdup(path);
+    pthread_mutex_init(&cache->lock, NULL);
+    _load(cache);
+    return cache;
+}
+
+// Drop in replacement for mpls_parse_file() that goes through the cache.
+// "st" may carry the result of a stat() the caller already did.
+// Safe to call from several threads at once.
+MPLS_PL*
+mpls_cache_parse(MPLS_CACHE *cache, char *path, struct stat *pst, int *err)
+{
+    struct stat st;
+    BITSTREAM bits;
+    MPLS_CACHE_REC *rec, *update = NULL;
+    MPLS_PL *pl;
+    uint64_t hash;
+
+    if (pst != NULL) {
+        st = *pst;
+    } else if (stat(path, &st)) {
+        return mpls_parse_file(path, err);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return mpls_parse_file(path, err);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    rec = _lookup(cache, path);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (err != NULL) {
+        *err = MPLS_OK;
+    }
+    if (rec != NULL && rec->size == (uint64_t)st.st_size && rec->mtime == _mtime(&st)) {
+        pl = _decode(rec);
+        if (pl == NULL && err != NULL) {
+            *err = MPLS_ERR_NOMEM;
+        }
+        return pl;
+    }
+
+    if (bs_open(&bits, path) < 0) {
+        if (err != NULL) {
+            *err = MPLS_ERR_IO;
+        }
+        return NULL;
+    }
+    hash = hash64(0, bits.buf, bits.end);
+    if (rec != NULL && rec->size == (uint64_t)bits.end && rec->hash == hash) {
+        // Only the stat data changed
+        pl = _decode(rec);
+        if (pl == NULL && err != NULL) {
+            *err = MPLS_ERR_NOMEM;
+        }
+        update = malloc(rec->rec_len);
+        if (update != NULL) {
+            memcpy(update, rec, rec->rec_len);
+            update->mtime = _mtime(&st);
+            update->check = _rec_check(update);
+        }
+    } else {
+        pl = mpls_parse_buffer(bits.buf, bits.end, err);
+        if (pl != NULL) {
+            update = _encode(pl, path, bits.end, _mtime(&st), hash);
+        }
+    }
+    bs_close(&bits);
+
+    if (update != NULL) {
+        pthread_mutex_lock(&cache->lock);
+        _own(cache, update);
+        _insert(cache, update);
+        cache->dirty = 1;
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return pl;
+}
+
+// Writes the cache back if anything changed and releases it
+int
+mpls_cache_close(MPLS_CACHE *cache)
+{
+    int ok = 1, ii;
+
+    if (cache == NULL) {
+        return 0;
+    }
+    if (cache->dirty) {
+        ok = _save(cache);
+    }
+    bs_close(&cache->file);
+    for (ii = 0; ii < cache->owned_count; ii++) {
+        free(cache->owned[ii]);
+    }
+    X_FREE(cache->owned);
+    X_FREE(cache->slot);
+    X_FREE(cache->path);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+    return ok;
+}
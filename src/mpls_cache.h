@@ -0,0 +1,15 @@
+#if !defined(_MPLS_CACHE_H_)
+#define _MPLS_CACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include "mpls_parse.h"
+
+typedef struct mpls_cache_s MPLS_CACHE;
+
+MPLS_CACHE* mpls_cache_open(const char *path);
+MPLS_PL* mpls_cache_parse(MPLS_CACHE *cache, char *path, struct stat *st, int *err);
+int mpls_cache_close(MPLS_CACHE *cache);
+
+#endif // _MPLS_CACHE_H_
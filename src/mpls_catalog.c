@@ -0,0 +1,420 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "util.h"
+#include "bits.h"
+#include "mpls_catalog.h"
+
+/*
+ * Catalog file layout.  Host byte order, every record starts on an 8
+ * byte boundary so the file is used straight from the mapping:
+ *
+ *   MPLS_CATALOG_HDR
+ *   MPLS_CATALOG_REC   record 0
+ *   disc               canonical path of the disc root or image, NUL terminated
+ *   name               playlist file name, NUL terminated, zero padded to
+ *                      a multiple of 8
+ *   MPLS_CATALOG_REC   record 1
+ *   ...
+ *
+ * Records are appended under a write lock on the file and never change
+ * afterwards, so readers take no lock: a mapping stays good while the
+ * file grows, and the checksum of each record tells a complete record
+ * from one being written or left behind by a writer that died.  Such a
+ * tail is ignored by readers and cut off by the next writer.
+ */
+
+#define MPLS_CATALOG_MAGIC    ('M' << 24 | 'P' << 16 | 'L' << 8 | 'F')
+#define MPLS_CATALOG_VERSION  2
+
+#define ALIGN8(x)             (((x) + 7) & ~(size_t)7)
+
+typedef struct
+{
+    uint32_t        magic;
+    uint32_t        version;
+} MPLS_CATALOG_HDR;
+
+typedef struct
+{
+    uint32_t        rec_len;
+    uint32_t        check;          // hash of the rest of the record
+    uint64_t        content;
+    uint64_t        structure;
+    uint32_t        duration;
+    uint16_t        disc_len;       // without the NUL
+    uint16_t        name_len;
+} MPLS_CATALOG_REC;
+
+typedef struct
+{
+    uint64_t          key;
+    uint32_t          seq;          // order of the record in the catalog
+    MPLS_CATALOG_REC *rec;
+} MPLS_CATALOG_SLOT;
+
+struct mpls_catalog_s
+{
+    char              *path;
+    BITSTREAM          file;        // records found when opened
+
+    // Two tables of the same size, by content and by structure
+    MPLS_CATALOG_SLOT *content;
+    MPLS_CATALOG_SLOT *structure;
+    int                alloc;
+    int                count;
+
+    // Records added since, the ones from "synced" on are not written yet
+    MPLS_CATALOG_REC **owned;
+    int                owned_alloc;
+    int                owned_count;
+    int                synced;
+};
+
+static size_t
+_rec_len(uint16_t disc_len, uint16_t name_len)
+{
+    return ALIGN8(sizeof(MPLS_CATALOG_REC) + disc_len + 1 + name_len + 1);
+}
+
+static char*
+_rec_disc(MPLS_CATALOG_REC *rec)
+{
+    return (char*)(rec + 1);
+}
+
+static char*
+_rec_name(MPLS_CATALOG_REC *rec)
+{
+    return _rec_disc(rec) + rec->disc_len + 1;
+}
+
+static uint32_t
+_rec_check(MPLS_CATALOG_REC *rec)
+{
+    return hash64(0, (uint8_t*)rec + 8, rec->rec_len - 8);
+}
+
+static MPLS_CATALOG_SLOT*
+_free_slot(MPLS_CATALOG_SLOT *table, int alloc, uint64_t key)
+{
+    int mask = alloc - 1;
+    int ii = (key ^ (key >> 32)) & mask;
+
+    while (table[ii].rec != NULL) {
+        ii = (ii + 1) & mask;
+    }
+    return &table[ii];
+}
+
+static void
+_insert(MPLS_CATALOG *catalog, MPLS_CATALOG_REC *rec)
+{
+    MPLS_CATALOG_SLOT *slot;
+    uint32_t seq = catalog->count;
+
+    if (2 * (catalog->count + 1) > catalog->alloc) {
+        MPLS_CATALOG_SLOT *content = catalog->content;
+        MPLS_CATALOG_SLOT *structure = catalog->structure;
+        int old_alloc = catalog->alloc, ii;
+
+        catalog->alloc = old_alloc ? 2 * old_alloc : 256;
+        catalog->content = calloc(catalog->alloc, sizeof(MPLS_CATALOG_SLOT));
+        catalog->structure = calloc(catalog->alloc, sizeof(MPLS_CATALOG_SLOT));
+        for (ii = 0; ii < old_alloc; ii++) {
+            if (content[ii].rec != NULL) {
+                *_free_slot(catalog->content, catalog->alloc, content[ii].key) = content[ii];
+            }
+            if (structure[ii].rec != NULL) {
+                *_free_slot(catalog->structure, catalog->alloc, structure[ii].key) = structure[ii];
+            }
+        }
+        X_FREE(content);
+        X_FREE(structure);
+    }
+    slot = _free_slot(catalog->content, catalog->alloc, rec->content);
+    slot->key = rec->content;
+    slot->seq = seq;
+    slot->rec = rec;
+    slot = _free_slot(catalog->structure, catalog->alloc, rec->structure);
+    slot->key = rec->structure;
+    slot->seq = seq;
+    slot->rec = rec;
+    catalog->count++;
+}
+
+// End of the complete records in "buf", adding them to "catalog" if set
+static size_t
+_scan(uint8_t *buf, size_t end, MPLS_CATALOG *catalog)
+{
+    size_t off = sizeof(MPLS_CATALOG_HDR);
+
+    while (off + sizeof(MPLS_CATALOG_REC) <= end) {
+        MPLS_CATALOG_REC *rec = (MPLS_CATALOG_REC*)(buf + off);
+
+        if (rec->rec_len % 8 != 0 ||
+            rec->rec_len > end - off ||
+            rec->rec_len != _rec_len(rec->disc_len, rec->name_len) ||
+            rec->check != _rec_check(rec) ||
+            _rec_disc(rec)[rec->disc_len] != 0 ||
+            _rec_name(rec)[rec->name_len] != 0) {
+            break;
+        }
+        if (catalog != NULL) {
+            _insert(catalog, rec);
+        }
+        off += rec->rec_len;
+    }
+    return off;
+}
+
+static int
+_check_hdr(BITSTREAM *file)
+{
+    MPLS_CATALOG_HDR *hdr = (MPLS_CATALOG_HDR*)file->buf;
+
+    return file->end >= (off_t)sizeof(MPLS_CATALOG_HDR) &&
+           hdr->magic == MPLS_CATALOG_MAGIC &&
+           hdr->version == MPLS_CATALOG_VERSION;
+}
+
+// A missing file is an empty catalog, created on the first sync
+MPLS_CATALOG*
+mpls_catalog_open(const char *path)
+{
+    MPLS_CATALOG *catalog;
+
+    catalog = calloc(1, sizeof(MPLS_CATALOG));
+    if (catalog == NULL) {
+        return NULL;
+    }
+    catalog->path = strdup(path);
+    if (catalog->path == NULL) {
+        X_FREE(catalog);
+        return NULL;
+    }
+    if (bs_map(&catalog->file, path) == 0 && catalog->file.end > 0) {
+        if (!_check_hdr(&catalog->file)) {
+            fprintf(stderr, "Invalid catalog file %s\n", path);
+            bs_close(&catalog->file);
+            X_FREE(catalog->path);
+            X_FREE(catalog);
+            return NULL;
+        }
+        _scan(catalog->file.buf, catalog->file.end, catalog);
+    }
+    return catalog;
+}
+
+static void
+_entry(MPLS_CATALOG_ENTRY *entry, MPLS_CATALOG_REC *rec)
+{
+    entry->content   = rec->content;
+    entry->structure = rec->structure;
+    entry->duration  = rec->duration;
+    entry->disc      = _rec_disc(rec);
+    entry->name      = _rec_name(rec);
+}
+
+int
+mpls_catalog_lookup(MPLS_CATALOG *catalog, const MPLS_CATALOG_ENTRY *entry,
+                    MPLS_CATALOG_ENTRY *found)
+{
+    MPLS_CATALOG_SLOT *first = NULL;
+    int mask = catalog->alloc - 1;
+    int ii;
+
+    if (catalog->alloc == 0) {
+        return MPLS_CATALOG_NEW;
+    }
+
+    ii = (entry->content ^ (entry->content >> 32)) & mask;
+    for (; catalog->content[ii].rec != NULL; ii = (ii + 1) & mask) {
+        MPLS_CATALOG_SLOT *slot = &catalog->content[ii];
+
+        if (slot->key != entry->content) {
+            continue;
+        }
+        if (strcmp(_rec_name(slot->rec), entry->name) == 0 &&
+            strcmp(_rec_disc(slot->rec), entry->disc) == 0) {
+            _entry(found, slot->rec);
+            return MPLS_CATALOG_SELF;
+        }
+        if (first == NULL || slot->seq < first->seq) {
+            first = slot;
+        }
+    }
+    if (first != NULL) {
+        _entry(found, first->rec);
+        return MPLS_CATALOG_CONTENT;
+    }
+
+    ii = (entry->structure ^ (entry->structure >> 32)) & mask;
+    for (; catalog->structure[ii].rec != NULL; ii = (ii + 1) & mask) {
+        MPLS_CATALOG_SLOT *slot = &catalog->structure[ii];
+
+        if (slot->key == entry->structure &&
+            (first == NULL || slot->seq < first->seq)) {
+            first = slot;
+        }
+    }
+    if (first != NULL) {
+        _entry(found, first->rec);
+        return MPLS_CATALOG_STRUCTURE;
+    }
+    return MPLS_CATALOG_NEW;
+}
+
+int
+mpls_catalog_add(MPLS_CATALOG *catalog, const MPLS_CATALOG_ENTRY *entry)
+{
+    MPLS_CATALOG_REC *rec;
+    size_t disc_len = strlen(entry->disc), name_len = strlen(entry->name);
+    size_t rec_len;
+
+    if (disc_len > UINT16_MAX || name_len > UINT16_MAX) {
+        return -1;
+    }
+    if (catalog->owned_count == catalog->owned_alloc) {
+        int alloc = catalog->owned_alloc ? 2 * catalog->owned_alloc : 64;
+        MPLS_CATALOG_REC **owned;
+
+        owned = realloc(catalog->owned, alloc * sizeof(MPLS_CATALOG_REC*));
+        if (owned == NULL) {
+            return -1;
+        }
+        catalog->owned = owned;
+        catalog->owned_alloc = alloc;
+    }
+    rec_len = _rec_len(disc_len, name_len);
+    rec = calloc(1, rec_len);
+    if (rec == NULL) {
+        return -1;
+    }
+    rec->rec_len   = rec_len;
+    rec->content   = entry->content;
+    rec->structure = entry->structure;
+    rec->duration  = entry->duration;
+    rec->disc_len  = disc_len;
+    rec->name_len  = name_len;
+    memcpy(_rec_disc(rec), entry->disc, disc_len);
+    memcpy(_rec_name(rec), entry->name, name_len);
+    rec->check     = _rec_check(rec);
+
+    catalog->owned[catalog->owned_count++] = rec;
+    _insert(catalog, rec);
+    return 0;
+}
+
+static int
+_write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, p, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return 0;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 1;
+}
+
+// Appends the records added since the last sync.  Writers go one at a
+// time through the lock (not on Windows) and start after the last
+// complete record, whoever wrote it.
+int
+mpls_catalog_sync(MPLS_CATALOG *catalog)
+{
+    MPLS_CATALOG_HDR hdr = { MPLS_CATALOG_MAGIC, MPLS_CATALOG_VERSION };
+    BITSTREAM file;
+    size_t end;
+    int fd, ii, ok;
+
+    if (catalog->synced == catalog->owned_count) {
+        return 0;
+    }
+    fd = open(catalog->path, O_RDWR | O_CREAT | O_BINARY, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to write catalog file %s\n", catalog->path);
+        return -1;
+    }
+#if !defined(_WIN32)
+    {
+        struct flock lock;
+
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        while (fcntl(fd, F_SETLKW, &lock) < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Failed to lock catalog file %s\n", catalog->path);
+                close(fd);
+                return -1;
+            }
+        }
+    }
+#endif
+
+    // Through the locked descriptor, opening the file again and closing
+    // that would drop the lock
+    file.end = -1;
+    ok = bs_map_fd(&file, fd) == 0;
+    if (ok && file.end == 0) {
+        end = 0;
+        ok = _write_all(fd, &hdr, sizeof(hdr));
+    } else if (ok && _check_hdr(&file)) {
+        end = _scan(file.buf, file.end, NULL);
+        // A writer died half way through a record
+        ok = end == (size_t)file.end || ftruncate(fd, end) == 0;
+        ok = ok && lseek(fd, end, SEEK_SET) == (off_t)end;
+    } else {
+        ok = 0;
+    }
+    if (file.end >= 0) {
+        bs_close(&file);
+    }
+    for (ii = catalog->synced; ok && ii < catalog->owned_count; ii++) {
+        ok = _write_all(fd, catalog->owned[ii], catalog->owned[ii]->rec_len);
+    }
+    ok = (close(fd) == 0) && ok;
+    if (!ok) {
+        fprintf(stderr, "Failed to write catalog file %s\n", catalog->path);
+        return -1;
+    }
+    catalog->synced = catalog->owned_count;
+    return 0;
+}
+
+int
+mpls_catalog_close(MPLS_CATALOG *catalog)
+{
+    int ii, ret;
+
+    if (catalog == NULL) {
+        return 0;
+    }
+    ret = mpls_catalog_sync(catalog);
+    bs_close(&catalog->file);
+    for (ii = 0; ii < catalog->owned_count; ii++) {
+        X_FREE(catalog->owned[ii]);
+    }
+    X_FREE(catalog->owned);
+    X_FREE(catalog->content);
+    X_FREE(catalog->structure);
+    X_FREE(catalog->path);
+    X_FREE(catalog);
+    return ret;
+}
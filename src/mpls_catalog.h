@@ -0,0 +1,38 @@
+#if !defined(_MPLS_CATALOG_H_)
+#define _MPLS_CATALOG_H_
+
+#include <stdint.h>
+
+// Persistent catalog of the playlists seen on every disc, by content
+// fingerprint (mpls_fingerprint) and structure fingerprint
+// (mpls_structure_fingerprint).  The file is only ever appended to, so
+// any number of processes can map it and look it up while one of them
+// adds to it.
+
+#define MPLS_CATALOG_NEW        0   // neither fingerprint is known
+#define MPLS_CATALOG_SELF       1   // same content, disc and name
+#define MPLS_CATALOG_CONTENT    2   // same content on another disc or name
+#define MPLS_CATALOG_STRUCTURE  3   // same structure, other content
+
+typedef struct mpls_catalog_s MPLS_CATALOG;
+
+typedef struct
+{
+    uint64_t        content;
+    uint64_t        structure;
+    uint32_t        duration;       // 45 kHz
+    const char     *disc;           // canonical disc root or image path
+    const char     *name;           // playlist file name
+} MPLS_CATALOG_ENTRY;
+
+MPLS_CATALOG* mpls_catalog_open(const char *path);
+// Looks "entry" up, on a match "found" gets the first entry catalogued
+int mpls_catalog_lookup(MPLS_CATALOG *catalog, const MPLS_CATALOG_ENTRY *entry,
+                        MPLS_CATALOG_ENTRY *found);
+// Added entries are found right away and written by mpls_catalog_sync()
+int mpls_catalog_add(MPLS_CATALOG *catalog, const MPLS_CATALOG_ENTRY *entry);
+int mpls_catalog_sync(MPLS_CATALOG *catalog);
+// Syncs and releases the catalog, returns -1 when the sync failed
+int mpls_catalog_close(MPLS_CATALOG *catalog);
+
+#endif // _MPLS_CATALOG_H_
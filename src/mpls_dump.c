@@ -1,455 +1,2254 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
+#include <strings.h>
 #include <libgen.h>
 #include <math.h>
-#include "mpls_parse.h"
+#include <pthread.h>
 #include "util.h"
+#include "mpls_parse.h"
+#include "mpls_cache.h"
+#include "mpls_index.h"
+#include "mpls_catalog.h"
+#include "mpls_show.h"
+#include "mpls_serve.h"
+#include "udf.h"
+#include "ws_pool.h"
+#include "batch_read.h"
+#include "index_parse.h"
+#include "mobj_parse.h"
+#if defined(__linux__)
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#endif
+
+typedef struct {
+    int value;
+    char *str;
+} value_map_t;
+
+// Parse job states, anything but PL_PENDING is final
+#define PL_PENDING   0
+#define PL_SKIP      1
+#define PL_FAILED    2
+#define PL_FILTERED  3
+#define PL_OK        4
+
+typedef struct {
+    char    *name;
+    MPLS_PL *pl;
+    int      state;
+    int      err;
+    uint32_t warnings;
+    UDF     *udf;       // set for playlists inside a disc image
+    const UDF_DIRENT *ent;
+    uint8_t *buf;       // contents read ahead by _read_jobs()
+    size_t   len;
+} pl_job_t;
+
+typedef struct {
+    dump_ctx_t      *ctx;
+    pl_job_t        *job;
+    int             *order;     // parse order with --physical
+    int              count;
+    int              next;
+    pthread_mutex_t  lock;
+    pthread_cond_t   done;
+} pl_queue_t;
+
+// Options acted on by main() rather than by the dump itself
+typedef struct {
+    char *manifest;
+    char *cache;
+    char *serve;
+    char *connect;
+    char *index;
+    char *query;
+    char *catalog;
+    int   watch;
+    int   recursive;
+} run_opts_t;
+
+static void
+_make_path(str_t *path, char *root, char *dir)
+{
+    struct stat st_buf;
+    char *base;
+
+    base = basename(root);
+    if (strcmp(base, dir) == 0) {
+        str_printf(path, "%s", root);
+    } else if (strcmp(base, "BDMV") != 0) {
+        str_printf(path, "%s/BDMV/%s", root, dir);
+    } else {
+        str_printf(path, "%s/%s", root, dir);
+    }
+
+    if (stat(path->buf, &st_buf) || !S_ISDIR(st_buf.st_mode)) {
+        str_free(path);
+    }
+}
+
+static int
+_has_ext(const char *name, const char *ext)
+{
+    size_t len = strlen(name), ext_len = strlen(ext);
+
+    return len > ext_len && strcasecmp(name + len - ext_len, ext) == 0;
+}
+
+// Playlists inside a disc image are read into memory and parsed with
+// the filters, the cache only knows files on disk
+static int
+_parse_udf_job(dump_ctx_t *ctx, pl_job_t *job)
+{
+    MPLS_FILTER filter;
+    MPLS_PL *pl;
+    uint8_t *buf;
+    size_t len;
+
+    if (job->ent->is_dir) {
+        return PL_SKIP;
+    }
+    buf = udf_read(job->udf, job->ent, &len);
+    if (buf == NULL) {
+        job->err = MPLS_ERR_IO;
+        return PL_FAILED;
+    }
+    dump_filter_init(ctx, &filter);
+    pl = mpls_parse_buffer_filter(buf, len, &filter, &job->err);
+    free(buf);
+    if (pl == NULL) {
+        return job->err == MPLS_ERR_FILTERED ? PL_FILTERED : PL_FAILED;
+    }
+    job->warnings = pl->warnings;
+    job->pl = pl;
+    return PL_OK;
+}
+
+// Parse one playlist and apply the filters that only look at the
+// playlist itself.  Safe to run from any thread.
+static int
+_parse_job(dump_ctx_t *ctx, pl_job_t *job, int regular_only)
+{
+    const dump_opts_t *opts = ctx->opts;
+    MPLS_FILTER filter;
+    struct stat st;
+    MPLS_PL *pl;
+
+    if (job->udf != NULL) {
+        return _parse_udf_job(ctx, job);
+    }
+    if (regular_only) {
+        if (stat(job->name, &st) || !S_ISREG(st.st_mode)) {
+            return PL_SKIP;
+        }
+    }
+    if (opts->cache == NULL) {
+        // The parser applies the filters itself and stops early
+        dump_filter_init(ctx, &filter);
+        if (job->buf != NULL) {
+            pl = mpls_parse_buffer_filter(job->buf, job->len, &filter, &job->err);
+            X_FREE(job->buf);
+            job->buf = NULL;
+        } else {
+            pl = mpls_parse_file_filter(job->name, &filter, &job->err);
+        }
+        if (pl == NULL) {
+            return job->err == MPLS_ERR_FILTERED ? PL_FILTERED : PL_FAILED;
+        }
+        job->warnings = pl->warnings;
+        job->pl = pl;
+        return PL_OK;
+    }
+
+    // Cache records are always complete, filter after the fact
+    pl = mpls_cache_parse(opts->cache, job->name, regular_only ? &st : NULL, &job->err);
+    if (pl == NULL) {
+        return PL_FAILED;
+    }
+    job->warnings = pl->warnings;
+    if (opts->seconds) {
+        if (!dump_filter_short(pl, opts->seconds)) {
+            mpls_free(&pl);
+            return PL_FILTERED;
+        }
+    }
+    if (opts->repeats) {
+        if (!dump_filter_repeats(pl, opts->repeats)) {
+            mpls_free(&pl);
+            return PL_FILTERED;
+        }
+    }
+    job->pl = pl;
+    return PL_OK;
+}
+
+// The disc of a playlist is the path in front of BDMV/PLAYLIST, or the
+// directory of a loose playlist
+static void
+_disc_of(str_t *disc, char *name)
+{
+    char *end;
+    int len;
+
+    end = strrchr(name, '/');
+    len = end != NULL ? end - name : 0;
+    if (len >= 13 && strncasecmp(name + len - 13, "BDMV/PLAYLIST", 13) == 0 &&
+        (len == 13 || name[len - 14] == '/')) {
+        len = len > 14 ? len - 14 : len - 13;
+    }
+    if (len > 0) {
+        str_printf(disc, "%.*s", len, name);
+    } else {
+        str_printf(disc, "%s", end == name ? "/" : ".");
+    }
+}
+
+// Adds an emitted playlist to the --index being built
+static void
+_index_add(dump_ctx_t *ctx, pl_job_t *job)
+{
+    str_t disc = {0,};
+    char *name = job->name;
+
+    _disc_of(&disc, name);
+    if (mpls_index_add(ctx->opts->index, disc.buf, name, job->pl) < 0) {
+        fprintf(ctx->log, "Failed to index %s\n", name);
+    }
+    str_free(&disc);
+}
+
+// Canonical path of the disc root or image of a playlist, so the same
+// disc reached as DISC, ./DISC or /mnt/DISC is catalogued once
+static void
+_disc_identity(str_t *id, char *name)
+{
+    str_t disc = {0,};
+    char *path;
+
+    _disc_of(&disc, name);
+#if !defined(_WIN32)
+    path = realpath(disc.buf, NULL);
+#else
+    path = _fullpath(NULL, disc.buf, 0);
+#endif
+    str_printf(id, "%s", path != NULL ? path : disc.buf);
+    free(path);
+    str_free(&disc);
+}
+
+// Looks an emitted playlist up in the --catalog and adds it when new.
+// Returns 0 for a playlist the catalog has under another name, which is
+// then left out like a duplicate.  A playlist with only the structure of
+// a catalogued one is kept, with a note.
+static int
+_catalog_check(dump_ctx_t *ctx, pl_job_t *job)
+{
+    MPLS_CATALOG_ENTRY entry, found;
+    str_t disc = {0,};
+    char *base;
+    int ret = 1;
+
+    _disc_identity(&disc, job->name);
+    base = strrchr(job->name, '/');
+    entry.content   = mpls_fingerprint(job->pl);
+    entry.structure = mpls_structure_fingerprint(job->pl);
+    entry.duration  = job->pl->duration > UINT32_MAX ? UINT32_MAX : job->pl->duration;
+    entry.disc      = disc.buf;
+    entry.name      = base != NULL ? base + 1 : job->name;
+    switch (mpls_catalog_lookup(ctx->opts->catalog, &entry, &found)) {
+        case MPLS_CATALOG_SELF:
+            break;
+
+        case MPLS_CATALOG_CONTENT:
+            fprintf(ctx->log, "In catalog: %s (as %s in %s)\n",
+                    job->name, found.name, found.disc);
+            ret = 0;
+            break;
+
+        case MPLS_CATALOG_STRUCTURE:
+            fprintf(ctx->log, "Similar in catalog: %s (like %s in %s)\n",
+                    job->name, found.name, found.disc);
+            // fall through
+
+        default:
+            if (mpls_catalog_add(ctx->opts->catalog, &entry) < 0) {
+                fprintf(ctx->log, "Failed to catalog %s\n", job->name);
+            }
+            break;
+    }
+    str_free(&disc);
+    return ret;
+}
+
+// Apply the filters that depend on previously emitted playlists and
+// print the result.  Must be called in output order.
+static void
+_emit_job(dump_ctx_t *ctx, pl_job_t *job)
+{
+    if (job->state == PL_FAILED) {
+        dump_show_error(ctx, job->name, job->err);
+        return;
+    }
+    dump_show_warnings(ctx, job->name, job->warnings);
+    if (job->state != PL_OK) {
+        return;
+    }
+    if ((!ctx->opts->dups || dump_filter_dup(ctx, job->pl)) &&
+        (ctx->opts->catalog == NULL || _catalog_check(ctx, job))) {
+        dump_show_marks(ctx, job->name, job->pl);
+        if (ctx->opts->index != NULL) {
+            _index_add(ctx, job);
+        }
+    }
+    mpls_free(&job->pl);
+}
+
+typedef struct {
+    batch_loc_t loc;
+    int         idx;
+} pl_loc_t;
+
+static int
+_loc_cmp(const void *a, const void *b)
+{
+    const pl_loc_t *la = a, *lb = b;
+
+    if (la->loc.phys != lb->loc.phys) {
+        return la->loc.phys < lb->loc.phys ? -1 : 1;
+    }
+    if (la->loc.ino != lb->loc.ino) {
+        return la->loc.ino < lb->loc.ino ? -1 : 1;
+    }
+    return la->idx - lb->idx;
+}
+
+// With --physical, the indexes of the jobs in the order their data lies
+// on the disk, which the reads and parses follow to spare the seeks.
+// Playlists in a disc image go by the location of their file entry.
+// NULL keeps the name order.
+static int*
+_physical_order(dump_ctx_t *ctx, pl_job_t *job, int count)
+{
+    pl_loc_t *loc;
+    int *order;
+    int ii;
+
+    if (!ctx->opts->physical || count < 2) {
+        return NULL;
+    }
+    loc = calloc(count, sizeof(pl_loc_t));
+    order = malloc(count * sizeof(int));
+    if (loc == NULL || order == NULL) {
+        X_FREE(loc);
+        X_FREE(order);
+        return NULL;
+    }
+    for (ii = 0; ii < count; ii++) {
+        loc[ii].idx = ii;
+        if (job[ii].udf != NULL) {
+            loc[ii].loc.phys = job[ii].ent->lbn;
+        } else {
+            batch_locate(job[ii].name, &loc[ii].loc);
+        }
+    }
+    qsort(loc, count, sizeof(pl_loc_t), _loc_cmp);
+    for (ii = 0; ii < count; ii++) {
+        order[ii] = loc[ii].idx;
+    }
+    free(loc);
+    return order;
+}
+
+// Reads the playlists of a directory ahead of the parse as one batch,
+// see batch_read.h.  The parser reads the ones that failed itself.  With
+// a cache most playlists are never read, so it is left to the cache.
+static void
+_read_jobs(dump_ctx_t *ctx, pl_job_t *job, const int *order, int count, int threads)
+{
+    batch_file_t *file;
+    int ii, idx;
+
+    if (ctx->opts->cache != NULL || count == 0) {
+        return;
+    }
+    file = calloc(count, sizeof(batch_file_t));
+    if (file == NULL) {
+        return;
+    }
+    for (ii = 0; ii < count; ii++) {
+        file[ii].path = job[order ? order[ii] : ii].name;
+    }
+    batch_read(file, count, threads);
+    for (ii = 0; ii < count; ii++) {
+        idx = order ? order[ii] : ii;
+        job[idx].buf = file[ii].buf;
+        job[idx].len = file[ii].len;
+    }
+    free(file);
+}
+
+static void
+_process_file(dump_ctx_t *ctx, char *name)
+{
+    pl_job_t job = {.name = name, .state = PL_PENDING, .err = MPLS_OK};
+
+    job.state = _parse_job(ctx, &job, 0);
+    _emit_job(ctx, &job);
+}
+
+static void*
+_parse_worker(void *arg)
+{
+    pl_queue_t *q = arg;
+    int idx, state;
+
+    while (1) {
+        pthread_mutex_lock(&q->lock);
+        idx = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        if (idx >= q->count) {
+            break;
+        }
+        if (q->order != NULL) {
+            idx = q->order[idx];
+        }
+        state = _parse_job(q->ctx, &q->job[idx], 0);
+        pthread_mutex_lock(&q->lock);
+        q->job[idx].state = state;
+        pthread_cond_broadcast(&q->done);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return NULL;
+}
+
+// Parse the playlists with up to "jobs" threads, but emit them in the
+// order they were listed so output matches a serial run.  The names come
+// from _list_playlists() or a disc image and are known to be files.
+static void
+_process_list(dump_ctx_t *ctx, char **names, int count, UDF *udf, UDF_DIRENT *ents)
+{
+    pl_queue_t q;
+    pthread_t *threads;
+    int nthreads, ii;
+
+    q.ctx = ctx;
+    q.job = calloc(count, sizeof(pl_job_t));
+    q.count = count;
+    q.next = 0;
+    for (ii = 0; ii < count; ii++) {
+        q.job[ii].name = names[ii];
+        q.job[ii].state = PL_PENDING;
+        q.job[ii].udf = udf;
+        q.job[ii].ent = ents ? &ents[ii] : NULL;
+    }
+    q.order = _physical_order(ctx, q.job, count);
+    if (udf == NULL) {
+        _read_jobs(ctx, q.job, q.order, count, ctx->opts->jobs);
+    }
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.done, NULL);
+
+    nthreads = ctx->opts->jobs < count ? ctx->opts->jobs : count;
+    threads = calloc(nthreads > 1 ? nthreads : 1, sizeof(pthread_t));
+    if (nthreads > 1) {
+        for (ii = 0; ii < nthreads; ii++) {
+            if (pthread_create(&threads[ii], NULL, _parse_worker, &q)) {
+                break;
+            }
+        }
+        nthreads = ii;
+    } else if (q.order != NULL) {
+        for (ii = 0; ii < count; ii++) {
+            q.job[q.order[ii]].state = _parse_job(ctx, &q.job[q.order[ii]], 0);
+        }
+    }
+
+    for (ii = 0; ii < count; ii++) {
+        if (nthreads > 1) {
+            pthread_mutex_lock(&q.lock);
+            while (q.job[ii].state == PL_PENDING) {
+                pthread_cond_wait(&q.done, &q.lock);
+            }
+            pthread_mutex_unlock(&q.lock);
+        } else if (q.job[ii].state == PL_PENDING) {
+            q.job[ii].state = _parse_job(ctx, &q.job[ii], 0);
+        }
+        _emit_job(ctx, &q.job[ii]);
+    }
+
+    if (nthreads > 1) {
+        for (ii = 0; ii < nthreads; ii++) {
+            pthread_join(threads[ii], NULL);
+        }
+    }
+    free(threads);
+    pthread_cond_destroy(&q.done);
+    pthread_mutex_destroy(&q.lock);
+    X_FREE(q.order);
+    free(q.job);
+}
+
+static void
+_usage(char *cmd)
+{
+    fprintf(stderr, 
+"Usage: %s -vli <mpls file> [<mpls file> ...]\n"
+"With no options, produces a list of the playlist(s) with durations\n"
+"Options:\n"
+"    v             - Verbose output.\n"
+"    r <N>         - Filter out titles that have >N repeating clips\n"
+"    d             - Filter out duplicate titles\n"
+"    s <seconds>   - Filter out short titles\n"
+"    f             - Filter combination -r2 -d -s120\n"
+"    j <N>         - Parse directory playlists with N threads\n"
+"    R             - Walk the directory arguments for disc roots (folders\n"
+"                    with a BDMV directory) and .iso images, and dump them\n"
+"\n"
+"    p <prefix>    - chapter output prefix (63 chars max)\n"
+"    e             - split chapters at new file\n"
+"    c <seconds>   - split chapters at first segment after <seconds>\n"
+"                    * can be repeated for multiple cuts\n"
+"    i <files>     - only include files (ex: -i 00001,00002,00005)\n"
+"\n"
+"    --cache <file> - keep parsed playlists in <file> and reuse them while\n"
+"                    the playlist size and mtime or content are unchanged\n"
+"    --physical    - read and parse the playlists of a directory in the\n"
+"                    order they lie on the disk, output order is unchanged\n"
+"    --titles-only - only the playlists the titles of index.bdmv can play,\n"
+"                    found through MovieObject.bdmv\n"
+"    --json        - one JSON record per playlist on stdout, with its play\n"
+"                    items, streams, marks and the chapter files written\n"
+"    --index <dir> - also write the playlists that are output to a columnar\n"
+"                    index in <dir>\n"
+"    --catalog <file> - leave out the playlists <file> has under another\n"
+"                    name, add the others to it\n"
+"    --query <dir> - list the playlists of the index in <dir> that match all\n"
+"                    the terms given as arguments: min=<seconds>,\n"
+"                    max=<seconds>, marks=<N>, clip=<id> and\n"
+"                    video|audio|pg=<codec|lang>[:<codec|lang>]\n"
+"    @ <list>      - also process the disc roots and playlists listed in\n"
+"                    <list>, one per line or NUL separated (- for stdin)\n"
+"\n"
+"    --serve <socket> - answer requests on a UNIX socket, see README\n"
+"    --connect <socket> - send the other arguments to a --serve server\n"
+"    --watch       - after the dump, keep watching the PLAYLIST directories\n"
+"                    and dump the .mpls files that are written or removed\n"
+, cmd);
+
+    exit(EXIT_FAILURE);
+}
+
+#define OPTS "vfr:ds:p:ec:i:j:@:R"
+
+// Long only options
+#define OPT_CACHE    256
+#define OPT_JSON     257
+#define OPT_SERVE    258
+#define OPT_CONNECT  259
+#define OPT_WATCH    260
+#define OPT_PHYSICAL 261
+#define OPT_TITLES   262
+#define OPT_INDEX    263
+#define OPT_QUERY    264
+#define OPT_CATALOG  265
+
+static const struct option long_opts[] = {
+    {"cache",       required_argument, NULL, OPT_CACHE},
+    {"json",        no_argument,       NULL, OPT_JSON},
+    {"serve",       required_argument, NULL, OPT_SERVE},
+    {"connect",     required_argument, NULL, OPT_CONNECT},
+    {"watch",       no_argument,       NULL, OPT_WATCH},
+    {"physical",    no_argument,       NULL, OPT_PHYSICAL},
+    {"titles-only", no_argument,       NULL, OPT_TITLES},
+    {"index",       required_argument, NULL, OPT_INDEX},
+    {"query",       required_argument, NULL, OPT_QUERY},
+    {"catalog",     required_argument, NULL, OPT_CATALOG},
+    {NULL,          0,                 NULL, 0}
+};
+
+// Directory entries are taken on d_type where the file system reports
+// it.  The others get an fstatat() relative to the open directory, which
+// spares the kernel the walk down the full path.
+static int
+_is_regular(DIR *dir, struct dirent *ent, const char *path)
+{
+    struct stat st;
+
+#if defined(DT_REG)
+    if (ent->d_type == DT_REG) {
+        return 1;
+    }
+    if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK) {
+        return 0;
+    }
+#endif
+#if !defined(_WIN32)
+    return fstatat(dirfd(dir), ent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode);
+#else
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+// Full paths of the .mpls files in the PLAYLIST directory of a disc
+// root, sorted by name.  Anything else is skipped before it costs a
+// parse job.  "path" gets the directory.
+static int
+_list_playlists(dump_ctx_t *ctx, char *arg, str_t *path, str_list_t *dirlist)
+{
+    DIR *dir;
+    struct dirent *ent;
+    str_t name = {0,};
+    int prefix;
+
+    _make_path(path, arg, "PLAYLIST");
+    if (path->buf == NULL) {
+        fprintf(ctx->log, "Failed to find playlist path: %s\n", arg);
+        return -1;
+    }
+    dir = opendir(path->buf);
+    if (dir == NULL) {
+        fprintf(ctx->log, "Failed to open dir: %s\n", path->buf);
+        str_free(path);
+        return -1;
+    }
+    // Every name is appended to the same directory prefix
+    str_printf(&name, "%s/", path->buf);
+    prefix = name.len;
+    for (ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
+        if (!_has_ext(ent->d_name, ".mpls")) {
+            continue;
+        }
+        name.len = prefix;
+        str_append(&name, ent->d_name);
+        if (_is_regular(dir, ent, name.buf)) {
+            str_list_append(dirlist, name.buf);
+        }
+    }
+    closedir(dir);
+    str_free(&name);
+    str_list_sort(dirlist);
+    return 0;
+}
+
+// Playlist number of a 00000.mpls name, -1 for any other name
+static int
+_playlist_number(const char *path)
+{
+    const char *base;
+    int ii;
+
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    if (strlen(base) != 10 || !_has_ext(base, ".mpls")) {
+        return -1;
+    }
+    for (ii = 0; ii < 5; ii++) {
+        if (base[ii] < '0' || base[ii] > '9') {
+            return -1;
+        }
+    }
+    return atoi(base);
+}
+
+static int
+_u32_cmp(const void *a, const void *b)
+{
+    uint32_t va = *(const uint32_t*)a, vb = *(const uint32_t*)b;
+
+    return va < vb ? -1 : va > vb;
+}
+
+// Numbers of the playlists the titles of a disc reach, from index.bdmv
+// and MovieObject.bdmv in "bdmv", a directory or the BDMV directory of a
+// disc image.  Returns -1 when they can not be worked out.
+static int
+_title_playlists(UDF *udf, const char *bdmv, uint32_t **playlists)
+{
+    INDX_ROOT *index = NULL;
+    MOBJ_OBJECTS *mobj = NULL;
+    UDF_DIRENT *ents;
+    uint8_t *buf;
+    str_t path = {0,};
+    size_t len;
+    int count = -1, ii;
+
+    if (udf == NULL) {
+        str_printf(&path, "%s/index.bdmv", bdmv);
+        index = indx_parse(path.buf);
+        str_printf(&path, "%s/MovieObject.bdmv", bdmv);
+        mobj = mobj_parse(path.buf);
+        str_free(&path);
+    } else {
+        count = udf_list(udf, bdmv, &ents);
+        for (ii = 0; ii < count; ii++) {
+            if (strcasecmp(ents[ii].name, "index.bdmv") == 0 && index == NULL) {
+                buf = udf_read(udf, &ents[ii], &len);
+                index = buf ? indx_parse_buffer(buf, len) : NULL;
+                X_FREE(buf);
+            } else if (strcasecmp(ents[ii].name, "MovieObject.bdmv") == 0 && mobj == NULL) {
+                buf = udf_read(udf, &ents[ii], &len);
+                mobj = buf ? mobj_parse_buffer(buf, len) : NULL;
+                X_FREE(buf);
+            }
+        }
+        if (count >= 0) {
+            free(ents);
+        }
+        count = -1;
+    }
+    if (index != NULL && mobj != NULL) {
+        count = mobj_title_playlists(index, mobj, playlists);
+    }
+    indx_free(&index);
+    mobj_free(&mobj);
+    return count;
+}
+
+// With --titles-only, drops the listed playlists no title reaches, along
+// with their disc image entries.  A disc whose titles can not be worked
+// out, BD-J or missing files, keeps them all.
+static void
+_titles_only(dump_ctx_t *ctx, const char *root, UDF *udf, const char *playlist_dir,
+             str_list_t *names, UDF_DIRENT *ents)
+{
+    uint32_t *playlists = NULL;
+    uint32_t num;
+    str_t bdmv = {0,};
+    char *slash;
+    int count, ii, kept = 0;
+
+    if (!ctx->opts->titles_only || names->count == 0) {
+        return;
+    }
+    str_printf(&bdmv, "%s", playlist_dir);
+    slash = strrchr(bdmv.buf, '/');
+    if (slash != NULL) {
+        *slash = 0;
+    }
+    count = _title_playlists(udf, bdmv.buf, &playlists);
+    str_free(&bdmv);
+    if (count <= 0) {
+        fprintf(ctx->log, "Titles not resolved, keeping all playlists: %s\n", root);
+        X_FREE(playlists);
+        return;
+    }
+    for (ii = 0; ii < names->count; ii++) {
+        num = _playlist_number(names->item[ii]);
+        if (bsearch(&num, playlists, count, sizeof(uint32_t), _u32_cmp) == NULL) {
+            free(names->item[ii]);
+            continue;
+        }
+        names->item[kept] = names->item[ii];
+        if (ents != NULL) {
+            ents[kept] = ents[ii];
+        }
+        kept++;
+    }
+    names->count = kept;
+    free(playlists);
+}
+
+static int
+_dirent_cmp(const void *a, const void *b)
+{
+    return strcmp(((const UDF_DIRENT*)a)->name, ((const UDF_DIRENT*)b)->name);
+}
+
+// Playlists of an open disc image, sorted by name.  They are named after
+// the image, disc.iso/BDMV/PLAYLIST/00000.mpls.  Like _list_playlists(),
+// only .mpls files are kept, "ents" is compacted to match "names".
+static int
+_list_iso(dump_ctx_t *ctx, UDF *udf, char *arg, UDF_DIRENT **ents, str_list_t *names)
+{
+    str_t name = {0,};
+    int count, kept, ii;
+
+    count = udf_list(udf, "BDMV/PLAYLIST", ents);
+    if (count < 0) {
+        fprintf(ctx->log, "Failed to find playlist path: %s\n", arg);
+        return -1;
+    }
+    for (ii = kept = 0; ii < count; ii++) {
+        if (!(*ents)[ii].is_dir && _has_ext((*ents)[ii].name, ".mpls")) {
+            (*ents)[kept++] = (*ents)[ii];
+        }
+    }
+    count = kept;
+    qsort(*ents, count, sizeof(UDF_DIRENT), _dirent_cmp);
+    for (ii = 0; ii < count; ii++) {
+        str_printf(&name, "%s/BDMV/PLAYLIST/%s", arg, (*ents)[ii].name);
+        str_list_append(names, name.buf);
+    }
+    str_free(&name);
+    return 0;
+}
+
+// A disc image is read like a disc root without mounting it
+static void
+_process_iso(dump_ctx_t *ctx, char *arg)
+{
+    UDF *udf;
+    UDF_DIRENT *ents;
+    str_list_t names = {0,};
+
+    udf = udf_open(arg);
+    if (udf == NULL) {
+        fprintf(ctx->log, "Failed to open disc image: %s\n", arg);
+        return;
+    }
+    if (!ctx->opts->json) {
+        fprintf(ctx->out, "Directory: %s:\n", arg);
+    }
+    if (_list_iso(ctx, udf, arg, &ents, &names) < 0) {
+        udf_close(udf);
+        return;
+    }
+    _titles_only(ctx, arg, udf, "BDMV/PLAYLIST", &names, ents);
+    _process_list(ctx, names.item, names.count, udf, ents);
+    str_list_free(&names);
+    free(ents);
+    udf_close(udf);
+}
+
+static void
+_process_arg(dump_ctx_t *ctx, char *arg)
+{
+    struct stat st;
+    str_t path = {0,};
+    str_list_t dirlist = {0,};
+
+    if (stat(arg, &st)) {
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (_has_ext(arg, ".iso")) {
+            _process_iso(ctx, arg);
+        } else {
+            _process_file(ctx, arg);
+        }
+        return;
+    }
+    if (!ctx->opts->json) {
+        fprintf(ctx->out, "Directory: %s:\n", arg);
+    }
+    if (_list_playlists(ctx, arg, &path, &dirlist) < 0) {
+        return;
+    }
+    _titles_only(ctx, arg, NULL, path.buf, &dirlist, NULL);
+    _process_list(ctx, dirlist.item, dirlist.count, NULL, NULL);
+    str_list_free(&dirlist);
+    str_free(&path);
+}
+
+static int
+_process_manifest(dump_ctx_t *ctx, char *manifest)
+{
+    FILE *fp;
+    str_t entry = {0,};
+
+    if (strcmp(manifest, "-") == 0) {
+        fp = stdin;
+    } else {
+        fp = fopen(manifest, "rb");
+        if (fp == NULL) {
+            fprintf(ctx->log, "Failed to open list: %s\n", manifest);
+            return 0;
+        }
+    }
+    while (str_read_entry(&entry, fp) >= 0) {
+        if (entry.len > 0) {
+            _process_arg(ctx, entry.buf);
+        }
+    }
+    str_free(&entry);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return 1;
+}
+
+// Recursive scan (-R) of a library tree.  A work stealing pool walks the
+// tree down to the disc roots, the parents of BDMV directories, and the
+// .iso images.  Each disc is queued to the same pool as soon as the walk
+// finds it, to be listed and parsed at most a few discs ahead of the
+// output.  The output follows the walk, depth first and by name in each
+// directory, disc by disc.
+
+// Pool task types
+#define SCAN_DIR     0
+#define SCAN_DISC    1
+#define SCAN_PARSE   2
+
+// Disc states
+#define DISC_WAITING 0      // found, waits for room ahead of the output
+#define DISC_PENDING 1
+#define DISC_FAILED  2      // image that could not be opened
+#define DISC_LISTED  3
+
+// Node states
+#define NODE_PENDING 0      // directory not read yet
+#define NODE_DIR     1
+#define NODE_DISC    2
+
+typedef struct scan_disc_s scan_disc_t;
+
+struct scan_disc_s {
+    char        *root;
+    int          state;
+    str_list_t   names;
+    pl_job_t    *job;
+    UDF         *udf;
+    UDF_DIRENT  *ents;
+    scan_disc_t *next;      // in scan_t.waiting
+};
+
+// A directory or image met by the walk, the output goes through the
+// tree of them in order
+typedef struct scan_node_s scan_node_t;
+
+struct scan_node_s {
+    char        *path;
+    int          state;
+    scan_node_t *child;     // entries of a directory, by name
+    int          count;
+    scan_disc_t  disc;
+};
+
+typedef struct {
+    int          type;
+    scan_node_t *node;
+    scan_disc_t *disc;
+    pl_job_t    *job;
+} scan_task_t;
+
+typedef struct {
+    dump_ctx_t      *ctx;
+    ws_pool_t       *pool;
+    pthread_mutex_t  lock;
+    pthread_cond_t   done;
+    int              window;    // discs queued ahead of the output
+    int              active;
+    scan_disc_t     *waiting;   // in the order they were found
+    scan_disc_t    **waiting_tail;
+} scan_t;
+
+static void _scan_push(scan_t *scan, int worker, int type, scan_node_t *node,
+                       scan_disc_t *disc, pl_job_t *job);
+
+// Symbolic links are not followed, they could loop
+static int
+_is_dir(DIR *dir, struct dirent *ent, const char *path)
+{
+    struct stat st;
+
+#if defined(DT_DIR)
+    if (ent->d_type == DT_DIR) {
+        return 1;
+    }
+    if (ent->d_type != DT_UNKNOWN) {
+        return 0;
+    }
+#endif
+#if !defined(_WIN32)
+    return fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+#else
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+// Queues a disc that was just found, or leaves it waiting when "window"
+// discs are already ahead of the output
+static void
+_scan_found(scan_t *scan, scan_node_t *node, int worker)
+{
+    scan_disc_t *disc = &node->disc;
+    int queue;
+
+    disc->root = node->path;
+    pthread_mutex_lock(&scan->lock);
+    node->state = NODE_DISC;
+    queue = scan->active < scan->window;
+    if (queue) {
+        scan->active++;
+        disc->state = DISC_PENDING;
+    } else {
+        disc->state = DISC_WAITING;
+        disc->next = NULL;
+        *scan->waiting_tail = disc;
+        scan->waiting_tail = &disc->next;
+    }
+    pthread_cond_broadcast(&scan->done);
+    pthread_mutex_unlock(&scan->lock);
+    if (queue) {
+        _scan_push(scan, worker, SCAN_DISC, NULL, disc, NULL);
+    }
+}
+
+// Takes "disc", or the first waiting disc when NULL and there is room,
+// off the waiting list.  Called with the lock held.
+static scan_disc_t*
+_scan_unwait(scan_t *scan, scan_disc_t *disc)
+{
+    scan_disc_t **link;
+
+    if (disc == NULL && scan->active >= scan->window) {
+        return NULL;
+    }
+    for (link = &scan->waiting; *link != NULL; link = &(*link)->next) {
+        if (disc == NULL || *link == disc) {
+            disc = *link;
+            *link = disc->next;
+            if (scan->waiting_tail == &disc->next) {
+                scan->waiting_tail = link;
+            }
+            scan->active++;
+            disc->state = DISC_PENDING;
+            return disc;
+        }
+    }
+    return NULL;
+}
+
+// Which of two sorted lists has the next entry, an exhausted one is last
+static int
+_merge_cmp(str_list_t *a, int ii, str_list_t *b, int jj)
+{
+    if (ii >= a->count) {
+        return 1;
+    }
+    if (jj >= b->count) {
+        return -1;
+    }
+    return strcmp(a->item[ii], b->item[jj]);
+}
+
+static void
+_scan_dir(scan_t *scan, scan_node_t *node, int worker)
+{
+    DIR *dir;
+    struct dirent *ent;
+    str_t name = {0,};
+    str_list_t subdirs = {0,}, images = {0,};
+    scan_node_t *child = NULL;
+    int disc = 0, prefix, count, ii, jj, kk;
+
+    dir = opendir(node->path);
+    if (dir == NULL) {
+        fprintf(scan->ctx->log, "Failed to open dir: %s\n", node->path);
+    } else {
+        str_printf(&name, "%s/", node->path);
+        prefix = name.len;
+        for (ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            name.len = prefix;
+            str_append(&name, ent->d_name);
+            if (_has_ext(ent->d_name, ".iso")) {
+                if (_is_regular(dir, ent, name.buf)) {
+                    str_list_append(&images, name.buf);
+                }
+            } else if (_is_dir(dir, ent, name.buf)) {
+                if (strcmp(ent->d_name, "BDMV") == 0) {
+                    disc = 1;
+                }
+                str_list_append(&subdirs, name.buf);
+            }
+        }
+        closedir(dir);
+        str_free(&name);
+    }
+
+    if (disc) {
+        str_list_free(&subdirs);
+        str_list_free(&images);
+        _scan_found(scan, node, worker);
+        return;
+    }
+    // Images and directories together in name order, the paths move
+    // over to the nodes.  An image is told by its root until it is found.
+    str_list_sort(&subdirs);
+    str_list_sort(&images);
+    count = subdirs.count + images.count;
+    if (count > 0) {
+        child = calloc(count, sizeof(scan_node_t));
+    }
+    if (child == NULL) {
+        str_list_free(&subdirs);
+        str_list_free(&images);
+        count = 0;
+    }
+    for (ii = jj = kk = 0; kk < count; kk++) {
+        if (_merge_cmp(&subdirs, ii, &images, jj) < 0) {
+            child[kk].path = subdirs.item[ii++];
+        } else {
+            child[kk].path = images.item[jj++];
+            child[kk].disc.root = child[kk].path;
+        }
+    }
+    X_FREE(subdirs.item);
+    X_FREE(images.item);
+
+    pthread_mutex_lock(&scan->lock);
+    node->child = child;
+    node->count = count;
+    node->state = NODE_DIR;
+    pthread_cond_broadcast(&scan->done);
+    pthread_mutex_unlock(&scan->lock);
+
+    // This worker pops its newest task first, pushed in reverse it walks
+    // the tree in name order while the others steal the last names
+    for (kk = count - 1; kk >= 0; kk--) {
+        if (child[kk].disc.root == NULL) {
+            _scan_push(scan, worker, SCAN_DIR, &child[kk], NULL, NULL);
+        } else {
+            _scan_found(scan, &child[kk], worker);
+        }
+    }
+}
+
+static void
+_scan_disc(scan_t *scan, scan_disc_t *disc, int worker)
+{
+    dump_ctx_t *ctx = scan->ctx;
+    struct stat st;
+    str_t path = {0,};
+    int *order;
+    int state = DISC_LISTED, ii;
+
+    if (stat(disc->root, &st) == 0 && !S_ISDIR(st.st_mode)) {
+        disc->udf = udf_open(disc->root);
+        if (disc->udf == NULL) {
+            fprintf(ctx->log, "Failed to open disc image: %s\n", disc->root);
+            state = DISC_FAILED;
+        } else if (_list_iso(ctx, disc->udf, disc->root, &disc->ents, &disc->names) == 0) {
+            _titles_only(ctx, disc->root, disc->udf, "BDMV/PLAYLIST", &disc->names, disc->ents);
+        }
+    } else {
+        if (_list_playlists(ctx, disc->root, &path, &disc->names) == 0) {
+            _titles_only(ctx, disc->root, NULL, path.buf, &disc->names, NULL);
+        }
+        str_free(&path);
+    }
+    if (disc->names.count > 0) {
+        disc->job = calloc(disc->names.count, sizeof(pl_job_t));
+        if (disc->job == NULL) {
+            str_list_free(&disc->names);
+        }
+    }
+    for (ii = 0; ii < disc->names.count; ii++) {
+        disc->job[ii].name = disc->names.item[ii];
+        disc->job[ii].state = PL_PENDING;
+        disc->job[ii].udf = disc->udf;
+        disc->job[ii].ent = disc->ents ? &disc->ents[ii] : NULL;
+    }
+    order = _physical_order(ctx, disc->job, disc->names.count);
+    // Other discs keep the other workers busy
+    if (disc->udf == NULL) {
+        _read_jobs(ctx, disc->job, order, disc->names.count, 1);
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    disc->state = state;
+    pthread_cond_broadcast(&scan->done);
+    pthread_mutex_unlock(&scan->lock);
+
+    for (ii = disc->names.count - 1; ii >= 0; ii--) {
+        _scan_push(scan, worker, SCAN_PARSE, NULL, NULL, &disc->job[order ? order[ii] : ii]);
+    }
+    X_FREE(order);
+}
+
+static void
+_scan_parse(scan_t *scan, pl_job_t *job)
+{
+    int state;
+
+    state = _parse_job(scan->ctx, job, 0);
+    pthread_mutex_lock(&scan->lock);
+    job->state = state;
+    pthread_cond_broadcast(&scan->done);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static void
+_scan_run(scan_t *scan, scan_task_t *task, int worker)
+{
+    switch (task->type) {
+        case SCAN_DIR:
+            _scan_dir(scan, task->node, worker);
+            break;
+
+        case SCAN_DISC:
+            _scan_disc(scan, task->disc, worker);
+            break;
+
+        case SCAN_PARSE:
+            _scan_parse(scan, task->job);
+            break;
+    }
+}
+
+static void
+_scan_task(void *handle, void *arg, int worker)
+{
+    _scan_run(handle, arg, worker);
+    free(arg);
+}
+
+static void
+_scan_push(scan_t *scan, int worker, int type, scan_node_t *node,
+           scan_disc_t *disc, pl_job_t *job)
+{
+    scan_task_t local = {type, node, disc, job};
+    scan_task_t *task;
+
+    // Out of memory, run it here rather than leave the output waiting
+    task = malloc(sizeof(scan_task_t));
+    if (task == NULL) {
+        _scan_run(scan, &local, worker);
+        return;
+    }
+    *task = local;
+    ws_pool_push(scan->pool, worker, task);
+}
+
+// Waits for a disc and its playlists in order and prints them.  A disc
+// still waiting for room is the one the output needs, it goes first.
+static void
+_scan_emit(scan_t *scan, scan_disc_t *disc)
+{
+    dump_ctx_t *ctx = scan->ctx;
+    scan_disc_t *next;
+    int ii;
+
+    pthread_mutex_lock(&scan->lock);
+    next = disc->state == DISC_WAITING ? _scan_unwait(scan, disc) : NULL;
+    pthread_mutex_unlock(&scan->lock);
+    if (next != NULL) {
+        _scan_push(scan, -1, SCAN_DISC, NULL, next, NULL);
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    while (disc->state == DISC_PENDING) {
+        pthread_cond_wait(&scan->done, &scan->lock);
+    }
+    pthread_mutex_unlock(&scan->lock);
+    if (disc->state != DISC_FAILED) {
+        if (!ctx->opts->json) {
+            fprintf(ctx->out, "Directory: %s:\n", disc->root);
+        }
+        for (ii = 0; ii < disc->names.count; ii++) {
+            pthread_mutex_lock(&scan->lock);
+            while (disc->job[ii].state == PL_PENDING) {
+                pthread_cond_wait(&scan->done, &scan->lock);
+            }
+            pthread_mutex_unlock(&scan->lock);
+            _emit_job(ctx, &disc->job[ii]);
+        }
+    }
+    str_list_free(&disc->names);
+    X_FREE(disc->job);
+    X_FREE(disc->ents);
+    if (disc->udf != NULL) {
+        udf_close(disc->udf);
+    }
+
+    // Its room goes to the discs found since
+    pthread_mutex_lock(&scan->lock);
+    scan->active--;
+    while ((next = _scan_unwait(scan, NULL)) != NULL) {
+        pthread_mutex_unlock(&scan->lock);
+        _scan_push(scan, -1, SCAN_DISC, NULL, next, NULL);
+        pthread_mutex_lock(&scan->lock);
+    }
+    pthread_mutex_unlock(&scan->lock);
+}
+
+// Prints the discs under "node" in walk order, releasing the nodes
+static void
+_scan_emit_node(scan_t *scan, scan_node_t *node)
+{
+    int ii;
+
+    pthread_mutex_lock(&scan->lock);
+    while (node->state == NODE_PENDING) {
+        pthread_cond_wait(&scan->done, &scan->lock);
+    }
+    pthread_mutex_unlock(&scan->lock);
+    if (node->state == NODE_DISC) {
+        _scan_emit(scan, &node->disc);
+    }
+    for (ii = 0; ii < node->count; ii++) {
+        _scan_emit_node(scan, &node->child[ii]);
+    }
+    X_FREE(node->child);
+    X_FREE(node->path);
+}
+
+static void
+_scan_tree(scan_t *scan, char *root)
+{
+    scan_node_t node;
+    int ii;
+
+    memset(&node, 0, sizeof(node));
+    node.path = strdup(root);
+    if (node.path == NULL) {
+        return;
+    }
+    for (ii = strlen(node.path) - 1; ii > 0 && node.path[ii] == '/'; ii--) {
+        node.path[ii] = 0;
+    }
+    _scan_push(scan, -1, SCAN_DIR, &node, NULL, NULL);
+    _scan_emit_node(scan, &node);
+    ws_pool_wait(scan->pool);
+}
+
+static void
+_scan(dump_ctx_t *ctx, char **args, int count)
+{
+    scan_t scan;
+    struct stat st;
+    int ii;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.ctx = ctx;
+    // Discs are parsed at most "window" ahead of the output, which holds
+    // down the playlists kept in memory on a large tree
+    scan.window = 4 * ctx->opts->jobs;
+    scan.waiting_tail = &scan.waiting;
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.done, NULL);
+    scan.pool = ws_pool_create(ctx->opts->jobs, _scan_task, &scan);
+    if (scan.pool == NULL) {
+        fprintf(ctx->log, "Failed to start the scan threads\n");
+    }
+    for (ii = 0; ii < count; ii++) {
+        if (scan.pool == NULL || stat(args[ii], &st) || !S_ISDIR(st.st_mode)) {
+            _process_arg(ctx, args[ii]);
+        } else {
+            _scan_tree(&scan, args[ii]);
+        }
+    }
+    ws_pool_destroy(scan.pool);
+    pthread_cond_destroy(&scan.done);
+    pthread_mutex_destroy(&scan.lock);
+}
+
+#if defined(__linux__)
+
+#define WATCH_EVENTS     (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)
+#define WATCH_SETTLE_MS  200
+
+// A playlist seen by --watch.  It keeps its range of chapter file
+// numbers, the chapter files it wrote and, with -d, the fingerprint it
+// claimed, so a rewritten playlist replaces its own chapter files and is
+// never taken for a duplicate of itself.
+typedef struct {
+    char       *name;
+    uint64_t    fingerprint;    // claimed in watch_t.seen, 0 for none
+    int         item_id;        // first chapter file number, 0 until shown
+    int         items;          // numbers from item_id on that are its own
+    str_list_t  written;        // chapter files of the last dump
+} watch_file_t;
+
+typedef struct {
+    dump_ctx_t     *ctx;
+    dump_opts_t     opts;       // the run options, -d is handled here
+    int             dups;
+    hash_set_t      seen;
+    watch_file_t   *file;
+    int             count;
+    int             alloc;
+    int             next_item;
+    int             fd;
+    str_list_t      dirs;
+    int            *wd;
+    FILE           *null;       // output of the dry runs of _watch_items()
+} watch_t;
+
+static volatile sig_atomic_t watch_stop;
+
+static void
+_watch_signal(int sig)
+{
+    watch_stop = 1;
+}
+
+static watch_file_t*
+_watch_add(watch_t *w, const char *name)
+{
+    watch_file_t *file;
+
+    if (w->count == w->alloc) {
+        w->alloc = w->alloc ? 2 * w->alloc : 256;
+        file = realloc(w->file, w->alloc * sizeof(watch_file_t));
+        if (file == NULL) {
+            return NULL;
+        }
+        w->file = file;
+    }
+    file = &w->file[w->count++];
+    file->name = strdup(name);
+    file->fingerprint = 0;
+    file->item_id = 0;
+    file->items = 0;
+    memset(&file->written, 0, sizeof(file->written));
+    return file;
+}
+
+static watch_file_t*
+_watch_find(watch_t *w, const char *name)
+{
+    int ii;
+
+    for (ii = 0; ii < w->count; ii++) {
+        if (strcmp(w->file[ii].name, name) == 0) {
+            return &w->file[ii];
+        }
+    }
+    return NULL;
+}
+
+static void
+_watch_release(watch_t *w, watch_file_t *file)
+{
+    if (file->fingerprint) {
+        hash_set_remove(&w->seen, file->fingerprint);
+        file->fingerprint = 0;
+    }
+}
+
+// Removes the chapter files of the last dump that "keep" does not list
+static void
+_watch_unlink(watch_file_t *file, const str_list_t *keep)
+{
+    int ii, jj;
+
+    for (ii = 0; ii < file->written.count; ii++) {
+        for (jj = 0; keep != NULL && jj < keep->count; jj++) {
+            if (strcmp(file->written.item[ii], keep->item[jj]) == 0) {
+                break;
+            }
+        }
+        if (keep == NULL || jj == keep->count) {
+            unlink(file->written.item[ii]);
+        }
+    }
+    str_list_free(&file->written);
+    memset(&file->written, 0, sizeof(file->written));
+}
+
+// Chapter file numbers a dump of "pl" takes, counted by a dump that
+// writes no file and goes to /dev/null
+static int
+_watch_items(watch_t *w, MPLS_PL *pl)
+{
+    dump_ctx_t dry = *w->ctx;
+    dump_opts_t opts = w->opts;
+
+    if (w->null == NULL) {
+        return 0;
+    }
+    opts.prefix[0] = 0;
+    opts.json = 0;
+    dry.opts = &opts;
+    dry.out = w->null;
+    dry.written = NULL;
+    dump_show_marks(&dry, "", pl);
+    return dry.item_id - w->ctx->item_id;
+}
+
+static void
+_watch_file(watch_t *w, watch_file_t *file)
+{
+    dump_ctx_t *ctx = w->ctx;
+    pl_job_t job = {.name = file->name, .state = PL_PENDING, .err = MPLS_OK};
+    str_list_t written = {0,};
+    uint64_t fingerprint;
+    int items;
+
+    _watch_release(w, file);
+    job.state = _parse_job(ctx, &job, 1);
+    if (job.state == PL_OK && w->dups) {
+        fingerprint = mpls_fingerprint(job.pl);
+        if (hash_set_add(&w->seen, fingerprint)) {
+            file->fingerprint = fingerprint;
+        } else {
+            mpls_free(&job.pl);
+            job.state = PL_FILTERED;
+        }
+    }
+    if (job.state == PL_OK) {
+        // A playlist that outgrew its numbers moves to new ones after
+        // all the others, rather than take those of the next playlist
+        items = _watch_items(w, job.pl);
+        if (file->item_id == 0 || items > file->items) {
+            file->item_id = w->next_item;
+            file->items = 0;
+        }
+        ctx->item_id = file->item_id;
+    }
+    ctx->written = &written;
+    _emit_job(ctx, &job);
+    ctx->written = NULL;
+    // The numbers are taken once used, a playlist left out by the
+    // catalog does not leave a gap
+    if (job.state == PL_OK && ctx->item_id - file->item_id > file->items) {
+        file->items = ctx->item_id - file->item_id;
+    }
+    if (file->item_id + file->items > w->next_item) {
+        w->next_item = file->item_id + file->items;
+    }
+    // What the new dump did not write again is stale
+    _watch_unlink(file, &written);
+    file->written = written;
+}
+
+static void
+_watch_flush(watch_t *w)
+{
+    if (w->opts.json) {
+        json_flush(&w->ctx->json);
+    } else {
+        fflush(w->ctx->out);
+    }
+}
+
+// Reparses the playlists that changed, in name order
+static void
+_watch_batch(watch_t *w, str_list_t *changed)
+{
+    dump_ctx_t *ctx = w->ctx;
+    struct stat st;
+    watch_file_t *file;
+    int ii;
+
+    str_list_sort(changed);
+    for (ii = 0; ii < changed->count; ii++) {
+        char *name = changed->item[ii];
+
+        file = _watch_find(w, name);
+        if (stat(name, &st) == 0) {
+            if (!w->opts.json) {
+                fprintf(ctx->out, "Changed: %s\n", name);
+            }
+            if (file == NULL) {
+                file = _watch_add(w, name);
+            }
+            if (file != NULL) {
+                _watch_file(w, file);
+            }
+        } else if (file != NULL) {
+            if (w->opts.json) {
+                json_object_begin(&ctx->json, NULL);
+                json_string(&ctx->json, "file", name);
+                json_bool(&ctx->json, "removed", 1);
+                json_object_end(&ctx->json);
+                json_end_record(&ctx->json);
+            } else {
+                fprintf(ctx->out, "Removed: %s\n", name);
+            }
+            _watch_release(w, file);
+            _watch_unlink(file, NULL);
+        }
+    }
+    str_list_free(changed);
+    memset(changed, 0, sizeof(*changed));
+    _watch_flush(w);
+}
+
+static void
+_watch_queue(str_list_t *changed, const char *name)
+{
+    int ii;
+
+    for (ii = 0; ii < changed->count; ii++) {
+        if (strcmp(changed->item[ii], name) == 0) {
+            return;
+        }
+    }
+    str_list_append(changed, name);
+}
 
-static int verbose;
+// Events that lost their place in a full queue, everything is looked at
+static void
+_watch_rescan(watch_t *w, str_list_t *changed)
+{
+    int ii;
 
-static int repeats = 0, seconds = 0, dups = 0, cut_at_new_file = 0;
-static double cut_seconds[4096];
-static int cut_seconds_idx = 0;
-static char included_files[4096] = {0};
+    for (ii = 0; ii < w->count; ii++) {
+        _watch_queue(changed, w->file[ii].name);
+    }
+    for (ii = 0; ii < w->dirs.count; ii++) {
+        str_t path = {0,};
+        str_list_t list = {0,};
+        int jj;
 
-typedef struct {
-    int value;
-    char *str;
-} value_map_t;
+        if (_list_playlists(w->ctx, w->dirs.item[ii], &path, &list) == 0) {
+            for (jj = 0; jj < list.count; jj++) {
+                _watch_queue(changed, list.item[jj]);
+            }
+            str_list_free(&list);
+            str_free(&path);
+        }
+    }
+}
 
 static void
-_show_marks(char *prefix, MPLS_PL *pl)
+_watch_run(watch_t *w)
 {
-    int level = 0;
-    int ii;
-    char current_clip_id[6] = {0};
-    char temp_clip_id[8] = {',', 0, 0, 0, 0, 0, ',', 0};
-    int reset_timestamp = 0;
-    int reset_file_timestamp = 0;
-    uint32_t current_timestamp = 0;
-    uint32_t current_file_timestamp = 0;
-    static int item_id = 1;
-    int chapter_id = 1;
-    FILE* fp = NULL;
-
-    double fps = 24 / 1.001;
-    uint32_t fps30 = 0, fps24 = 0;
-
-    // guess FPS
-    for (ii = 0; ii < pl->mark_count; ii++) {
-        uint32_t time = pl->play_mark[ii].abs_start;
-        double time_f = time / 45000.0;
-        double frame_f_30 = time_f / 1.001 * 30.0;
-        double frame_f_24 = time_f / 1.001 * 24.0;
-        double diff_f_30 = fabs(frame_f_30 - round(frame_f_30));
-        double diff_f_24 = fabs(frame_f_24 - round(frame_f_24));
-        if (diff_f_30 < 1e-2) fps30++;
-        if (diff_f_24 < 1e-2) fps24++;
-    }
-
-    if (fps30 > fps24)
-        fps = 30 / 1.001;
-
-
-    for (ii = 0; ii < pl->mark_count; ii++) {
-        MPLS_PI *pi;
-        MPLS_PLM *plm;
-        str_t *clip_id;
-        int hour, min;
-        double sec;
-        int p_hour, p_min;
-        double p_sec;
-
-        plm = &pl->play_mark[ii];
-        printf("PlayMark %2d: ", ii);
-        if (plm->play_item_ref < pl->list_count) {
-            pi = &pl->play_item[plm->play_item_ref];
-            clip_id = str_substr(pi->clip_id, 0, 5);
-
-            if (included_files[0]) {
-                // Filter clip id
-                strncpy(temp_clip_id + 1, pi->clip_id, 5);
-                if (strstr(included_files, temp_clip_id) == NULL) {
-                    printf("Skipped: %s\n", clip_id->buf);
-                    continue;
-                }
-            }
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = {w->fd, POLLIN, 0};
+    const struct inotify_event *ev;
+    str_list_t changed = {0,};
+    ssize_t len;
+    char *p;
+    int ret, ii;
 
-            int new_file = cut_at_new_file && strncmp(clip_id->buf, current_clip_id, 5) != 0;
-            if (current_clip_id[0] == 0 || new_file) {
-                reset_timestamp = 1;
-                if (new_file)
-                    reset_file_timestamp = 1;
+    while (!watch_stop) {
+        // Changes are picked up once nothing happened for a moment, so a
+        // playlist written in several steps is parsed once
+        ret = poll(&pfd, 1, changed.count ? WATCH_SETTLE_MS : -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            strncpy(current_clip_id, clip_id->buf, 5);
-            if (cut_seconds[cut_seconds_idx] > 0.0) {
-                uint32_t rel_start_current = plm->abs_start - current_timestamp;
-                double sec = rel_start_current / 45000.0;
-                if (sec > cut_seconds[cut_seconds_idx]) {
-                    reset_timestamp = 1;
-                    if (cut_seconds[cut_seconds_idx+1] > 0.0)
-                        cut_seconds_idx++;
-                }
+            break;
+        }
+        if (ret == 0) {
+            _watch_batch(w, &changed);
+            continue;
+        }
+        len = read(w->fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            break;
+        }
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                fprintf(w->ctx->log, "Watch events lost, rescanning\n");
+                _watch_rescan(w, &changed);
+                continue;
             }
-            printf("PlayItem: %s\n", clip_id->buf);
-            str_free(clip_id);
-            free(clip_id);
-        } else {
-            printf("PlayItem: Invalid reference\n");
-        }
-
-        if (reset_file_timestamp) {
-            current_file_timestamp = plm->abs_start;
-            reset_file_timestamp = 0;
-        }
-
-        if (reset_timestamp) {
-            if (fp)
-                fclose(fp);
-            if (*prefix) {
-                char filename[128];
-                strncpy(filename, prefix, 63);
-                sprintf(filename + strlen(filename), "_%02d_%sm2ts_%0.0f.txt", item_id, current_clip_id, round((plm->abs_start - current_file_timestamp) * fps / 45000.0));
-                printf("Opening %s\n", filename);
-                fp = fopen(filename, "wb");
-                if (!fp) {
-                    printf("ERROR: unable to open file %s\n", filename);
-                    return;
+            if (ev->len == 0 || !_has_ext(ev->name, ".mpls")) {
+                continue;
+            }
+            for (ii = 0; ii < w->dirs.count; ii++) {
+                if (w->wd[ii] == ev->wd) {
+                    str_t name = {0,};
+
+                    str_printf(&name, "%s/%s", w->dirs.item[ii], ev->name);
+                    _watch_queue(&changed, name.buf);
+                    str_free(&name);
+                    break;
                 }
             }
-            current_timestamp = plm->abs_start;
-            reset_timestamp = 0;
-            item_id++;
-            chapter_id = 1;
-        }
-
-        p_hour = plm->abs_start / (45000*60*60);
-        p_min = plm->abs_start / (45000*60) % 60;
-        p_sec = (double)(plm->abs_start % (45000 * 60)) / 45000;
-
-        uint32_t rel_start = plm->abs_start - current_timestamp;
-        hour = rel_start / (45000*60*60);
-        min = rel_start / (45000*60) % 60;
-        sec = (double)(rel_start % (45000 * 60)) / 45000;
-        indent_printf(level+1, "Abs Time (mm:ss.ms): %02d:%02d:%06.3f (%02d:%02d:%06.3f) [%0.0f]", p_hour, p_min, p_sec, hour, min, sec, round(rel_start * fps / 45000.0));
-        if (fp)
-            fprintf(fp, "CHAPTER%02d=%02d:%02d:%06.3f\nCHAPTER%02dNAME=\n", chapter_id, hour, min, sec, chapter_id);
-        chapter_id++;
-    }
-    if (fp)
-        fclose(fp);
+        }
+    }
+    str_list_free(&changed);
 }
 
+// Dumps the arguments like a normal run, then keeps watching the
+// PLAYLIST directories and dumps again whatever .mpls file changes
 static int
-_filter_dup(MPLS_PL *pl_list[], int count, MPLS_PL *pl)
+_watch(dump_ctx_t *ctx, char **args, int count)
 {
-    int ii, jj;
+    const dump_opts_t *opts = ctx->opts;
+    struct sigaction sa;
+    watch_t w;
+    int ii, jj, wd;
+
+    memset(&w, 0, sizeof(w));
+    w.ctx = ctx;
+    w.opts = *opts;
+    w.dups = opts->dups;
+    w.opts.dups = 0;
+    w.next_item = ctx->item_id;
+    w.fd = inotify_init1(IN_CLOEXEC);
+    if (w.fd < 0) {
+        fprintf(ctx->log, "Failed to start watching: %s\n", strerror(errno));
+        return -1;
+    }
+    w.wd = calloc(count, sizeof(int));
+    w.null = fopen("/dev/null", "w");
+    ctx->opts = &w.opts;
 
     for (ii = 0; ii < count; ii++) {
-        if (pl->list_count != pl_list[ii]->list_count ||
-            pl->duration != pl_list[ii]->duration) {
+        struct stat st;
+        str_t path = {0,};
+        str_list_t list = {0,};
+        watch_file_t *file;
+
+        if (stat(args[ii], &st)) {
             continue;
         }
-        for (jj = 0; jj < pl->list_count; jj++) {
-            MPLS_PI *pi1, *pi2;
-
-            pi1 = &pl->play_item[jj];
-            pi2 = &pl_list[ii]->play_item[jj];
-
-            if (memcmp(pi1->clip_id, pi2->clip_id, 5) != 0 ||
-                pi1->in_time != pi2->in_time ||
-                pi1->out_time != pi2->out_time) {
-                break;
+        if (!S_ISDIR(st.st_mode) && _has_ext(args[ii], ".iso")) {
+            // Images do not change, they are dumped once
+            _process_iso(ctx, args[ii]);
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            file = _watch_add(&w, args[ii]);
+            if (file != NULL) {
+                _watch_file(&w, file);
             }
+            continue;
         }
-        if (jj != pl->list_count) {
+        if (!w.opts.json) {
+            fprintf(ctx->out, "Directory: %s:\n", args[ii]);
+        }
+        if (_list_playlists(ctx, args[ii], &path, &list) < 0) {
             continue;
         }
-        return 0;
+        wd = inotify_add_watch(w.fd, path.buf, WATCH_EVENTS);
+        if (wd < 0) {
+            fprintf(ctx->log, "Failed to watch %s: %s\n", path.buf, strerror(errno));
+        } else {
+            w.wd[w.dirs.count] = wd;
+            str_list_append(&w.dirs, path.buf);
+        }
+        for (jj = 0; jj < list.count; jj++) {
+            file = _watch_add(&w, list.item[jj]);
+            if (file != NULL) {
+                _watch_file(&w, file);
+            }
+        }
+        str_list_free(&list);
+        str_free(&path);
     }
-    return 1;
-}
+    _watch_flush(&w);
 
-static int
-_find_repeats(MPLS_PL *pl, const char *m2ts)
-{
-    int ii, count = 0;
+    // Stop cleanly so the output is flushed and the cache written back
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _watch_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    _watch_run(&w);
 
-    for (ii = 0; ii < pl->list_count; ii++) {
-        MPLS_PI *pi;
-        str_t *m2ts_file;
-
-        pi = &pl->play_item[ii];
-        m2ts_file = str_substr(pi->clip_id, 0, 5);
-        // Ignore titles with repeated segments
-        if (strcmp(m2ts_file->buf, m2ts) == 0) {
-            count++;
-        }
-        str_free(m2ts_file);
-        free(m2ts_file);
+    ctx->opts = opts;
+    for (ii = 0; ii < w.count; ii++) {
+        free(w.file[ii].name);
+        str_list_free(&w.file[ii].written);
     }
-    return count;
+    if (w.null != NULL) {
+        fclose(w.null);
+    }
+    free(w.file);
+    free(w.wd);
+    str_list_free(&w.dirs);
+    hash_set_free(&w.seen);
+    close(w.fd);
+    return 0;
 }
 
+#else
+
 static int
-_filter_short(MPLS_PL *pl, int seconds)
+_watch(dump_ctx_t *ctx, char **args, int count)
 {
-    // Ignore short playlists
-    if (pl->duration / 45000 <= seconds) {
-        return 0;
-    }
-    return 1;
+    fprintf(ctx->log, "--watch is not available on this platform\n");
+    return -1;
 }
 
+#endif
+
+// Names for the coding types of --query
+static const value_map_t codec_map[] = {
+    {0x01, "mpeg1"},
+    {0x02, "mpeg2"},
+    {0x1b, "h264"},
+    {0x20, "mvc"},
+    {0x24, "hevc"},
+    {0xea, "vc1"},
+    {0x80, "lpcm"},
+    {0x81, "ac3"},
+    {0x82, "dts"},
+    {0x83, "truehd"},
+    {0x84, "eac3"},
+    {0x85, "dtshd"},
+    {0x86, "dtsma"},
+    {0xa1, "eac3-secondary"},
+    {0xa2, "dtshd-secondary"},
+    {0x90, "pgs"},
+    {0x92, "textst"},
+    {0, NULL}
+};
+
+// A codec name, a hexadecimal coding type or a three letter language
 static int
-_filter_repeats(MPLS_PL *pl, int repeats)
+_query_stream(MPLS_INDEX_QUERY *query, uint8_t kind, char *val)
 {
+    char *part, *next;
     int ii;
 
-    for (ii = 0; ii < pl->list_count; ii++) {
-        MPLS_PI *pi;
-        str_t *m2ts_file;
-
-        pi = &pl->play_item[ii];
-        m2ts_file = str_substr(pi->clip_id, 0, 5);
-        // Ignore titles with repeated segments
-        if (_find_repeats(pl, m2ts_file->buf) > repeats) {
+    if (query->num_terms >= MPLS_INDEX_MAX_TERMS) {
+        return 0;
+    }
+    query->term[query->num_terms].kind = kind;
+    query->term[query->num_terms].coding = -1;
+    query->term[query->num_terms].lang = 0;
+    for (part = val; part != NULL; part = next) {
+        next = strchr(part, ':');
+        if (next != NULL) {
+            *next++ = 0;
+        }
+        for (ii = 0; codec_map[ii].str != NULL; ii++) {
+            if (strcasecmp(part, codec_map[ii].str) == 0) {
+                break;
+            }
+        }
+        if (codec_map[ii].str != NULL) {
+            query->term[query->num_terms].coding = codec_map[ii].value;
+        } else if (strncasecmp(part, "0x", 2) == 0 && strlen(part) > 2 &&
+                   strlen(part) <= 4 && strspn(part + 2, "0123456789abcdefABCDEF") == strlen(part + 2)) {
+            query->term[query->num_terms].coding = strtol(part + 2, NULL, 16);
+        } else if (strlen(part) == 3 && strspn(part, "abcdefghijklmnopqrstuvwxyz") == 3) {
+            query->term[query->num_terms].lang = part[0] << 16 | part[1] << 8 | part[2];
+        } else {
             return 0;
         }
-        str_free(m2ts_file);
-        free(m2ts_file);
     }
+    query->num_terms++;
     return 1;
 }
 
-static void
-_make_path(str_t *path, char *root, char *dir)
+static int
+_query_term(MPLS_INDEX_QUERY *query, char *term)
 {
-    struct stat st_buf;
-    char *base;
+    char *val;
 
-    base = basename(root);
-    if (strcmp(base, dir) == 0) {
-        str_printf(path, "%s", root);
-    } else if (strcmp(base, "BDMV") != 0) {
-        str_printf(path, "%s/BDMV/%s", root, dir);
-    } else {
-        str_printf(path, "%s/%s", root, dir);
+    val = strchr(term, '=');
+    if (val == NULL || val[1] == 0) {
+        return 0;
     }
-
-    if (stat(path->buf, &st_buf) || !S_ISDIR(st_buf.st_mode)) {
-        str_free(path);
+    *val++ = 0;
+    if (strcmp(term, "min") == 0) {
+        query->min_duration = atof(val) * 45000;
+    } else if (strcmp(term, "max") == 0) {
+        query->max_duration = atof(val) * 45000;
+    } else if (strcmp(term, "marks") == 0) {
+        query->min_marks = atoi(val);
+    } else if (strcmp(term, "clip") == 0) {
+        if (strlen(val) != 5 || strspn(val, "0123456789") != 5) {
+            return 0;
+        }
+        query->clip = atoi(val);
+    } else if (strcmp(term, "video") == 0) {
+        return _query_stream(query, MPLS_INDEX_VIDEO, val);
+    } else if (strcmp(term, "audio") == 0) {
+        return _query_stream(query, MPLS_INDEX_AUDIO, val);
+    } else if (strcmp(term, "pg") == 0) {
+        return _query_stream(query, MPLS_INDEX_PG, val);
+    } else {
+        return 0;
     }
+    return 1;
 }
 
-static MPLS_PL*
-_process_file(char *prefix, char *name, MPLS_PL *pl_list[], int pl_count)
+// --query: the playlists of the index that match every term
+static int
+_query(char *dir, char **args, int count, int json)
 {
-    MPLS_PL *pl;
+    MPLS_INDEX_QUERY query;
+    MPLS_INDEX_MAP *map;
+    json_writer_t jw;
+    uint8_t *match;
+    uint32_t pp;
+    int ii;
 
-    pl = calloc(1, sizeof(MPLS_PL));
-    pl = mpls_parse(name, verbose);
-    if (pl == NULL) {
-        fprintf(stderr, "Parse failed: %s\n", name);
-        return NULL;
-    }
-    if (seconds) {
-        if (!_filter_short(pl, seconds)) {
-            mpls_free(&pl);
-            return NULL;
+    memset(&query, 0, sizeof(query));
+    query.clip = -1;
+    for (ii = 0; ii < count; ii++) {
+        char *term = strdup(args[ii]);
+
+        if (term == NULL || !_query_term(&query, term)) {
+            fprintf(stderr, "Invalid query term: %s\n", args[ii]);
+            X_FREE(term);
+            return -1;
         }
+        free(term);
     }
-    if (repeats) {
-        if (!_filter_repeats(pl, repeats)) {
-            mpls_free(&pl);
-            return NULL;
-        }
+    map = mpls_index_open(dir);
+    if (map == NULL) {
+        return -1;
     }
-    if (dups) {
-        if (!_filter_dup(pl_list, pl_count, pl)) {
-            mpls_free(&pl);
-            return NULL;
-        }
+    match = malloc(map->num_playlists ? map->num_playlists : 1);
+    if (match == NULL || (json && json_init(&jw, stdout, JSON_BUF_SIZE) < 0)) {
+        X_FREE(match);
+        mpls_index_close(map);
+        return -1;
     }
-    _show_marks(prefix, pl);
-    return pl;
-}
+    mpls_index_query(map, &query, match);
 
-static void
-_usage(char *cmd)
-{
-    fprintf(stderr, 
-"Usage: %s -vli <mpls file> [<mpls file> ...]\n"
-"With no options, produces a list of the playlist(s) with durations\n"
-"Options:\n"
-"    v             - Verbose output.\n"
-"    r <N>         - Filter out titles that have >N repeating clips\n"
-"    d             - Filter out duplicate titles\n"
-"    s <seconds>   - Filter out short titles\n"
-"    f             - Filter combination -r2 -d -s120\n"
-"\n"
-"    p <prefix>    - chapter output prefix (63 chars max)\n"
-"    e             - split chapters at new file\n"
-"    c <seconds>   - split chapters at first segment after <seconds>\n"
-"                    * can be repeated for multiple cuts\n"
-"    i <files>     - only include files (ex: -i 00001,00002,00005)\n"
-, cmd);
+    for (pp = 0; pp < map->num_playlists; pp++) {
+        const char *name = map->strings + map->pl_name[pp];
+        uint32_t duration = map->pl_duration[pp];
 
-    exit(EXIT_FAILURE);
+        if (!match[pp]) {
+            continue;
+        }
+        if (json) {
+            json_object_begin(&jw, NULL);
+            json_string(&jw, "file", name);
+            json_string(&jw, "disc", map->strings + map->disc_name[map->pl_disc[pp]]);
+            json_uint(&jw, "duration", duration);
+            json_fixed(&jw, "seconds", duration / 45000.0, 3);
+            json_object_end(&jw);
+            json_end_record(&jw);
+        } else {
+            printf("%s -- %02u:%02u:%06.3f\n", name, duration / (45000 * 3600),
+                   duration / (45000 * 60) % 60, fmod(duration / 45000.0, 60));
+        }
+    }
+    if (json) {
+        json_flush(&jw);
+        json_free(&jw);
+    }
+    free(match);
+    mpls_index_close(map);
+    return 0;
 }
 
-#define OPTS "vfr:ds:p:ec:i:"
-
+// Fills "opts" from the command line or a server request.  Returns the
+// index of the first file argument, -1 on an unknown option.
 static int
-_qsort_str_cmp(const void *a, const void *b)
-{
-    char *stra = *(char**)a;
-    char *strb = *(char**)b;
-
-    return strcmp(stra, strb);
-}
-
-int
-main(int argc, char *argv[])
+_parse_opts(dump_opts_t *opts, run_opts_t *run, int argc, char *argv[])
 {
-    MPLS_PL *pl;
     int opt;
-    int ii, pl_ii;
-    MPLS_PL *pl_list[1000];
-    struct stat st;
-    str_t path = {0,};
-    DIR *dir = NULL;
-    char prefix[64] = {0};
+    int ncuts = 0;
 
-    for (size_t i = 0; i < sizeof(cut_seconds) / sizeof(cut_seconds[0]); i++)
-    {
-        cut_seconds[i] = -1.0;
-    }
+    dump_opts_init(opts);
+    memset(run, 0, sizeof(*run));
+    // glibc and musl restart the scan when optind is 0
+    optind = 0;
 
     do {
-        opt = getopt(argc, argv, OPTS);
+        opt = getopt_long(argc, argv, OPTS, long_opts, NULL);
         switch (opt) {
             case -1: 
                 break;
 
             case 'v':
-                verbose = 1;
+                opts->verbose = 1;
                 break;
 
             case 'd':
-                dups = 1;
+                opts->dups = 1;
                 break;
 
             case 'r':
-                repeats = atoi(optarg);
+                opts->repeats = atoi(optarg);
                 break;
 
             case 'f':
-                repeats = 2;
-                dups = 1;
-                seconds = 120;
+                opts->repeats = 2;
+                opts->dups = 1;
+                opts->seconds = 120;
                 break;
 
             case 's':
-                seconds = atoi(optarg);
+                opts->seconds = atoi(optarg);
+                break;
+
+            case 'j':
+                opts->jobs = atoi(optarg);
+                if (opts->jobs < 1) {
+                    opts->jobs = 1;
+                }
                 break;
 
             case 'p':
-                strncpy(prefix, optarg, sizeof(prefix) - 1);
+                strncpy(opts->prefix, optarg, sizeof(opts->prefix) - 1);
                 break;
 
             case 'e':
-                cut_at_new_file = 1;
+                opts->cut_at_new_file = 1;
                 break;
 
             case 'c':
-                cut_seconds[cut_seconds_idx++] = atof(optarg);
+                // Keep the last slot at -1 so the list stays terminated
+                if (ncuts < MAX_CUTS - 1) {
+                    opts->cut_seconds[ncuts++] = atof(optarg);
+                }
                 break;
 
             case 'i':
-                strncpy(included_files + 1, optarg, sizeof(included_files) - 2);
-                included_files[0] = ',';
-                included_files[strlen(included_files)] = ',';
+                strncpy(opts->included_files + 1, optarg, sizeof(opts->included_files) - 2);
+                opts->included_files[0] = ',';
+                opts->included_files[strlen(opts->included_files)] = ',';
                 break;
 
-            default:
-                _usage(argv[0]);
+            case '@':
+                run->manifest = optarg;
+                break;
+
+            case 'R':
+                run->recursive = 1;
+                break;
+
+            case OPT_CACHE:
+                run->cache = optarg;
+                break;
+
+            case OPT_JSON:
+                opts->json = 1;
+                break;
+
+            case OPT_SERVE:
+                run->serve = optarg;
+                break;
+
+            case OPT_CONNECT:
+                run->connect = optarg;
+                break;
+
+            case OPT_WATCH:
+                run->watch = 1;
+                break;
+
+            case OPT_PHYSICAL:
+                opts->physical = 1;
+                break;
+
+            case OPT_TITLES:
+                opts->titles_only = 1;
+                break;
+
+            case OPT_INDEX:
+                run->index = optarg;
+                break;
+
+            case OPT_QUERY:
+                run->query = optarg;
+                break;
+
+            case OPT_CATALOG:
+                run->catalog = optarg;
                 break;
+
+            default:
+                return -1;
         }
     } while (opt != -1);
 
-    if (optind >= argc) {
-        _usage(argv[0]);
-    }
+    return optind;
+}
 
-    cut_seconds_idx = 0;
+typedef struct {
+    dump_opts_t  opts;
+    dump_ctx_t   ctx;
+    MPLS_CACHE  *cache;
+} serve_state_t;
 
-    for (pl_ii = 0, ii = optind; pl_ii < 1000 && ii < argc; ii++) {
-        if (stat(argv[ii], &st)) {
-            continue;
+// One request of --serve, the reply is the --json output followed by a
+// status record
+static int
+_serve_request(void *handle, int argc, char **argv, FILE *out)
+{
+    serve_state_t *state = handle;
+    run_opts_t run;
+    int first, ii;
+
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        pthread_mutex_lock(&state->ctx.dup_lock);
+        hash_set_free(&state->ctx.dup_set);
+        pthread_mutex_unlock(&state->ctx.dup_lock);
+        fprintf(out, "{\"status\":\"ok\"}\n");
+        return 0;
+    }
+    first = _parse_opts(&state->opts, &run, argc, argv);
+    if (first < 0 || run.cache != NULL || run.serve != NULL || run.connect != NULL || run.watch ||
+        run.index != NULL || run.query != NULL || run.catalog != NULL ||
+        (run.manifest != NULL && strcmp(run.manifest, "-") == 0) ||
+        (first >= argc && run.manifest == NULL)) {
+        fprintf(out, "{\"status\":\"error\",\"error\":\"invalid request\"}\n");
+        return 0;
+    }
+    state->opts.json = 1;
+    state->opts.cache = state->cache;
+
+    dump_ctx_begin(&state->ctx, &state->opts, out);
+    if (run.recursive) {
+        _scan(&state->ctx, argv + first, argc - first);
+    } else {
+        for (ii = first; ii < argc; ii++) {
+            _process_arg(&state->ctx, argv[ii]);
         }
-        dir = NULL;
-        if (S_ISDIR(st.st_mode)) {
-            printf("Directory: %s:\n", argv[ii]);
-            _make_path(&path, argv[ii], "PLAYLIST");
-            if (path.buf == NULL) {
-                fprintf(stderr, "Failed to find playlist path: %s\n", argv[ii]);
+    }
+    if (run.manifest != NULL) {
+        _process_manifest(&state->ctx, run.manifest);
+    }
+    dump_ctx_end(&state->ctx);
+    fprintf(out, "{\"status\":\"ok\"}\n");
+    return 0;
+}
+
+static int
+_serve(char *socket, MPLS_CACHE *cache, char *cmd)
+{
+    serve_state_t state;
+    int ret;
+
+    dump_opts_init(&state.opts);
+    state.cache = cache;
+    dump_ctx_init(&state.ctx, &state.opts, stdout, stderr);
+    ret = serve_listen(socket, cmd, _serve_request, &state);
+    dump_ctx_free(&state.ctx);
+    return ret;
+}
+
+// Hands the command line to a server.  File arguments are made absolute
+// since the server resolves them from its own working directory.
+static int
+_connect(char *socket, int argc, char *argv[], int first)
+{
+    char **req;
+    char last[256];
+    int count = 0, ii, ret;
+
+    req = calloc(argc, sizeof(char*));
+    if (req == NULL) {
+        return EXIT_FAILURE;
+    }
+    for (ii = 1; ii < argc; ii++) {
+        if (ii < first) {
+            if (strcmp(argv[ii], "--connect") == 0) {
+                ii++;
                 continue;
             }
-            dir = opendir(path.buf);
-            if (dir == NULL) {
-                fprintf(stderr, "Failed to open dir: %s\n", path.buf);
-                str_free(&path);
+            if (strncmp(argv[ii], "--connect=", 10) == 0) {
                 continue;
             }
-        }
-        if (dir != NULL) {
-            char **dirlist = calloc(10001, sizeof(char*));
-            struct dirent *ent;
-            int jj = 0;
-            for (ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
-                if (ent->d_name != NULL) {
-                    dirlist[jj++] = strdup(ent->d_name);
-                }
-            }
-            qsort(dirlist, jj, sizeof(char*), _qsort_str_cmp);
-            for (jj = 0; dirlist[jj] != NULL; jj++) {
-                str_t name = {0,};
-                str_printf(&name, "%s/%s", path.buf, dirlist[jj]);
-                free(dirlist[jj]);
-                if (stat(name.buf, &st)) {
-                    str_free(&name);
-                    continue;
-                }
-                if (!S_ISREG(st.st_mode)) {
-                    str_free(&name);
-                    continue;
-                }
-                pl = _process_file(prefix, name.buf, pl_list, pl_ii);
-                str_free(&name);
-                if (pl != NULL) {
-                    pl_list[pl_ii++] = pl;
-                }
-            } while (ent != NULL);
-            free(dirlist);
-            str_free(&path);
+            req[count++] = strdup(argv[ii]);
         } else {
-            pl = _process_file(prefix, argv[ii], pl_list, pl_ii);
-            if (pl != NULL) {
-                pl_list[pl_ii++] = pl;
+#if !defined(_WIN32)
+            req[count] = realpath(argv[ii], NULL);
+#endif
+            if (req[count] == NULL) {
+                req[count] = strdup(argv[ii]);
             }
+            count++;
         }
     }
-    // Cleanup
-    for (ii = 0; ii < pl_ii; ii++) {
-        mpls_free(&pl_list[ii]);
+    ret = serve_request(socket, count, req, "{\"status\":", stdout, last, sizeof(last));
+    for (ii = 0; ii < count; ii++) {
+        free(req[ii]);
     }
-    return 0;
+    free(req);
+    if (ret < 0 || strstr(last, "\"ok\"") == NULL) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
 }
 
+int
+main(int argc, char *argv[])
+{
+    dump_opts_t opts;
+    dump_ctx_t ctx;
+    run_opts_t run;
+    int first;
+    int ii;
+    int ret = 0;
+
+    first = _parse_opts(&opts, &run, argc, argv);
+    if (first < 0) {
+        _usage(argv[0]);
+    }
+    if (run.connect != NULL) {
+        return _connect(run.connect, argc, argv, first);
+    }
+    if (run.query != NULL) {
+        if (run.index != NULL || run.catalog != NULL || run.serve != NULL || run.watch ||
+            run.recursive || run.manifest != NULL) {
+            _usage(argv[0]);
+        }
+        ret = _query(run.query, argv + first, argc - first, opts.json) < 0;
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (run.cache != NULL) {
+        opts.cache = mpls_cache_open(run.cache);
+    }
+    if (run.serve != NULL) {
+        if (first < argc || run.manifest != NULL || run.index != NULL || run.catalog != NULL) {
+            _usage(argv[0]);
+        }
+        ret = _serve(run.serve, opts.cache, argv[0]) < 0;
+        mpls_cache_close(opts.cache);
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (first >= argc && run.manifest == NULL) {
+        _usage(argv[0]);
+    }
+    if (run.watch && (first >= argc || run.manifest != NULL || run.recursive ||
+                      run.index != NULL)) {
+        _usage(argv[0]);
+    }
+
+    if (run.index != NULL) {
+        opts.index = mpls_index_create();
+        if (opts.index == NULL) {
+            fprintf(stderr, "Failed to create index %s\n", run.index);
+            return EXIT_FAILURE;
+        }
+    }
+    if (run.catalog != NULL) {
+        opts.catalog = mpls_catalog_open(run.catalog);
+        if (opts.catalog == NULL) {
+            mpls_index_free(opts.index);
+            return EXIT_FAILURE;
+        }
+    }
+
+    dump_ctx_init(&ctx, &opts, stdout, stderr);
+    if (run.watch) {
+        ret = _watch(&ctx, argv + first, argc - first);
+        dump_ctx_free(&ctx);
+        mpls_cache_close(opts.cache);
+        if (mpls_catalog_close(opts.catalog) < 0) {
+            ret = -1;
+        }
+        return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (run.recursive) {
+        _scan(&ctx, argv + first, argc - first);
+    } else {
+        for (ii = first; ii < argc; ii++) {
+            _process_arg(&ctx, argv[ii]);
+        }
+    }
+    if (run.manifest != NULL) {
+        _process_manifest(&ctx, run.manifest);
+    }
+    // Cleanup
+    dump_ctx_free(&ctx);
+    if (opts.cache != NULL) {
+        mpls_cache_close(opts.cache);
+    }
+    if (opts.index != NULL) {
+        ret = mpls_index_write(opts.index, run.index) < 0;
+        mpls_index_free(opts.index);
+    }
+    if (mpls_catalog_close(opts.catalog) < 0) {
+        ret = 1;
+    }
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "bits.h"
+#include "mpls_gen.h"
+
+// Fixed sizes of the structures written below, in bytes
+#define GEN_HEADER_LEN      40
+#define GEN_APPINFO_LEN     18
+#define GEN_ITEM_LEN        32      // clip id up to still_time
+#define GEN_ANGLE_LEN       10
+#define GEN_STN_LEN         14      // STN header after the length field
+#define GEN_STREAM_LEN      16      // entry and attributes, with lengths
+#define GEN_MARK_LEN        14
+
+static const char *langs[] = {"jpn", "eng", "fra", "deu", "spa", "ita", "chi", "kor"};
+
+uint32_t
+mpls_gen_rand(uint32_t *seed)
+{
+    // xorshift32, the generator has to be repeatable across platforms
+    uint32_t x = *seed ? *seed : 0x2545f491;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+static int
+_rand_range(uint32_t *seed, int lo, int hi)
+{
+    return lo + mpls_gen_rand(seed) % (hi - lo + 1);
+}
+
+// Picks a playlist shape.  Most are the short extras and episode lists
+// found on real discs, a few are seamless branching features with
+// hundreds of items and some push the 16 bit counts to their limit.
+void
+mpls_gen_random(MPLS_GEN *gen, uint32_t *seed)
+{
+    int kind = mpls_gen_rand(seed) % 100;
+
+    memset(gen, 0, sizeof(*gen));
+    gen->version = _rand_range(seed, 1, 3);
+    if (kind < 70) {
+        gen->play_items = _rand_range(seed, 1, 8);
+        gen->item_time = 45000 * _rand_range(seed, 10, 3600);
+    } else if (kind < 95) {
+        gen->play_items = _rand_range(seed, 8, 64);
+        gen->item_time = 45000 * _rand_range(seed, 30, 600);
+    } else if (kind < 99) {
+        gen->play_items = _rand_range(seed, 100, 2000);
+        gen->item_time = 45000 * _rand_range(seed, 1, 30);
+    } else {
+        gen->play_items = _rand_range(seed, 2000, 65535);
+        gen->item_time = 45000 / _rand_range(seed, 1, 8);
+    }
+    gen->marks = _rand_range(seed, 0, gen->play_items * 3);
+    if (gen->marks > 65535) {
+        gen->marks = 65535;
+    }
+    gen->clips = gen->play_items;
+    if (mpls_gen_rand(seed) % 5 == 0) {
+        gen->clips = gen->play_items / 3 + 1;
+    }
+    if (mpls_gen_rand(seed) % 7 == 0) {
+        gen->angle_every = _rand_range(seed, 1, 8);
+        gen->angles = _rand_range(seed, 2, 9);
+    }
+    gen->num_video = 1;
+    gen->num_audio = _rand_range(seed, 1, 8);
+    gen->num_pg = _rand_range(seed, 0, 16);
+    gen->num_ig = _rand_range(seed, 0, 1);
+    if (mpls_gen_rand(seed) % 20 == 0) {
+        gen->num_audio = _rand_range(seed, 8, 255);
+        gen->num_pg = _rand_range(seed, 16, 255);
+    }
+}
+
+static int
+_is_multi_angle(const MPLS_GEN *gen, int item)
+{
+    return gen->angle_every > 0 && item % gen->angle_every == 0;
+}
+
+static int
+_num_streams(const MPLS_GEN *gen)
+{
+    return gen->num_video + gen->num_audio + gen->num_pg + gen->num_ig;
+}
+
+// Length of one play item, not counting its 16 bit length field
+static size_t
+_item_len(const MPLS_GEN *gen, int item)
+{
+    size_t len = GEN_ITEM_LEN;
+
+    if (_is_multi_angle(gen, item)) {
+        len += 2 + GEN_ANGLE_LEN * (gen->angles - 1);
+    }
+    return len + 2 + GEN_STN_LEN + GEN_STREAM_LEN * _num_streams(gen);
+}
+
+static size_t
+_list_len(const MPLS_GEN *gen)
+{
+    size_t len = 6;
+    int ii;
+
+    for (ii = 0; ii < gen->play_items; ii++) {
+        len += 2 + _item_len(gen, ii);
+    }
+    return len;
+}
+
+size_t
+mpls_gen_size(const MPLS_GEN *gen)
+{
+    return GEN_HEADER_LEN + GEN_APPINFO_LEN + 4 + _list_len(gen) +
+           4 + 2 + GEN_MARK_LEN * gen->marks;
+}
+
+static void
+_gen_clip_id(BITSTREAM *bs, int clip)
+{
+    char id[6];
+
+    snprintf(id, sizeof(id), "%05u", (unsigned)clip % 100000);
+    bs_write(bs, 32, (uint32_t)id[0] << 24 | id[1] << 16 | id[2] << 8 | id[3]);
+    bs_write(bs, 8, id[4]);
+    bs_write(bs, 32, 'M' << 24 | '2' << 16 | 'T' << 8 | 'S');
+}
+
+static void
+_gen_lang(BITSTREAM *bs, int idx)
+{
+    const char *lang = langs[idx % (sizeof(langs) / sizeof(langs[0]))];
+
+    bs_write(bs, 24, lang[0] << 16 | lang[1] << 8 | lang[2]);
+}
+
+static void
+_gen_stream(BITSTREAM *bs, uint16_t pid, uint8_t coding, int idx)
+{
+    // Stream entry, a clip stream referenced by PID
+    bs_write(bs, 8, 9);
+    bs_write(bs, 8, 1);
+    bs_write(bs, 16, pid);
+    bs_skip(bs, 6 * 8);
+
+    // Stream attributes
+    bs_write(bs, 8, 5);
+    bs_write(bs, 8, coding);
+    switch (coding) {
+        case 0x1b:
+            bs_write(bs, 4, 6);
+            bs_write(bs, 4, 1);
+            bs_skip(bs, 3 * 8);
+            break;
+
+        case 0x81:
+        case 0x83:
+        case 0x86:
+            bs_write(bs, 4, 1);
+            bs_write(bs, 4, 1);
+            _gen_lang(bs, idx);
+            break;
+
+        default:
+            _gen_lang(bs, idx);
+            bs_skip(bs, 8);
+            break;
+    }
+}
+
+static void
+_gen_stn(BITSTREAM *bs, const MPLS_GEN *gen)
+{
+    static const uint8_t audio_coding[] = {0x83, 0x81, 0x86};
+    int ii;
+
+    bs_write(bs, 16, GEN_STN_LEN + GEN_STREAM_LEN * _num_streams(gen));
+    bs_skip(bs, 16);
+    bs_write(bs, 8, gen->num_video);
+    bs_write(bs, 8, gen->num_audio);
+    bs_write(bs, 8, gen->num_pg);
+    bs_write(bs, 8, gen->num_ig);
+    bs_write(bs, 8, 0);
+    bs_write(bs, 8, 0);
+    bs_write(bs, 8, 0);
+    bs_skip(bs, 5 * 8);
+
+    for (ii = 0; ii < gen->num_video; ii++) {
+        _gen_stream(bs, 0x1011 + ii, 0x1b, ii);
+    }
+    for (ii = 0; ii < gen->num_audio; ii++) {
+        _gen_stream(bs, 0x1100 + ii, audio_coding[ii % 3], ii);
+    }
+    for (ii = 0; ii < gen->num_pg; ii++) {
+        _gen_stream(bs, 0x1200 + ii, 0x90, ii);
+    }
+    for (ii = 0; ii < gen->num_ig; ii++) {
+        _gen_stream(bs, 0x1400 + ii, 0x91, ii);
+    }
+}
+
+static uint32_t
+_in_time(const MPLS_GEN *gen, int item)
+{
+    // Spread the items over the clips so they don't all start at zero
+    return 27000000 + (item / gen->clips) * gen->item_time;
+}
+
+static void
+_gen_playitem(BITSTREAM *bs, const MPLS_GEN *gen, int item)
+{
+    static const uint8_t conditions[] = {1, 5, 6};
+    uint32_t in_time = _in_time(gen, item);
+    int multi = _is_multi_angle(gen, item);
+    int ii;
+
+    bs_write(bs, 16, _item_len(gen, item));
+    _gen_clip_id(bs, item % gen->clips + 1);
+    bs_skip(bs, 11);
+    bs_write(bs, 1, multi);
+    bs_write(bs, 4, item ? conditions[item % 3] : 1);
+    bs_write(bs, 8, 0);
+    bs_write(bs, 32, in_time);
+    bs_write(bs, 32, in_time + gen->item_time);
+    // UO_mask_table, random_access_flag, still_mode and still_time
+    bs_skip(bs, 12 * 8);
+
+    if (multi) {
+        bs_write(bs, 8, gen->angles);
+        bs_write(bs, 8, 0);
+        for (ii = 1; ii < gen->angles; ii++) {
+            _gen_clip_id(bs, 90000 + ii);
+            bs_write(bs, 8, 0);
+        }
+    }
+    _gen_stn(bs, gen);
+}
+
+static void
+_gen_marks(BITSTREAM *bs, const MPLS_GEN *gen)
+{
+    int ii;
+
+    bs_write(bs, 32, 2 + GEN_MARK_LEN * gen->marks);
+    bs_write(bs, 16, gen->marks);
+    for (ii = 0; ii < gen->marks; ii++) {
+        // Mark ii sits at fraction ii / marks of the playlist
+        uint64_t pos = (uint64_t)ii * gen->play_items;
+        int item = pos / gen->marks;
+        uint64_t offset = (pos % gen->marks) * gen->item_time / gen->marks;
+
+        bs_write(bs, 8, 0);
+        bs_write(bs, 8, 1);
+        bs_write(bs, 16, item);
+        bs_write(bs, 32, _in_time(gen, item) + (uint32_t)offset);
+        bs_write(bs, 16, 0xffff);
+        bs_write(bs, 32, 0);
+    }
+}
+
+// Encodes the playlist described by gen into buf, which must hold at
+// least mpls_gen_size() bytes.  Returns the number of bytes written,
+// 0 if the buffer is too small or gen is out of range.
+size_t
+mpls_gen(const MPLS_GEN *gen, uint8_t *buf, size_t size)
+{
+    BITSTREAM bs;
+    size_t len, list_len;
+    uint32_t list_pos, mark_pos;
+    int ii;
+
+    if (gen->version < 1 || gen->version > 3 ||
+        gen->play_items < 1 || gen->play_items > 65535 ||
+        gen->marks < 0 || gen->marks > 65535 || gen->clips < 1 ||
+        (gen->angle_every && (gen->angles < 2 || gen->angles > 9)) ||
+        gen->num_video > 255 || gen->num_audio > 255 ||
+        gen->num_pg > 255 || gen->num_ig > 255) {
+        return 0;
+    }
+    len = mpls_gen_size(gen);
+    if (size < len) {
+        return 0;
+    }
+    list_len = _list_len(gen);
+    list_pos = GEN_HEADER_LEN + GEN_APPINFO_LEN;
+    mark_pos = list_pos + 4 + list_len;
+
+    memset(buf, 0, len);
+    bs_init_buf(&bs, buf, len);
+
+    // Header, the reserved bytes are left zero
+    bs_write(&bs, 32, 'M' << 24 | 'P' << 16 | 'L' << 8 | 'S');
+    bs_write(&bs, 32, '0' << 24 | ('0' + gen->version) << 16 | '0' << 8 | '0');
+    bs_write(&bs, 32, list_pos);
+    bs_write(&bs, 32, mark_pos);
+    bs_write(&bs, 32, 0);
+    bs_seek_byte(&bs, GEN_HEADER_LEN);
+
+    // AppInfoPlayList, sequential playback
+    bs_write(&bs, 32, GEN_APPINFO_LEN - 4);
+    bs_skip(&bs, 8);
+    bs_write(&bs, 8, 1);
+    bs_seek_byte(&bs, list_pos);
+
+    bs_write(&bs, 32, list_len);
+    bs_skip(&bs, 16);
+    bs_write(&bs, 16, gen->play_items);
+    bs_write(&bs, 16, 0);
+    for (ii = 0; ii < gen->play_items; ii++) {
+        _gen_playitem(&bs, gen, ii);
+    }
+
+    _gen_marks(&bs, gen);
+    if ((size_t)(bs_pos(&bs) >> 3) != len) {
+        return 0;
+    }
+    return len;
+}
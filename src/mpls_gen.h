@@ -0,0 +1,31 @@
+#if !defined(_MPLS_GEN_H_)
+#define _MPLS_GEN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Shape of a synthetic playlist.  Every play item carries the same STN
+// table, clip ids are "00001" up to clips and repeat when there are
+// fewer clips than play items.
+typedef struct
+{
+    int             version;        // 1 - 3, type indicator "0100" - "0300"
+    int             play_items;     // 1 - 65535
+    int             marks;          // 0 - 65535, spread over the play items
+    int             clips;          // distinct clip ids
+    int             angle_every;    // every Nth play item is multi angle, 0 for none
+    int             angles;         // 2 - 9
+    int             num_video;      // STN streams per play item, 0 - 255 each
+    int             num_audio;
+    int             num_pg;
+    int             num_ig;
+    uint32_t        item_time;      // 45 kHz ticks per play item
+} MPLS_GEN;
+
+// xorshift32 step, repeatable across platforms; a zero seed is replaced
+uint32_t mpls_gen_rand(uint32_t *seed);
+void mpls_gen_random(MPLS_GEN *gen, uint32_t *seed);
+size_t mpls_gen_size(const MPLS_GEN *gen);
+size_t mpls_gen(const MPLS_GEN *gen, uint8_t *buf, size_t size);
+
+#endif // _MPLS_GEN_H_
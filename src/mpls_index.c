@@ -0,0 +1,558 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if defined(_WIN32)
+#include <io.h>
+#endif
+#include "util.h"
+#include "bits.h"
+#include "mpls_index.h"
+
+#define MPLS_INDEX_MAGIC    ('M' << 24 | 'P' << 16 | 'L' << 8 | 'I')
+#define MPLS_INDEX_VERSION  1
+
+// index.hdr, in native byte order like the columns: on a machine of the
+// other order the magic does not match and the index is refused
+typedef struct
+{
+    uint32_t        magic;
+    uint32_t        version;
+    uint32_t        num_discs;
+    uint32_t        num_playlists;
+    uint32_t        num_items;
+    uint32_t        num_streams;
+    uint32_t        num_marks;
+    uint32_t        strings_size;
+} MPLS_INDEX_HDR;
+
+enum {
+    COL_DISC_NAME,
+    COL_DISC_FIRST,
+    COL_PL_DISC,
+    COL_PL_NAME,
+    COL_PL_DURATION,
+    COL_PL_FIRST_ITEM,
+    COL_PL_FIRST_STREAM,
+    COL_PL_FIRST_MARK,
+    COL_PI_CLIP,
+    COL_PI_IN,
+    COL_PI_OUT,
+    COL_ST_KIND,
+    COL_ST_CODING,
+    COL_ST_LANG,
+    COL_MK_TIME,
+    COL_STRINGS,
+};
+
+// Column files and the size of one row
+static const struct {
+    const char *name;
+    int         width;
+} _columns[MPLS_INDEX_COLUMNS] = {
+    { "disc_name",       4 },
+    { "disc_first",      4 },
+    { "pl_disc",         4 },
+    { "pl_name",         4 },
+    { "pl_duration",     4 },
+    { "pl_first_item",   4 },
+    { "pl_first_stream", 4 },
+    { "pl_first_mark",   4 },
+    { "pi_clip",         4 },
+    { "pi_in",           4 },
+    { "pi_out",          4 },
+    { "st_kind",         1 },
+    { "st_coding",       1 },
+    { "st_lang",         4 },
+    { "mk_time",         4 },
+    { "strings",         1 },
+};
+
+typedef struct
+{
+    uint8_t        *buf;
+    size_t          len;
+    size_t          alloc;
+} column_t;
+
+struct mpls_index_s
+{
+    MPLS_INDEX_HDR  hdr;
+    column_t        col[MPLS_INDEX_COLUMNS];
+    uint32_t        last_disc;      // name of the current disc in strings
+    int             failed;
+};
+
+// Row count of a column, "first" columns end with the child row count
+static uint64_t
+_rows(const MPLS_INDEX_HDR *hdr, int col)
+{
+    switch (col) {
+        case COL_DISC_NAME:
+            return hdr->num_discs;
+        case COL_DISC_FIRST:
+            return (uint64_t)hdr->num_discs + 1;
+        case COL_PL_DISC:
+        case COL_PL_NAME:
+        case COL_PL_DURATION:
+            return hdr->num_playlists;
+        case COL_PL_FIRST_ITEM:
+        case COL_PL_FIRST_STREAM:
+        case COL_PL_FIRST_MARK:
+            return (uint64_t)hdr->num_playlists + 1;
+        case COL_PI_CLIP:
+        case COL_PI_IN:
+        case COL_PI_OUT:
+            return hdr->num_items;
+        case COL_ST_KIND:
+        case COL_ST_CODING:
+        case COL_ST_LANG:
+            return hdr->num_streams;
+        case COL_MK_TIME:
+            return hdr->num_marks;
+        default:
+            return hdr->strings_size;
+    }
+}
+
+static int
+_col_add(column_t *col, const void *val, size_t len)
+{
+    if (col->len + len > col->alloc) {
+        size_t alloc = col->alloc ? col->alloc : 4096;
+        uint8_t *buf;
+
+        while (alloc < col->len + len) {
+            alloc *= 2;
+        }
+        buf = realloc(col->buf, alloc);
+        if (buf == NULL) {
+            return 0;
+        }
+        col->buf = buf;
+        col->alloc = alloc;
+    }
+    memcpy(col->buf + col->len, val, len);
+    col->len += len;
+    return 1;
+}
+
+static int
+_col_u32(column_t *col, uint32_t val)
+{
+    return _col_add(col, &val, sizeof(val));
+}
+
+static int
+_col_u8(column_t *col, uint8_t val)
+{
+    return _col_add(col, &val, sizeof(val));
+}
+
+static int
+_col_string(column_t *col, const char *str)
+{
+    return _col_add(col, str, strlen(str) + 1);
+}
+
+// Clip ids are five digits, anything else never matches a clip query
+static uint32_t
+_clip_number(const char *clip_id)
+{
+    uint32_t num = 0;
+    int ii;
+
+    for (ii = 0; ii < 5; ii++) {
+        if (clip_id[ii] < '0' || clip_id[ii] > '9') {
+            return UINT32_MAX;
+        }
+        num = num * 10 + clip_id[ii] - '0';
+    }
+    return num;
+}
+
+static int
+_add_streams(MPLS_INDEX *index, uint8_t kind, const MPLS_STREAM *ss, int count)
+{
+    column_t *col = index->col;
+    int ii, ok = 1;
+
+    for (ii = 0; ok && ii < count; ii++) {
+        ok = _col_u8(&col[COL_ST_KIND], kind) &&
+             _col_u8(&col[COL_ST_CODING], ss[ii].coding_type) &&
+             _col_u32(&col[COL_ST_LANG], ss[ii].lang[0] << 16 |
+                                         ss[ii].lang[1] << 8 |
+                                         ss[ii].lang[2]);
+    }
+    index->hdr.num_streams += count;
+    return ok;
+}
+
+MPLS_INDEX*
+mpls_index_create(void)
+{
+    MPLS_INDEX *index;
+
+    index = calloc(1, sizeof(MPLS_INDEX));
+    if (index == NULL) {
+        return NULL;
+    }
+    index->hdr.magic   = MPLS_INDEX_MAGIC;
+    index->hdr.version = MPLS_INDEX_VERSION;
+    return index;
+}
+
+// Adds "pl", read from "name" on "disc".  A new disc starts whenever
+// "disc" differs from the one of the previous playlist.  After a failure
+// the index is kept consistent by refusing to write it.
+int
+mpls_index_add(MPLS_INDEX *index, const char *disc, const char *name, const MPLS_PL *pl)
+{
+    MPLS_INDEX_HDR *hdr = &index->hdr;
+    column_t *col = index->col;
+    int ii, ok = 1;
+
+    if (index->failed) {
+        return -1;
+    }
+    if (hdr->num_discs == 0 ||
+        strcmp((char*)col[COL_STRINGS].buf + index->last_disc, disc) != 0) {
+        index->last_disc = col[COL_STRINGS].len;
+        ok = _col_u32(&col[COL_DISC_NAME], index->last_disc) &&
+             _col_u32(&col[COL_DISC_FIRST], hdr->num_playlists) &&
+             _col_string(&col[COL_STRINGS], disc);
+        hdr->num_discs++;
+    }
+
+    ok = ok && _col_u32(&col[COL_PL_DISC], hdr->num_discs - 1) &&
+               _col_u32(&col[COL_PL_NAME], col[COL_STRINGS].len) &&
+               _col_string(&col[COL_STRINGS], name) &&
+               _col_u32(&col[COL_PL_DURATION], pl->duration > UINT32_MAX ?
+                                               UINT32_MAX : pl->duration) &&
+               _col_u32(&col[COL_PL_FIRST_ITEM], hdr->num_items) &&
+               _col_u32(&col[COL_PL_FIRST_STREAM], hdr->num_streams) &&
+               _col_u32(&col[COL_PL_FIRST_MARK], hdr->num_marks);
+    hdr->num_playlists++;
+
+    for (ii = 0; ok && ii < pl->list_count; ii++) {
+        MPLS_PI *pi = &pl->play_item[ii];
+
+        ok = _col_u32(&col[COL_PI_CLIP], _clip_number(pi->clip_id)) &&
+             _col_u32(&col[COL_PI_IN], pi->in_time) &&
+             _col_u32(&col[COL_PI_OUT], pi->out_time);
+        hdr->num_items++;
+        if (pi->stn.video != NULL) {
+            ok = ok && _add_streams(index, MPLS_INDEX_VIDEO, pi->stn.video, pi->stn.num_video);
+        }
+        if (pi->stn.audio != NULL) {
+            ok = ok && _add_streams(index, MPLS_INDEX_AUDIO, pi->stn.audio, pi->stn.num_audio);
+        }
+        if (pi->stn.pg != NULL) {
+            ok = ok && _add_streams(index, MPLS_INDEX_PG, pi->stn.pg, pi->stn.num_pg);
+        }
+    }
+    for (ii = 0; ok && ii < pl->mark_count; ii++) {
+        ok = _col_u32(&col[COL_MK_TIME], pl->play_mark[ii].abs_start);
+        hdr->num_marks++;
+    }
+
+    if (!ok) {
+        index->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Each file goes through a temporary and a rename, so a reader that
+// still maps the old one keeps seeing it whole
+static int
+_write_file(const char *dir, const char *name, const void *buf, size_t len)
+{
+    str_t path = {0,}, tmp = {0,};
+    FILE *fp;
+    int ok;
+
+    str_printf(&path, "%s/%s", dir, name);
+    str_printf(&tmp, "%s.tmp", path.buf);
+    fp = fopen(tmp.buf, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to write index file %s\n", tmp.buf);
+        str_free(&path);
+        str_free(&tmp);
+        return 0;
+    }
+    ok = len == 0 || fwrite(buf, len, 1, fp) == 1;
+    ok = (fclose(fp) == 0) && ok;
+#if defined(_WIN32)
+    remove(path.buf);
+#endif
+    if (!ok || rename(tmp.buf, path.buf) != 0) {
+        fprintf(stderr, "Failed to write index file %s\n", path.buf);
+        remove(tmp.buf);
+        ok = 0;
+    }
+    str_free(&path);
+    str_free(&tmp);
+    return ok;
+}
+
+// Writes the index to "dir", created when missing.  The header goes
+// last, a reader that catches a rebuild half way finds columns that do
+// not match it and refuses the index.
+int
+mpls_index_write(MPLS_INDEX *index, const char *dir)
+{
+    MPLS_INDEX_HDR *hdr = &index->hdr;
+    column_t *col = index->col;
+    str_t name = {0,};
+    int ii, ok;
+
+    if (index->failed) {
+        fprintf(stderr, "Index incomplete, not written: %s\n", dir);
+        return -1;
+    }
+#if defined(_WIN32)
+    ok = mkdir(dir) == 0 || errno == EEXIST;
+#else
+    ok = mkdir(dir, 0777) == 0 || errno == EEXIST;
+#endif
+    if (!ok) {
+        fprintf(stderr, "Failed to create index directory %s\n", dir);
+        return -1;
+    }
+
+    // Close the "first" columns, then trim them back so the index can
+    // still be added to
+    ok = _col_u32(&col[COL_DISC_FIRST], hdr->num_playlists) &&
+         _col_u32(&col[COL_PL_FIRST_ITEM], hdr->num_items) &&
+         _col_u32(&col[COL_PL_FIRST_STREAM], hdr->num_streams) &&
+         _col_u32(&col[COL_PL_FIRST_MARK], hdr->num_marks);
+    hdr->strings_size = col[COL_STRINGS].len;
+    for (ii = 0; ok && ii < MPLS_INDEX_COLUMNS; ii++) {
+        str_printf(&name, "%s.col", _columns[ii].name);
+        ok = _write_file(dir, name.buf, col[ii].buf, col[ii].len);
+    }
+    ok = ok && _write_file(dir, "index.hdr", hdr, sizeof(*hdr));
+    str_free(&name);
+
+    col[COL_DISC_FIRST].len      = (size_t)hdr->num_discs * 4;
+    col[COL_PL_FIRST_ITEM].len   = (size_t)hdr->num_playlists * 4;
+    col[COL_PL_FIRST_STREAM].len = (size_t)hdr->num_playlists * 4;
+    col[COL_PL_FIRST_MARK].len   = (size_t)hdr->num_playlists * 4;
+    return ok ? 0 : -1;
+}
+
+void
+mpls_index_free(MPLS_INDEX *index)
+{
+    int ii;
+
+    if (index == NULL) {
+        return;
+    }
+    for (ii = 0; ii < MPLS_INDEX_COLUMNS; ii++) {
+        X_FREE(index->col[ii].buf);
+    }
+    X_FREE(index);
+}
+
+// "first" columns must rise from 0 to the child row count
+static int
+_check_first(const uint32_t *first, uint32_t count, uint32_t rows)
+{
+    uint32_t ii;
+
+    if (first[0] != 0 || first[count] != rows) {
+        return 0;
+    }
+    for (ii = 0; ii < count; ii++) {
+        if (first[ii] > first[ii + 1]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int
+_check_strings(const uint32_t *offsets, uint32_t count, const char *strings, uint32_t size)
+{
+    uint32_t ii;
+
+    for (ii = 0; ii < count; ii++) {
+        if (offsets[ii] >= size) {
+            return 0;
+        }
+    }
+    return count == 0 || strings[size - 1] == 0;
+}
+
+// Checks the offsets once, so queries can follow them blindly
+static int
+_check(const MPLS_INDEX_MAP *map, uint32_t strings_size)
+{
+    uint32_t ii;
+
+    for (ii = 0; ii < map->num_playlists; ii++) {
+        if (map->pl_disc[ii] >= map->num_discs) {
+            return 0;
+        }
+    }
+    return _check_first(map->disc_first, map->num_discs, map->num_playlists) &&
+           _check_first(map->pl_first_item, map->num_playlists, map->num_items) &&
+           _check_first(map->pl_first_stream, map->num_playlists, map->num_streams) &&
+           _check_first(map->pl_first_mark, map->num_playlists, map->num_marks) &&
+           _check_strings(map->disc_name, map->num_discs, map->strings, strings_size) &&
+           _check_strings(map->pl_name, map->num_playlists, map->strings, strings_size);
+}
+
+MPLS_INDEX_MAP*
+mpls_index_open(const char *dir)
+{
+    MPLS_INDEX_MAP *map;
+    MPLS_INDEX_HDR hdr;
+    BITSTREAM file;
+    str_t path = {0,};
+    int ii, ok;
+
+    str_printf(&path, "%s/index.hdr", dir);
+    if (bs_open(&file, path.buf) < 0) {
+        fprintf(stderr, "Failed to open index %s\n", dir);
+        str_free(&path);
+        return NULL;
+    }
+    ok = file.end == sizeof(hdr);
+    if (ok) {
+        memcpy(&hdr, file.buf, sizeof(hdr));
+        ok = hdr.magic == MPLS_INDEX_MAGIC && hdr.version == MPLS_INDEX_VERSION;
+    }
+    bs_close(&file);
+    map = ok ? calloc(1, sizeof(MPLS_INDEX_MAP)) : NULL;
+
+    for (ii = 0; map != NULL && ii < MPLS_INDEX_COLUMNS; ii++) {
+        str_printf(&path, "%s/%s.col", dir, _columns[ii].name);
+        if (bs_map(&map->file[ii], path.buf) < 0 ||
+            (uint64_t)map->file[ii].end != _rows(&hdr, ii) * _columns[ii].width) {
+            mpls_index_close(map);
+            map = NULL;
+        }
+    }
+    str_free(&path);
+    if (map == NULL) {
+        fprintf(stderr, "Invalid index %s\n", dir);
+        return NULL;
+    }
+
+    map->num_discs       = hdr.num_discs;
+    map->num_playlists   = hdr.num_playlists;
+    map->num_items       = hdr.num_items;
+    map->num_streams     = hdr.num_streams;
+    map->num_marks       = hdr.num_marks;
+    map->disc_name       = (const uint32_t*)map->file[COL_DISC_NAME].buf;
+    map->disc_first      = (const uint32_t*)map->file[COL_DISC_FIRST].buf;
+    map->pl_disc         = (const uint32_t*)map->file[COL_PL_DISC].buf;
+    map->pl_name         = (const uint32_t*)map->file[COL_PL_NAME].buf;
+    map->pl_duration     = (const uint32_t*)map->file[COL_PL_DURATION].buf;
+    map->pl_first_item   = (const uint32_t*)map->file[COL_PL_FIRST_ITEM].buf;
+    map->pl_first_stream = (const uint32_t*)map->file[COL_PL_FIRST_STREAM].buf;
+    map->pl_first_mark   = (const uint32_t*)map->file[COL_PL_FIRST_MARK].buf;
+    map->pi_clip         = (const uint32_t*)map->file[COL_PI_CLIP].buf;
+    map->pi_in           = (const uint32_t*)map->file[COL_PI_IN].buf;
+    map->pi_out          = (const uint32_t*)map->file[COL_PI_OUT].buf;
+    map->st_kind         = map->file[COL_ST_KIND].buf;
+    map->st_coding       = map->file[COL_ST_CODING].buf;
+    map->st_lang         = (const uint32_t*)map->file[COL_ST_LANG].buf;
+    map->mk_time         = (const uint32_t*)map->file[COL_MK_TIME].buf;
+    map->strings         = (const char*)map->file[COL_STRINGS].buf;
+
+    if (!_check(map, hdr.strings_size)) {
+        fprintf(stderr, "Invalid index %s\n", dir);
+        mpls_index_close(map);
+        return NULL;
+    }
+    return map;
+}
+
+void
+mpls_index_close(MPLS_INDEX_MAP *map)
+{
+    int ii;
+
+    if (map == NULL) {
+        return;
+    }
+    for (ii = 0; ii < MPLS_INDEX_COLUMNS; ii++) {
+        bs_close(&map->file[ii]);
+    }
+    X_FREE(map);
+}
+
+// The scans below are branch free over contiguous columns so the
+// compiler can vectorize them: first a pass over the playlist columns,
+// then, per term, an or-reduction over the child rows of each playlist
+// still in the running.
+uint32_t
+mpls_index_query(const MPLS_INDEX_MAP *map, const MPLS_INDEX_QUERY *query,
+                 uint8_t *match)
+{
+    const uint32_t *first;
+    uint32_t num = map->num_playlists;
+    uint32_t min = query->min_duration;
+    uint32_t max = query->max_duration ? query->max_duration : UINT32_MAX;
+    uint32_t pp, ii, count = 0;
+    int tt;
+
+    first = map->pl_first_mark;
+    for (pp = 0; pp < num; pp++) {
+        match[pp] = (map->pl_duration[pp] >= min) &
+                    (map->pl_duration[pp] <= max) &
+                    (first[pp + 1] - first[pp] >= query->min_marks);
+    }
+
+    if (query->clip >= 0) {
+        uint32_t clip = query->clip;
+
+        first = map->pl_first_item;
+        for (pp = 0; pp < num; pp++) {
+            uint8_t any = 0;
+
+            if (!match[pp]) {
+                continue;
+            }
+            for (ii = first[pp]; ii < first[pp + 1]; ii++) {
+                any |= map->pi_clip[ii] == clip;
+            }
+            match[pp] = any;
+        }
+    }
+
+    first = map->pl_first_stream;
+    for (tt = 0; tt < query->num_terms; tt++) {
+        uint8_t  kind       = query->term[tt].kind;
+        uint8_t  any_coding = query->term[tt].coding < 0;
+        uint8_t  coding     = query->term[tt].coding;
+        uint8_t  any_lang   = query->term[tt].lang == 0;
+        uint32_t lang       = query->term[tt].lang;
+
+        for (pp = 0; pp < num; pp++) {
+            uint8_t any = 0;
+
+            if (!match[pp]) {
+                continue;
+            }
+            for (ii = first[pp]; ii < first[pp + 1]; ii++) {
+                any |= (map->st_kind[ii] == kind) &
+                       (any_coding | (map->st_coding[ii] == coding)) &
+                       (any_lang | (map->st_lang[ii] == lang));
+            }
+            match[pp] = any;
+        }
+    }
+
+    for (pp = 0; pp < num; pp++) {
+        count += match[pp];
+    }
+    return count;
+}
@@ -0,0 +1,87 @@
+#if !defined(_MPLS_INDEX_H_)
+#define _MPLS_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bits.h"
+#include "mpls_parse.h"
+
+// Columnar index of the playlists of a library.  The playlists, their
+// play items, streams and marks are flattened into one file per field
+// ("struct of arrays") in a directory, in native byte order, so a query
+// maps the few columns it needs and scans them as plain arrays.  Rows of
+// a child table belong to a parent through the parent's "first" column,
+// which has one extra entry: the streams of playlist p are
+// st_*[pl_first_stream[p] .. pl_first_stream[p + 1]).
+
+// st_kind values
+#define MPLS_INDEX_VIDEO    1
+#define MPLS_INDEX_AUDIO    2
+#define MPLS_INDEX_PG       3
+
+typedef struct mpls_index_s MPLS_INDEX;
+
+// Building, playlists of a disc must be added one after the other
+MPLS_INDEX* mpls_index_create(void);
+int mpls_index_add(MPLS_INDEX *index, const char *disc, const char *name, const MPLS_PL *pl);
+int mpls_index_write(MPLS_INDEX *index, const char *dir);
+void mpls_index_free(MPLS_INDEX *index);
+
+// Index columns
+#define MPLS_INDEX_COLUMNS  16
+
+typedef struct
+{
+    uint32_t        num_discs;
+    uint32_t        num_playlists;
+    uint32_t        num_items;
+    uint32_t        num_streams;
+    uint32_t        num_marks;
+
+    const uint32_t *disc_name;          // offsets in "strings"
+    const uint32_t *disc_first;         // first playlist
+    const uint32_t *pl_disc;
+    const uint32_t *pl_name;
+    const uint32_t *pl_duration;        // 45 kHz
+    const uint32_t *pl_first_item;
+    const uint32_t *pl_first_stream;    // streams of all the play items
+    const uint32_t *pl_first_mark;
+    const uint32_t *pi_clip;            // clip id as a number
+    const uint32_t *pi_in;
+    const uint32_t *pi_out;
+    const uint8_t  *st_kind;
+    const uint8_t  *st_coding;
+    const uint32_t *st_lang;            // three letters, first in the high bits
+    const uint32_t *mk_time;            // from the playlist start, 45 kHz
+    const char     *strings;
+
+    BITSTREAM       file[MPLS_INDEX_COLUMNS];
+} MPLS_INDEX_MAP;
+
+MPLS_INDEX_MAP* mpls_index_open(const char *dir);
+void mpls_index_close(MPLS_INDEX_MAP *map);
+
+#define MPLS_INDEX_MAX_TERMS 16
+
+// A playlist matches when its duration is in range and, for every
+// stream term, at least one of its streams matches the term.  Zero in a
+// field matches anything, coding -1 too.
+typedef struct
+{
+    uint32_t        min_duration;       // 45 kHz
+    uint32_t        max_duration;
+    uint32_t        min_marks;
+    int64_t         clip;               // -1 for any
+    int             num_terms;
+    struct {
+        uint8_t     kind;
+        int         coding;
+        uint32_t    lang;
+    } term[MPLS_INDEX_MAX_TERMS];
+} MPLS_INDEX_QUERY;
+
+// Sets match[p] for the matching playlists, returns their count
+uint32_t mpls_index_query(const MPLS_INDEX_MAP *map, const MPLS_INDEX_QUERY *query,
+                          uint8_t *match);
+
+#endif // _MPLS_INDEX_H_
@@ -4,7 +4,6 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <libgen.h>
 #include "util.h"
 #include "bits.h"
 #include "mpls_parse.h"
@@ -14,20 +13,11 @@
 #define MPLS_SIG2A ('0' << 24 | '2' << 16 | '0' << 8 | '0')
 #define MPLS_SIG2B ('0' << 24 | '1' << 16 | '0' << 8 | '0')
 
-static int mpls_verbose = 0;
-
-static void
-_human_readable_sig(char *sig, uint32_t s1, uint32_t s2)
+// Bytes left in the stream from the current position
+static off_t
+_bytes_left(BITSTREAM *bits)
 {
-    sig[0] = (s1 >> 24) & 0xFF;
-    sig[1] = (s1 >> 16) & 0xFF;
-    sig[2] = (s1 >>  8) & 0xFF;
-    sig[3] = (s1      ) & 0xFF;
-    sig[4] = (s2 >> 24) & 0xFF;
-    sig[5] = (s2 >> 16) & 0xFF;
-    sig[6] = (s2 >>  8) & 0xFF;
-    sig[7] = (s2      ) & 0xFF;
-    sig[8] = 0;
+    return bits->end - (bs_pos(bits) >> 3);
 }
 
 static int
@@ -39,31 +29,29 @@ _parse_header(BITSTREAM *bits, MPLS_PL *pl)
         (pl->type_indicator2 != MPLS_SIG2A && 
          pl->type_indicator2 != MPLS_SIG2B && 
          pl->type_indicator2 != MPLS_SIG3)) {
-
-        char sig[9];
-        char expect[9];
-
-        _human_readable_sig(sig, pl->type_indicator, pl->type_indicator2);
-        _human_readable_sig(expect, MPLS_SIG1, MPLS_SIG2A);
-        fprintf(stderr, "failed signature match, expected (%s) got (%s)\n", 
-                expect, sig);
-        return 0;
+        return MPLS_ERR_SIGNATURE;
+    }
+    if (bits->end < 20) {
+        return MPLS_ERR_TRUNCATED;
     }
     pl->list_pos = bs_read(bits, 32);
     pl->mark_pos = bs_read(bits, 32);
     pl->ext_pos  = bs_read(bits, 32);
 
-    return 1;
+    if (pl->list_pos >= bits->end || pl->mark_pos >= bits->end) {
+        return MPLS_ERR_TRUNCATED;
+    }
+    return MPLS_OK;
 }
 
-static int
-_parse_stream(BITSTREAM *bits, MPLS_STREAM *s)
+static void
+_parse_stream(BITSTREAM *bits, MPLS_PL *pl, MPLS_STREAM *s)
 {
     int len;
     int pos;
 
     if (!bs_is_align(bits, 0x07)) {
-        fprintf(stderr, "_parse_stream: Stream alignment error\n");
+        pl->warnings |= MPLS_WARN_ALIGNMENT;
     }
     len = bs_read(bits, 8);
     pos = bs_pos(bits) >> 3;
@@ -87,7 +75,7 @@ _parse_stream(BITSTREAM *bits, MPLS_STREAM *s)
             break;
 
         default:
-            fprintf(stderr, "unrecognized stream type %02x\n", s->stream_type);
+            pl->warnings |= MPLS_WARN_STREAM_TYPE;
             break;
     };
 
@@ -131,30 +119,93 @@ _parse_stream(BITSTREAM *bits, MPLS_STREAM *s)
             break;
 
         default:
-            fprintf(stderr, "unrecognized coding type %02x\n", s->coding_type);
+            pl->warnings |= MPLS_WARN_CODING_TYPE;
             break;
     };
 
     bs_seek_byte(bits, pos + len);
-    return 1;
+}
+
+// Stream arrays are handed out from the pool that mpls_alloc() sized for
+// the whole playlist
+typedef struct {
+    MPLS_STREAM *next;
+    uint32_t     left;
+} MPLS_STREAM_POOL;
+
+static MPLS_STREAM*
+_parse_streams(BITSTREAM *bits, MPLS_PL *pl, MPLS_STREAM_POOL *pool, int count)
+{
+    MPLS_STREAM *ss;
+    int ii;
+
+    if (count == 0 || (uint32_t)count > pool->left) {
+        return NULL;
+    }
+    ss = pool->next;
+    pool->next += count;
+    pool->left -= count;
+    for (ii = 0; ii < count; ii++) {
+        _parse_stream(bits, pl, &ss[ii]);
+    }
+    return ss;
+}
+
+static int
+_parse_stn_streams(BITSTREAM *bits, MPLS_PL *pl, MPLS_STREAM_POOL *pool, MPLS_PI *pi)
+{
+    pi->stn.video = _parse_streams(bits, pl, pool, pi->stn.num_video);
+    pi->stn.audio = _parse_streams(bits, pl, pool, pi->stn.num_audio);
+    pi->stn.pg    = _parse_streams(bits, pl, pool, pi->stn.num_pg);
+    if ((pi->stn.num_video && pi->stn.video == NULL) ||
+        (pi->stn.num_audio && pi->stn.audio == NULL) ||
+        (pi->stn.num_pg && pi->stn.pg == NULL)) {
+        return MPLS_ERR_NOMEM;
+    }
+    return MPLS_OK;
+}
+
+// Moves from the start of a play item, just after its length field, to
+// the stream counts of its STN table
+static void
+_skip_to_stn(BITSTREAM *bits, int pos)
+{
+    int num_angles;
+
+    bs_seek_byte(bits, pos + 9);
+    bs_skip(bits, 11);
+    if (bs_read(bits, 1)) {
+        bs_seek_byte(bits, pos + 32);
+        num_angles = bs_read(bits, 8);
+        bs_skip(bits, 8);
+        if (num_angles > 1) {
+            bs_skip(bits, (num_angles - 1) * 10 * 8);
+        }
+    } else {
+        bs_seek_byte(bits, pos + 32);
+    }
+    // STN length and 2 reserved bytes
+    bs_skip(bits, 4 * 8);
 }
 
 static int
-_parse_playitem(BITSTREAM *bits, MPLS_PI *pi)
+_parse_playitem(BITSTREAM *bits, MPLS_PL *pl, MPLS_STREAM_POOL *pool, MPLS_PI *pi)
 {
-    int len, ii;
+    int len, ii, ret;
     uint8_t is_multi_angle;
-    uint8_t codecId[5];
+    uint8_t codecId[4];
     int pos;
-    MPLS_STREAM *ss;
 
     if (!bs_is_align(bits, 0x07)) {
-        fprintf(stderr, "_parse_playitem: Stream alignment error\n");
+        pl->warnings |= MPLS_WARN_ALIGNMENT;
     }
 
     // PlayItem Length
     len = bs_read(bits, 16);
     pos = bs_pos(bits) >> 3;
+    if (_bytes_left(bits) < len) {
+        return MPLS_ERR_TRUNCATED;
+    }
 
     // Primary Clip identifer
     bs_read_bytes(bits, (uint8_t*)pi->clip_id, 5);
@@ -162,8 +213,7 @@ _parse_playitem(BITSTREAM *bits, MPLS_PI *pi)
     // skip the redundant "M2TS" CodecIdentifier
     bs_read_bytes(bits, codecId, 4);
     if (memcmp(codecId, "M2TS", 4) != 0) {
-        codecId[4] = 0;
-        fprintf(stderr, "Incorrect CodecIdentifier (%s)\n", codecId);
+        pl->warnings |= MPLS_WARN_CODEC_ID;
     }
 
     // Skip reserved 11 bits
@@ -177,8 +227,7 @@ _parse_playitem(BITSTREAM *bits, MPLS_PI *pi)
         pi->connection_condition != 0x05 &&
         pi->connection_condition != 0x06) {
 
-        fprintf(stderr, "Unexpected connection condition %02x\n", 
-                pi->connection_condition);
+        pl->warnings |= MPLS_WARN_CONNECTION;
     }
 
     pi->stc_id   = bs_read(bits, 8);
@@ -217,48 +266,51 @@ _parse_playitem(BITSTREAM *bits, MPLS_PI *pi)
     // 5 reserve bytes
     bs_skip(bits, 5 * 8);
 
-    ss = NULL;
-    if (pi->stn.num_video) {
-        ss = malloc(pi->stn.num_video * sizeof(MPLS_STREAM));
-    }
-    for (ii = 0; ii < pi->stn.num_video; ii++) {
-        if (!_parse_stream(bits, &ss[ii])) {
-            X_FREE(ss);
-            fprintf(stderr, "error parsing video entry\n");
-            return 0;
+    // Without a pool the streams are left for _parse_stn_tables
+    if (pool != NULL) {
+        ret = _parse_stn_streams(bits, pl, pool, pi);
+        if (ret != MPLS_OK) {
+            return ret;
         }
     }
-    pi->stn.video = ss;
 
-    ss = NULL;
-    if (pi->stn.num_audio)
-        ss = malloc(pi->stn.num_audio * sizeof(MPLS_STREAM));
-    for (ii = 0; ii < pi->stn.num_audio; ii++) {
+    // Seek past any unused items
+    bs_seek_byte(bits, pos + len);
+    return MPLS_OK;
+}
 
-        if (!_parse_stream(bits, &ss[ii])) {
-            X_FREE(ss);
-            fprintf(stderr, "error parsing audio entry\n");
-            return 0;
-        }
-    }
-    pi->stn.audio = ss;
+// Second pass over the play items that only decodes the STN streams,
+// used when the filter had to see the play items first
+static int
+_parse_stn_tables(BITSTREAM *bits, MPLS_PL *pl, MPLS_STREAM_POOL *pool)
+{
+    int ii, len, pos, ret;
 
-    ss = NULL;
-    if (pi->stn.num_pg) {
-        ss = malloc(pi->stn.num_pg * sizeof(MPLS_STREAM));
-    }
-    for (ii = 0; ii < pi->stn.num_pg; ii++) {
-        if (!_parse_stream(bits, &ss[ii])) {
-            X_FREE(ss);
-            fprintf(stderr, "error parsing pg entry\n");
-            return 0;
+    bs_seek_byte(bits, pl->list_pos + 10);
+    for (ii = 0; ii < pl->list_count; ii++) {
+        len = bs_read(bits, 16);
+        pos = bs_pos(bits) >> 3;
+        _skip_to_stn(bits, pos);
+        // The counts were read with the play item
+        bs_skip(bits, 12 * 8);
+        ret = _parse_stn_streams(bits, pl, pool, &pl->play_item[ii]);
+        if (ret != MPLS_OK) {
+            return ret;
         }
+        bs_seek_byte(bits, pos + len);
     }
-    pi->stn.pg = ss;
+    return MPLS_OK;
+}
 
-    // Seek past any unused items
-    bs_seek_byte(bits, pos + len);
-    return 1;
+static void
+_parse_mark(BITSTREAM *bits, MPLS_PLM *plm)
+{
+    plm->mark_id       = bs_read(bits, 8);
+    plm->mark_type     = bs_read(bits, 8);
+    plm->play_item_ref = bs_read(bits, 16);
+    plm->time          = bs_read(bits, 32);
+    plm->entry_es_pid  = bs_read(bits, 16);
+    plm->duration      = bs_read(bits, 32);
 }
 
 static int
@@ -270,27 +322,20 @@ _parse_playlistmark(BITSTREAM *bits, MPLS_PL *pl)
     bs_seek_byte(bits, pl->mark_pos);
     // Skip the length field, I don't use it
     bs_skip(bits, 32);
-    // Then get the number of marks
-    pl->mark_count = bs_read(bits, 16);
+    // The number of marks was already taken by _count_sections
+    bs_skip(bits, 16);
 
-    plm = malloc(pl->mark_count * sizeof(MPLS_PLM));
+    plm = pl->play_mark;
     for (ii = 0; ii < pl->mark_count; ii++) {
-        plm[ii].mark_id       = bs_read(bits, 8);
-        plm[ii].mark_type     = bs_read(bits, 8);
-        plm[ii].play_item_ref = bs_read(bits, 16);
-        plm[ii].time          = bs_read(bits, 32);
-        plm[ii].entry_es_pid  = bs_read(bits, 16);
-        plm[ii].duration      = bs_read(bits, 32);
-    }
-    pl->play_mark = plm;
-    return 1;
+        _parse_mark(bits, &plm[ii]);
+    }
+    return MPLS_OK;
 }
 
 static int
-_parse_playlist(BITSTREAM *bits, MPLS_PL *pl)
+_parse_playlist(BITSTREAM *bits, MPLS_PL *pl, MPLS_STREAM_POOL *pool)
 {
-    int ii;
-    MPLS_PI *pi;
+    int ii, err;
 
     bs_seek_byte(bits, pl->list_pos);
     // Skip playlist length
@@ -298,35 +343,22 @@ _parse_playlist(BITSTREAM *bits, MPLS_PL *pl)
     // Skip reserved bytes
     bs_skip(bits, 16);
 
-    pl->list_count = bs_read(bits, 16);
+    // The number of play items was already taken by _count_sections
+    bs_skip(bits, 16);
     pl->sub_count = bs_read(bits, 16);
 
-    pi = calloc(pl->list_count,  sizeof(MPLS_PI));
     for (ii = 0; ii < pl->list_count; ii++) {
-        if (!_parse_playitem(bits, &pi[ii])) {
-            X_FREE(pi);
-            fprintf(stderr, "error parsing play list item\n");
-            return 0;
-        }
-    }
-    pl->play_item = pi;
-#if 0
-    // TODO
-    for (ii = 0; ii < pl->sub_count; ii++)
-    {
-        if (!parse_subpath(stream, pl))
-        {
-            fprintf(stderr, "error parsing subpath\n");
-            return 0;
+        err = _parse_playitem(bits, pl, pool, &pl->play_item[ii]);
+        if (err != MPLS_OK) {
+            return err;
         }
     }
-#else
-    if (pl->sub_count && mpls_verbose) {
-        fprintf(stderr, "Subpath not supported. Skipping\n");
+    // TODO: parse subpaths
+    if (pl->sub_count) {
+        pl->warnings |= MPLS_WARN_SUBPATH;
     }
-#endif
 
-    return 1;
+    return MPLS_OK;
 }
 
 static void
@@ -358,76 +390,525 @@ _extrapolate(MPLS_PL *pl)
     }
 }
 
+// Allocates a playlist together with its play item, mark and stream
+// arrays in one zeroed block, so mpls_free() is a single free().  The
+// counts are set and the stream array is returned in "streams" for the
+// caller to hand out to the STN tables.
+MPLS_PL*
+mpls_alloc(uint16_t list_count, uint16_t mark_count, uint32_t stream_count,
+           MPLS_STREAM **streams)
+{
+    MPLS_PL *pl;
+    uint8_t *p;
+    size_t len;
+
+    // Largest alignment first, so no padding is needed between arrays
+    len = sizeof(MPLS_PL) + list_count * sizeof(MPLS_PI) +
+          mark_count * sizeof(MPLS_PLM) + stream_count * sizeof(MPLS_STREAM);
+    p = calloc(1, len);
+    if (p == NULL) {
+        return NULL;
+    }
+    pl = (MPLS_PL*)p;
+    p += sizeof(MPLS_PL);
+    pl->list_count = list_count;
+    pl->mark_count = mark_count;
+    if (list_count) {
+        pl->play_item = (MPLS_PI*)p;
+        p += list_count * sizeof(MPLS_PI);
+    }
+    if (mark_count) {
+        pl->play_mark = (MPLS_PLM*)p;
+        p += mark_count * sizeof(MPLS_PLM);
+    }
+    if (streams != NULL) {
+        *streams = stream_count ? (MPLS_STREAM*)p : NULL;
+    }
+    return pl;
+}
+
 void
 mpls_free(MPLS_PL **p_pl)
 {
+    X_FREE(*p_pl);
+    *p_pl = NULL;
+}
+
+// Hash of the clip_id/in_time/out_time sequence.  Two playlists that
+// play the same segments of the same clips get the same fingerprint.
+uint64_t
+mpls_fingerprint(MPLS_PL *pl)
+{
+    uint8_t buf[13];
+    uint64_t hash;
+    int ii;
+
+    buf[0] = pl->list_count >> 8;
+    buf[1] = pl->list_count;
+    hash = hash64(0, buf, 2);
+    for (ii = 0; ii < pl->list_count; ii++) {
+        MPLS_PI *pi = &pl->play_item[ii];
+
+        memcpy(buf, pi->clip_id, 5);
+        buf[5]  = pi->in_time >> 24;
+        buf[6]  = pi->in_time >> 16;
+        buf[7]  = pi->in_time >> 8;
+        buf[8]  = pi->in_time;
+        buf[9]  = pi->out_time >> 24;
+        buf[10] = pi->out_time >> 16;
+        buf[11] = pi->out_time >> 8;
+        buf[12] = pi->out_time;
+        hash = hash64(hash, buf, 13);
+    }
+    return hash;
+}
+
+// Compares what _hash_streams() hashes
+static int
+_same_streams(MPLS_STREAM *a, MPLS_STREAM *b, int count)
+{
+    int ii;
+
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    for (ii = 0; ii < count; ii++) {
+        if (a[ii].coding_type != b[ii].coding_type ||
+            a[ii].format != b[ii].format ||
+            a[ii].rate != b[ii].rate ||
+            a[ii].char_code != b[ii].char_code ||
+            memcmp(a[ii].lang, b[ii].lang, 3) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint64_t
+_hash_streams(uint64_t hash, MPLS_STREAM *ss, int count)
+{
+    uint8_t buf[7];
     int ii;
-    MPLS_PL *pl = *p_pl;
 
-    if (pl->play_mark != NULL) {
-        X_FREE(pl->play_mark);
+    for (ii = 0; ss != NULL && ii < count; ii++) {
+        buf[0] = ss[ii].coding_type;
+        buf[1] = ss[ii].format;
+        buf[2] = ss[ii].rate;
+        buf[3] = ss[ii].char_code;
+        memcpy(buf + 4, ss[ii].lang, 3);
+        hash = hash64(hash, buf, 7);
     }
+    return hash;
+}
+
+// Hash of the duration, the STN tables and the mark times, but not of
+// the clips.  The same title authored into other clips, as on another
+// release or region, gets the same fingerprint as long as its streams
+// and chapters are the same.  Consecutive play items with the same
+// streams count once, so splitting a title into more clips makes no
+// difference.  Only meaningful when the STN tables were decoded.
+uint64_t
+mpls_structure_fingerprint(MPLS_PL *pl)
+{
+    uint8_t buf[8];
+    uint64_t hash;
+    int ii;
 
+    buf[0] = pl->duration >> 24;
+    buf[1] = pl->duration >> 16;
+    buf[2] = pl->duration >> 8;
+    buf[3] = pl->duration;
+    hash = hash64(0, buf, 4);
     for (ii = 0; ii < pl->list_count; ii++) {
-        MPLS_PI *pi;
-        pi = &pl->play_item[ii];
-        if (pi->stn.video != NULL) {
-            X_FREE(pi->stn.video);
+        MPLS_PL_STN *stn = &pl->play_item[ii].stn;
+
+        if (ii > 0) {
+            MPLS_PL_STN *prev = &pl->play_item[ii - 1].stn;
+
+            if (stn->num_video == prev->num_video &&
+                stn->num_audio == prev->num_audio &&
+                stn->num_pg == prev->num_pg &&
+                _same_streams(stn->video, prev->video, stn->num_video) &&
+                _same_streams(stn->audio, prev->audio, stn->num_audio) &&
+                _same_streams(stn->pg, prev->pg, stn->num_pg)) {
+                continue;
+            }
         }
-        if (pi->stn.audio != NULL) {
-            X_FREE(pi->stn.audio);
+        buf[0] = stn->num_video;
+        buf[1] = stn->num_audio;
+        buf[2] = stn->num_pg;
+        hash = hash64(hash, buf, 3);
+        hash = _hash_streams(hash, stn->video, stn->num_video);
+        hash = _hash_streams(hash, stn->audio, stn->num_audio);
+        hash = _hash_streams(hash, stn->pg, stn->num_pg);
+    }
+    for (ii = 0; ii < pl->mark_count; ii++) {
+        MPLS_PLM *plm = &pl->play_mark[ii];
+
+        buf[0] = plm->mark_type;
+        buf[1] = plm->abs_start >> 24;
+        buf[2] = plm->abs_start >> 16;
+        buf[3] = plm->abs_start >> 8;
+        buf[4] = plm->abs_start;
+        hash = hash64(hash, buf, 5);
+    }
+    return hash;
+}
+
+// Number of STN streams the parser will keep for the play item at the
+// current position, read the same way _parse_playitem does.  Also adds
+// the play item to the playlist duration.
+static int
+_count_item_streams(BITSTREAM *bits, uint64_t *duration)
+{
+    int len, pos, count;
+    uint32_t in_time, out_time;
+
+    len = bs_read(bits, 16);
+    pos = bs_pos(bits) >> 3;
+    if (_bytes_left(bits) < len) {
+        return -1;
+    }
+    bs_seek_byte(bits, pos + 12);
+    in_time  = bs_read(bits, 32);
+    out_time = bs_read(bits, 32);
+    *duration += out_time - in_time;
+
+    _skip_to_stn(bits, pos);
+    count  = bs_read(bits, 8);
+    count += bs_read(bits, 8);
+    count += bs_read(bits, 8);
+
+    bs_seek_byte(bits, pos + len);
+    return count;
+}
+
+// Walk the playlist and mark sections once to size the allocation
+static int
+_count_sections(BITSTREAM *bits, MPLS_PL *hdr, uint32_t *stream_count)
+{
+    int ii, count;
+
+    bs_seek_byte(bits, hdr->list_pos + 6);
+    hdr->list_count = bs_read(bits, 16);
+    bs_skip(bits, 16);
+    *stream_count = 0;
+    hdr->duration = 0;
+    for (ii = 0; ii < hdr->list_count; ii++) {
+        count = _count_item_streams(bits, &hdr->duration);
+        if (count < 0) {
+            return MPLS_ERR_TRUNCATED;
         }
-        if (pi->stn.pg != NULL) {
-            X_FREE(pi->stn.pg);
+        *stream_count += count;
+    }
+
+    bs_seek_byte(bits, hdr->mark_pos + 4);
+    hdr->mark_count = bs_read(bits, 16);
+    if (_bytes_left(bits) < hdr->mark_count * 14) {
+        return MPLS_ERR_TRUNCATED;
+    }
+    return MPLS_OK;
+}
+
+static MPLS_PL*
+_mpls_parse(BITSTREAM *bits, const MPLS_FILTER *filter, int *err)
+{
+    MPLS_PL    hdr = {0,};
+    MPLS_PL   *pl = NULL;
+    MPLS_STREAM_POOL pool, *item_pool;
+    uint32_t   stream_count;
+    int        with_stn, ret;
+
+    ret = _parse_header(bits, &hdr);
+    if (ret == MPLS_OK) {
+        ret = _count_sections(bits, &hdr, &stream_count);
+    }
+    if (ret != MPLS_OK) {
+        goto fail;
+    }
+    // The duration is known from the play item headers alone, so short
+    // playlists are rejected before anything is allocated
+    if (filter != NULL && filter->min_duration && hdr.duration < filter->min_duration) {
+        ret = MPLS_ERR_FILTERED;
+        goto fail;
+    }
+    with_stn = filter == NULL || !(filter->flags & MPLS_PARSE_NO_STN);
+    if (!with_stn) {
+        stream_count = 0;
+    }
+    pl = mpls_alloc(hdr.list_count, hdr.mark_count, stream_count, &pool.next);
+    if (pl == NULL) {
+        ret = MPLS_ERR_NOMEM;
+        goto fail;
+    }
+    pool.left = stream_count;
+    pl->type_indicator  = hdr.type_indicator;
+    pl->type_indicator2 = hdr.type_indicator2;
+    pl->list_pos        = hdr.list_pos;
+    pl->mark_pos        = hdr.mark_pos;
+    pl->ext_pos         = hdr.ext_pos;
+
+    // With an accept callback the STN tables wait until it has seen
+    // the play items
+    item_pool = with_stn && (filter == NULL || filter->accept == NULL) ? &pool : NULL;
+    ret = _parse_playlist(bits, pl, item_pool);
+    if (ret == MPLS_OK && filter != NULL && filter->accept != NULL) {
+        _extrapolate(pl);
+        if (!filter->accept(filter->handle, pl)) {
+            ret = MPLS_ERR_FILTERED;
+        } else if (with_stn) {
+            ret = _parse_stn_tables(bits, pl, &pool);
         }
     }
+    if (ret == MPLS_OK) {
+        ret = _parse_playlistmark(bits, pl);
+    }
+    if (ret != MPLS_OK) {
+        mpls_free(&pl);
+        goto fail;
+    }
+    _extrapolate(pl);
 
-    if (pl->play_item != NULL) {
-        X_FREE(pl->play_item);
+fail:
+    if (err != NULL) {
+        *err = ret;
     }
-    X_FREE(*p_pl);
+    return pl;
 }
 
-MPLS_PL*
-mpls_parse(char *path, int verbose)
+// Position in the play item list, so the play item a mark refers to can
+// be found again without keeping the items around.  Marks are normally
+// in play item order, which makes the walk linear.
+typedef struct {
+    int      idx;
+    int      pos;       // offset of the play item length field
+    uint32_t abs_start;
+} MPLS_ITEM_CURSOR;
+
+static void
+_cursor_reset(MPLS_ITEM_CURSOR *cur, const MPLS_PL *hdr)
 {
-    BITSTREAM  bits;
-    FILE      *fp;
-    MPLS_PL   *pl;
+    cur->idx = 0;
+    cur->pos = hdr->list_pos + 10;
+    cur->abs_start = 0;
+}
 
-    mpls_verbose = verbose;
+// Returns the abs_start and in_time of play item "ref"
+static uint32_t
+_cursor_seek(BITSTREAM *bits, MPLS_ITEM_CURSOR *cur, const MPLS_PL *hdr, int ref,
+             uint32_t *in_time)
+{
+    uint32_t out_time;
+    int len;
 
-    pl = calloc(1, sizeof(MPLS_PL));
-    if (pl == NULL) {
-        return NULL;
+    if (ref < cur->idx) {
+        _cursor_reset(cur, hdr);
+    }
+    while (1) {
+        bs_seek_byte(bits, cur->pos);
+        len = bs_read(bits, 16);
+        bs_seek_byte(bits, cur->pos + 2 + 12);
+        *in_time = bs_read(bits, 32);
+        out_time = bs_read(bits, 32);
+        if (cur->idx == ref) {
+            return cur->abs_start;
+        }
+        cur->abs_start += out_time - *in_time;
+        cur->pos += 2 + len;
+        cur->idx++;
     }
+}
 
-    fp = fopen(path, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "Failed to open %s\n", path);
-        X_FREE(pl);
-        return NULL;
+static int
+_parse_item_streams(BITSTREAM *bits, MPLS_PL *hdr, const MPLS_PI *pi, int item, int pos,
+                    const MPLS_EVENTS *ev, void *handle)
+{
+    const int count[3] = {pi->stn.num_video, pi->stn.num_audio, pi->stn.num_pg};
+    MPLS_STREAM s;
+    int type, ii;
+
+    _skip_to_stn(bits, pos + 2);
+    // Stream counts and reserved bytes
+    bs_skip(bits, 12 * 8);
+    for (type = MPLS_STN_VIDEO; type <= MPLS_STN_PG; type++) {
+        for (ii = 0; ii < count[type]; ii++) {
+            memset(&s, 0, sizeof(s));
+            _parse_stream(bits, hdr, &s);
+            if (ev->stream(handle, item, type, ii, &s)) {
+                return MPLS_ERR_STOPPED;
+            }
+        }
     }
+    return MPLS_OK;
+}
 
-    bs_init(&bits, fp);
-    memset(pl, 0, sizeof(MPLS_PL));
-    if (!_parse_header(&bits, pl)) {
-        fclose(fp);
-        mpls_free(&pl);
-        return NULL;
+static int
+_mpls_parse_events(BITSTREAM *bits, const MPLS_EVENTS *ev, void *handle)
+{
+    MPLS_PL hdr = {0,};
+    MPLS_PI pi;
+    MPLS_PLM plm;
+    MPLS_ITEM_CURSOR cur;
+    uint32_t stream_count, abs_start = 0, in_time;
+    int ii, ret, pos, next;
+
+    ret = _parse_header(bits, &hdr);
+    if (ret == MPLS_OK) {
+        ret = _count_sections(bits, &hdr, &stream_count);
     }
-    if (!_parse_playlist(&bits, pl)) {
-        fclose(fp);
-        mpls_free(&pl);
-        return NULL;
+    if (ret != MPLS_OK) {
+        return ret;
     }
-    if (!_parse_playlistmark(&bits, pl)) {
-        fclose(fp);
-        mpls_free(&pl);
+    bs_seek_byte(bits, hdr.list_pos + 8);
+    hdr.sub_count = bs_read(bits, 16);
+    if (hdr.sub_count) {
+        hdr.warnings |= MPLS_WARN_SUBPATH;
+    }
+    if (ev->header != NULL && ev->header(handle, &hdr)) {
+        return MPLS_ERR_STOPPED;
+    }
+
+    pos = hdr.list_pos + 10;
+    for (ii = 0; ii < hdr.list_count && (ev->play_item != NULL || ev->stream != NULL); ii++) {
+        memset(&pi, 0, sizeof(pi));
+        bs_seek_byte(bits, pos);
+        ret = _parse_playitem(bits, &hdr, NULL, &pi);
+        if (ret != MPLS_OK) {
+            return ret;
+        }
+        next = bs_pos(bits) >> 3;
+        pi.abs_start = abs_start;
+        abs_start += pi.out_time - pi.in_time;
+        pi.abs_end = abs_start;
+        if (ev->play_item != NULL && ev->play_item(handle, ii, &pi)) {
+            return MPLS_ERR_STOPPED;
+        }
+        if (ev->stream != NULL) {
+            ret = _parse_item_streams(bits, &hdr, &pi, ii, pos, ev, handle);
+            if (ret != MPLS_OK) {
+                return ret;
+            }
+        }
+        pos = next;
+    }
+
+    _cursor_reset(&cur, &hdr);
+    for (ii = 0; ii < hdr.mark_count && ev->mark != NULL; ii++) {
+        bs_seek_byte(bits, hdr.mark_pos + 6 + ii * 14);
+        _parse_mark(bits, &plm);
+        plm.abs_start = 0;
+        if (plm.play_item_ref < hdr.list_count) {
+            plm.abs_start = _cursor_seek(bits, &cur, &hdr, plm.play_item_ref, &in_time);
+            plm.abs_start += plm.time - in_time;
+        }
+        if (ev->mark(handle, ii, &plm)) {
+            return MPLS_ERR_STOPPED;
+        }
+    }
+
+    if (ev->end != NULL) {
+        ev->end(handle, &hdr);
+    }
+    return MPLS_OK;
+}
+
+// Parse a playlist held in memory without building an MPLS_PL.  The
+// events are called in file order straight from the buffer and nothing
+// is allocated, any of them may be NULL.  Returns MPLS_OK, one of the
+// MPLS_ERR_* codes, or MPLS_ERR_STOPPED when an event returned non zero.
+int
+mpls_parse_buffer_events(const uint8_t *buf, size_t len, const MPLS_EVENTS *ev, void *handle)
+{
+    BITSTREAM  bits;
+
+    bs_init_buf(&bits, buf, len);
+    return _mpls_parse_events(&bits, ev, handle);
+}
+
+// Same as mpls_parse_buffer_events() for a file, read into a heap
+// buffer first, which is the one allocation.
+int
+mpls_parse_file_events(const char *path, const MPLS_EVENTS *ev, void *handle)
+{
+    BITSTREAM  bits;
+    int        ret;
+
+    if (bs_open(&bits, path) < 0) {
+        return MPLS_ERR_IO;
+    }
+    ret = _mpls_parse_events(&bits, ev, handle);
+    bs_close(&bits);
+    return ret;
+}
+
+// Parse a playlist held in memory.  The buffer is only read and may be
+// released as soon as this returns.  On failure NULL is returned and
+// "err" (if not NULL) receives one of the MPLS_ERR_* codes.
+MPLS_PL*
+mpls_parse_buffer(const uint8_t *buf, size_t len, int *err)
+{
+    return mpls_parse_buffer_filter(buf, len, NULL, err);
+}
+
+// Same as mpls_parse_buffer(), but playlists rejected by "filter" are
+// dropped as early as possible and reported as MPLS_ERR_FILTERED
+MPLS_PL*
+mpls_parse_buffer_filter(const uint8_t *buf, size_t len, const MPLS_FILTER *filter, int *err)
+{
+    BITSTREAM  bits;
+
+    bs_init_buf(&bits, buf, len);
+    return _mpls_parse(&bits, filter, err);
+}
+
+MPLS_PL*
+mpls_parse_file(const char *path, int *err)
+{
+    return mpls_parse_file_filter(path, NULL, err);
+}
+
+MPLS_PL*
+mpls_parse_file_filter(const char *path, const MPLS_FILTER *filter, int *err)
+{
+    BITSTREAM  bits;
+    MPLS_PL   *pl;
+
+    if (bs_open(&bits, path) < 0) {
+        if (err != NULL) {
+            *err = MPLS_ERR_IO;
+        }
         return NULL;
     }
-    _extrapolate(pl);
-    fclose(fp);
+    pl = _mpls_parse(&bits, filter, err);
+    bs_close(&bits);
     return pl;
 }
 
+const char*
+mpls_strerror(int err)
+{
+    switch (err) {
+        case MPLS_OK:            return "success";
+        case MPLS_ERR_IO:        return "failed to open or read file";
+        case MPLS_ERR_NOMEM:     return "out of memory";
+        case MPLS_ERR_SIGNATURE: return "not an MPLS playlist";
+        case MPLS_ERR_TRUNCATED: return "truncated playlist";
+        case MPLS_ERR_FILTERED:  return "rejected by filter";
+        case MPLS_ERR_STOPPED:   return "stopped by callback";
+        default:                 return "unknown error";
+    }
+}
+
+const char*
+mpls_strwarning(uint32_t warning)
+{
+    switch (warning) {
+        case MPLS_WARN_ALIGNMENT:   return "stream alignment error";
+        case MPLS_WARN_STREAM_TYPE: return "unrecognized stream type";
+        case MPLS_WARN_CODING_TYPE: return "unrecognized coding type";
+        case MPLS_WARN_CODEC_ID:    return "incorrect CodecIdentifier";
+        case MPLS_WARN_CONNECTION:  return "unexpected connection condition";
+        case MPLS_WARN_SUBPATH:     return "subpath not supported, skipping";
+        default:                    return "unknown warning";
+    }
+}
@@ -1,9 +1,26 @@
 #if !defined(_MPLS_PARSE_H_)
 #define _MPLS_PARSE_H_
 
-#include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 
+// Error codes returned by the parser
+#define MPLS_OK                  0
+#define MPLS_ERR_IO             -1
+#define MPLS_ERR_NOMEM          -2
+#define MPLS_ERR_SIGNATURE      -3
+#define MPLS_ERR_TRUNCATED      -4
+#define MPLS_ERR_FILTERED       -5
+#define MPLS_ERR_STOPPED        -6
+
+// Non fatal problems found while parsing, or'ed into MPLS_PL.warnings
+#define MPLS_WARN_ALIGNMENT     0x01
+#define MPLS_WARN_STREAM_TYPE   0x02
+#define MPLS_WARN_CODING_TYPE   0x04
+#define MPLS_WARN_CODEC_ID      0x08
+#define MPLS_WARN_CONNECTION    0x10
+#define MPLS_WARN_SUBPATH       0x20
+
 typedef struct
 {
     uint8_t         stream_type;
@@ -73,10 +90,70 @@ typedef struct
 
     // Extrapolated items
     uint64_t        duration;
+    uint32_t        warnings;
 } MPLS_PL;
 
+// MPLS_FILTER.flags
+#define MPLS_PARSE_NO_STN       0x01    // leave the STN stream arrays NULL
+
+// Early rejection of playlists.  The duration is checked while sizing
+// the allocation, before anything is decoded.  "accept" is called once
+// the play items are decoded (clip ids, times, abs_start/abs_end and
+// duration), before the STN streams and marks; returning 0 rejects the
+// playlist.
+typedef struct
+{
+    uint64_t        min_duration;   // 45 kHz ticks, 0 to accept any
+    uint32_t        flags;
+    int           (*accept)(void *handle, MPLS_PL *pl);
+    void           *handle;
+} MPLS_FILTER;
+
+// Stream types passed to MPLS_EVENTS.stream
+#define MPLS_STN_VIDEO          0
+#define MPLS_STN_AUDIO          1
+#define MPLS_STN_PG             2
 
-MPLS_PL* mpls_parse(char *path, int verbose);
+// Event driven parsing.  "header" gets the type indicators, positions,
+// counts and duration.  Play items come with their stream counts but no
+// stream arrays, the streams of a play item follow it when "stream" is
+// set.  Marks come last, with abs_start filled in.  "end" gets the
+// header again with the warnings of everything that was decoded.  A non
+// zero return stops the parse.
+typedef struct
+{
+    int           (*header)(void *handle, const MPLS_PL *pl);
+    int           (*play_item)(void *handle, int idx, const MPLS_PI *pi);
+    int           (*stream)(void *handle, int item, int type, int idx, const MPLS_STREAM *s);
+    int           (*mark)(void *handle, int idx, const MPLS_PLM *plm);
+    void          (*end)(void *handle, const MPLS_PL *pl);
+} MPLS_EVENTS;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+MPLS_PL* mpls_parse_buffer(const uint8_t *buf, size_t len, int *err);
+MPLS_PL* mpls_parse_file(const char *path, int *err);
+MPLS_PL* mpls_parse_buffer_filter(const uint8_t *buf, size_t len, const MPLS_FILTER *filter,
+                                  int *err);
+MPLS_PL* mpls_parse_file_filter(const char *path, const MPLS_FILTER *filter, int *err);
+// The buffer variant allocates nothing, the file one only the buffer the
+// file is read into
+int mpls_parse_buffer_events(const uint8_t *buf, size_t len, const MPLS_EVENTS *ev,
+                             void *handle);
+int mpls_parse_file_events(const char *path, const MPLS_EVENTS *ev, void *handle);
+MPLS_PL* mpls_alloc(uint16_t list_count, uint16_t mark_count, uint32_t stream_count,
+                    MPLS_STREAM **streams);
 void mpls_free(MPLS_PL **pl);
+uint64_t mpls_fingerprint(MPLS_PL *pl);
+uint64_t mpls_structure_fingerprint(MPLS_PL *pl);
+const char* mpls_strerror(int err);
+const char* mpls_strwarning(uint32_t warning);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // _MPLS_PARSE_H_
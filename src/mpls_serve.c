@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "mpls_serve.h"
+
+#if !defined(_WIN32)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define SERVE_MAX_ARGS  256
+
+#define SERVE_MAX_CONNS     64
+#define SERVE_MAX_LINE      (1 << 20)
+#define SERVE_TIMEOUT_MS    60000
+
+static volatile sig_atomic_t serve_stop;
+static int serve_pipe[2] = {-1, -1};
+
+// The pipe wakes poll() up even when the signal came just before it
+static void
+_on_signal(int sig)
+{
+    int saved = errno;
+
+    serve_stop = 1;
+    if (serve_pipe[1] >= 0 && write(serve_pipe[1], "x", 1) < 0) {
+        // Full, poll() is awake already
+    }
+    errno = saved;
+}
+
+static int64_t
+_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+_make_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int
+_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (_make_addr(&addr, path) < 0) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+_bind(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (_make_addr(&addr, path) < 0) {
+        return -1;
+    }
+    // A socket nobody answers on is left over from a server that died
+    fd = _connect(path);
+    if (fd >= 0) {
+        fprintf(stderr, "Socket already in use: %s\n", path);
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 16) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Splits a request line in place, empty fields are dropped
+static int
+_split(char *line, const char *cmd, char **argv)
+{
+    int argc = 0;
+    char *field;
+
+    argv[argc++] = (char*)cmd;
+    for (field = strtok(line, "\t"); field != NULL; field = strtok(NULL, "\t")) {
+        if (argc == SERVE_MAX_ARGS) {
+            return -1;
+        }
+        argv[argc++] = field;
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+// A client connection.  Requests are read without blocking the other
+// connections, the replies go out through "out".
+typedef struct {
+    int      fd;
+    FILE    *out;
+    str_t    in;            // received, not yet handled
+    int64_t  last;          // ms, when something was last received
+} serve_conn_t;
+
+static int
+_serve_open(serve_conn_t *conn, int fd)
+{
+    struct timeval tv = { SERVE_TIMEOUT_MS / 1000, 0 };
+    int dup_fd;
+
+    memset(conn, 0, sizeof(*conn));
+    // A client that does not read its reply is dropped, not waited for
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    dup_fd = dup(fd);
+    conn->out = dup_fd < 0 ? NULL : fdopen(dup_fd, "wb");
+    if (conn->out == NULL) {
+        if (dup_fd >= 0) {
+            close(dup_fd);
+        }
+        close(fd);
+        return -1;
+    }
+    conn->fd = fd;
+    conn->last = _now_ms();
+    return 0;
+}
+
+static void
+_serve_close(serve_conn_t *conn)
+{
+    fclose(conn->out);
+    close(conn->fd);
+    str_free(&conn->in);
+}
+
+// Handles the complete request lines received, all that is left at
+// "eof".  Returns -1 when the connection is to be closed.
+static int
+_serve_lines(serve_conn_t *conn, int eof, const char *cmd, serve_fn_t fn, void *handle)
+{
+    char *argv[SERVE_MAX_ARGS + 1];
+    char *line;
+    int argc, len, ii;
+
+    while (!serve_stop && conn->in.len > 0) {
+        for (ii = 0; ii < conn->in.len; ii++) {
+            if (conn->in.buf[ii] == '\n' || conn->in.buf[ii] == 0) {
+                break;
+            }
+        }
+        if (ii == conn->in.len && !eof) {
+            return conn->in.len > SERVE_MAX_LINE ? -1 : 0;
+        }
+        line = conn->in.buf;
+        line[ii] = 0;
+        len = ii;
+        if (len > 0 && line[len - 1] == '\r') {
+            line[--len] = 0;
+        }
+        if (len > 0) {
+            argc = _split(line, cmd, argv);
+            if (argc < 0) {
+                fprintf(conn->out, "{\"status\":\"error\",\"error\":\"too many arguments\"}\n");
+            } else if (fn(handle, argc, argv, conn->out)) {
+                return -1;
+            }
+            if (fflush(conn->out) == EOF) {
+                return -1;
+            }
+        }
+        // Past the terminator, which the last line at EOF may lack
+        ii = ii < conn->in.len ? ii + 1 : ii;
+        memmove(conn->in.buf, conn->in.buf + ii, conn->in.len - ii);
+        conn->in.len -= ii;
+    }
+    return eof ? -1 : 0;
+}
+
+// Reads what a connection sent, returns -1 when it is to be closed
+static int
+_serve_read(serve_conn_t *conn, const char *cmd, serve_fn_t fn, void *handle)
+{
+    char buf[4096];
+    ssize_t len;
+
+    len = read(conn->fd, buf, sizeof(buf));
+    if (len < 0) {
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+    }
+    conn->last = _now_ms();
+    str_append_sub(&conn->in, buf, 0, len);
+    return _serve_lines(conn, len == 0, cmd, fn, handle);
+}
+
+int
+serve_listen(const char *path, const char *cmd, serve_fn_t fn, void *handle)
+{
+    struct sigaction sa;
+    struct pollfd pfd[SERVE_MAX_CONNS + 2];
+    serve_conn_t conn[SERVE_MAX_CONNS];
+    int64_t now, wait;
+    int fd, fd_conn, ret, count = 0, polled, ii, kept;
+    char byte;
+
+    fd = _bind(path);
+    if (fd < 0) {
+        return -1;
+    }
+    if (pipe(serve_pipe) < 0) {
+        fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    fcntl(serve_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(serve_pipe[1], F_SETFL, O_NONBLOCK);
+
+    // No SA_RESTART, a signal has to break out of a request being
+    // handled.  One that comes before poll() is seen through the pipe.
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // A client that goes away mid reply must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!serve_stop) {
+        // Connections only wait for their requests so long
+        now = _now_ms();
+        wait = -1;
+        for (ii = 0; ii < count; ii++) {
+            int64_t left = conn[ii].last + SERVE_TIMEOUT_MS - now;
+
+            if (wait < 0 || left < wait) {
+                wait = left > 0 ? left : 0;
+            }
+            pfd[ii].fd = conn[ii].fd;
+            pfd[ii].events = POLLIN;
+            pfd[ii].revents = 0;
+        }
+        // A full server leaves new connections in the backlog
+        pfd[count].fd = count < SERVE_MAX_CONNS ? fd : -1;
+        pfd[count].events = POLLIN;
+        pfd[count].revents = 0;
+        pfd[count + 1].fd = serve_pipe[0];
+        pfd[count + 1].events = POLLIN;
+        pfd[count + 1].revents = 0;
+
+        polled = count;
+        ret = poll(pfd, polled + 2, (int)wait);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to wait for requests: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[polled + 1].revents) {
+            while (read(serve_pipe[0], &byte, 1) > 0) {
+            }
+        }
+
+        now = _now_ms();
+        for (ii = kept = 0; ii < polled; ii++) {
+            ret = 0;
+            if (pfd[ii].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ret = _serve_read(&conn[ii], cmd, fn, handle);
+            } else if (now - conn[ii].last >= SERVE_TIMEOUT_MS) {
+                ret = -1;
+            }
+            if (ret < 0) {
+                _serve_close(&conn[ii]);
+            } else {
+                conn[kept++] = conn[ii];
+            }
+        }
+        count = kept;
+
+        if (pfd[polled].revents & POLLIN) {
+            fd_conn = accept(fd, NULL, NULL);
+            if (fd_conn >= 0) {
+                if (_serve_open(&conn[count], fd_conn) == 0) {
+                    count++;
+                }
+            } else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                fprintf(stderr, "Failed to accept: %s\n", strerror(errno));
+                break;
+            }
+        }
+    }
+    for (ii = 0; ii < count; ii++) {
+        _serve_close(&conn[ii]);
+    }
+    close(serve_pipe[0]);
+    close(serve_pipe[1]);
+    close(fd);
+    unlink(path);
+    return 0;
+}
+
+int
+serve_request(const char *path, int argc, char **argv, const char *end,
+              FILE *out, char *last, size_t last_size)
+{
+    str_t line = {0,};
+    FILE *fp;
+    int fd, ii, found = 0;
+
+    fd = _connect(path);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to connect to %s\n", path);
+        return -1;
+    }
+    fp = fdopen(fd, "r+b");
+    if (fp == NULL) {
+        close(fd);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (ii = 0; ii < argc; ii++) {
+        fprintf(fp, "%s%s", ii ? "\t" : "", argv[ii]);
+    }
+    fprintf(fp, "\n");
+    fflush(fp);
+
+    // The server keeps the connection open for more requests, so the
+    // reply ends at the end line rather than at EOF
+    while (str_read_entry(&line, fp) >= 0) {
+        fprintf(out, "%s\n", line.buf);
+        if (strncmp(line.buf, end, strlen(end)) == 0) {
+            strncpy(last, line.buf, last_size - 1);
+            last[last_size - 1] = 0;
+            found = 1;
+            break;
+        }
+    }
+    str_free(&line);
+    fclose(fp);
+    return found ? 0 : -1;
+}
+
+#else
+
+int
+serve_listen(const char *path, const char *cmd, serve_fn_t fn, void *handle)
+{
+    fprintf(stderr, "Server mode is not available on this platform\n");
+    return -1;
+}
+
+int
+serve_request(const char *path, int argc, char **argv, const char *end,
+              FILE *out, char *last, size_t last_size)
+{
+    fprintf(stderr, "Server mode is not available on this platform\n");
+    return -1;
+}
+
+#endif
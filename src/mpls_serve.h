@@ -0,0 +1,24 @@
+#if !defined(_MPLS_SERVE_H_)
+#define _MPLS_SERVE_H_
+
+#include <stdio.h>
+
+// Request handler.  argv[0] is the program name followed by the fields
+// of one request, the reply is written to "out".  Returning non zero
+// closes the connection.
+typedef int (*serve_fn_t)(void *handle, int argc, char **argv, FILE *out);
+
+// Serve requests on a UNIX socket until SIGINT or SIGTERM.  A request
+// is one line of tab separated arguments.  Connections may carry any
+// number of requests and are served together, requests one at a time
+// in the order they come in; a connection that sends nothing for a
+// minute is closed.
+int serve_listen(const char *path, const char *cmd, serve_fn_t fn, void *handle);
+
+// Send one request and copy the reply to "out" up to and including the
+// line that starts with "end".  Returns that line in "last", or -1 if
+// the server could not be reached or went away.
+int serve_request(const char *path, int argc, char **argv, const char *end,
+                  FILE *out, char *last, size_t last_size);
+
+#endif // _MPLS_SERVE_H_
@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "util.h"
+#include "mpls_parse.h"
+#include "mpls_show.h"
+
+static void
+_json_stream(json_writer_t *jw, MPLS_STREAM *s)
+{
+    json_object_begin(jw, NULL);
+    json_uint(jw, "stream_type", s->stream_type);
+    json_uint(jw, "pid", s->pid);
+    if (s->stream_type != 1) {
+        json_uint(jw, "subpath_id", s->subpath_id);
+        json_uint(jw, "subclip_id", s->subclip_id);
+    }
+    json_uint(jw, "coding_type", s->coding_type);
+    json_uint(jw, "format", s->format);
+    json_uint(jw, "rate", s->rate);
+    if (s->lang[0]) {
+        json_stringn(jw, "lang", (char*)s->lang, 3);
+    }
+    json_object_end(jw);
+}
+
+static void
+_json_streams(json_writer_t *jw, const char *key, MPLS_STREAM *ss, int count)
+{
+    int ii;
+
+    json_array_begin(jw, key);
+    for (ii = 0; ii < count && ss != NULL; ii++) {
+        _json_stream(jw, &ss[ii]);
+    }
+    json_array_end(jw);
+}
+
+// Opens a JSON record with everything about the playlist but its marks
+static void
+_json_playlist(json_writer_t *jw, const char *name, MPLS_PL *pl, double fps)
+{
+    char type[8];
+    uint32_t flag;
+    int ii;
+
+    for (ii = 0; ii < 4; ii++) {
+        type[ii]     = pl->type_indicator >> (24 - 8 * ii);
+        type[ii + 4] = pl->type_indicator2 >> (24 - 8 * ii);
+    }
+    json_object_begin(jw, NULL);
+    json_string(jw, "file", name);
+    json_stringn(jw, "type", type, 8);
+    json_uint(jw, "duration", pl->duration);
+    json_fixed(jw, "seconds", pl->duration / 45000.0, 3);
+    json_fixed(jw, "fps", fps, 3);
+    json_array_begin(jw, "warnings");
+    for (flag = 1; flag <= MPLS_WARN_SUBPATH; flag <<= 1) {
+        if (pl->warnings & flag) {
+            json_string(jw, NULL, mpls_strwarning(flag));
+        }
+    }
+    json_array_end(jw);
+
+    json_array_begin(jw, "play_items");
+    for (ii = 0; ii < pl->list_count; ii++) {
+        MPLS_PI *pi = &pl->play_item[ii];
+
+        json_object_begin(jw, NULL);
+        json_stringn(jw, "clip_id", pi->clip_id, 5);
+        json_uint(jw, "in_time", pi->in_time);
+        json_uint(jw, "out_time", pi->out_time);
+        json_uint(jw, "abs_start", pi->abs_start);
+        json_uint(jw, "abs_end", pi->abs_end);
+        json_uint(jw, "connection_condition", pi->connection_condition);
+        json_uint(jw, "stc_id", pi->stc_id);
+        json_object_begin(jw, "streams");
+        _json_streams(jw, "video", pi->stn.video, pi->stn.num_video);
+        _json_streams(jw, "audio", pi->stn.audio, pi->stn.num_audio);
+        _json_streams(jw, "pg", pi->stn.pg, pi->stn.num_pg);
+        json_object_end(jw);
+        json_object_end(jw);
+    }
+    json_array_end(jw);
+}
+
+// Closes the record opened by _json_playlist
+static void
+_json_playlist_end(json_writer_t *jw, str_list_t *files, const char *error)
+{
+    int ii;
+
+    json_array_end(jw);
+    json_array_begin(jw, "chapter_files");
+    for (ii = 0; ii < files->count; ii++) {
+        json_string(jw, NULL, files->item[ii]);
+    }
+    json_array_end(jw);
+    if (error != NULL) {
+        json_string(jw, "error", error);
+    }
+    json_object_end(jw);
+    json_end_record(jw);
+    str_list_free(files);
+}
+
+// Failed playlists still get a record so every input is accounted for
+void
+dump_show_error(dump_ctx_t *ctx, const char *name, int err)
+{
+    fprintf(ctx->log, "Parse failed: %s (%s)\n", name, mpls_strerror(err));
+    if (ctx->opts->json) {
+        json_object_begin(&ctx->json, NULL);
+        json_string(&ctx->json, "file", name);
+        json_string(&ctx->json, "error", mpls_strerror(err));
+        json_object_end(&ctx->json);
+        json_end_record(&ctx->json);
+    }
+}
+
+void
+dump_show_marks(dump_ctx_t *ctx, const char *name, MPLS_PL *pl)
+{
+    const dump_opts_t *opts = ctx->opts;
+    json_writer_t *jw = opts->json ? &ctx->json : NULL;
+    str_list_t chapter_files = {0,};
+    char filename[128] = {0};
+    int level = 0;
+    int ii;
+    char current_clip_id[6] = {0};
+    char temp_clip_id[8] = {',', 0, 0, 0, 0, 0, ',', 0};
+    int reset_timestamp = 0;
+    int reset_file_timestamp = 0;
+    uint32_t current_timestamp = 0;
+    uint32_t current_file_timestamp = 0;
+    int chapter_id = 1;
+    FILE* fp = NULL;
+
+    double fps = 24 / 1.001;
+    uint32_t fps30 = 0, fps24 = 0;
+
+    // guess FPS
+    for (ii = 0; ii < pl->mark_count; ii++) {
+        uint32_t time = pl->play_mark[ii].abs_start;
+        double time_f = time / 45000.0;
+        double frame_f_30 = time_f / 1.001 * 30.0;
+        double frame_f_24 = time_f / 1.001 * 24.0;
+        double diff_f_30 = fabs(frame_f_30 - round(frame_f_30));
+        double diff_f_24 = fabs(frame_f_24 - round(frame_f_24));
+        if (diff_f_30 < 1e-2) fps30++;
+        if (diff_f_24 < 1e-2) fps24++;
+    }
+
+    if (fps30 > fps24)
+        fps = 30 / 1.001;
+
+    if (jw) {
+        _json_playlist(jw, name, pl, fps);
+        json_array_begin(jw, "marks");
+    }
+
+    for (ii = 0; ii < pl->mark_count; ii++) {
+        MPLS_PI *pi;
+        MPLS_PLM *plm;
+        str_t *clip_id;
+        int hour, min;
+        double sec;
+        int p_hour, p_min;
+        double p_sec;
+
+        plm = &pl->play_mark[ii];
+        if (!jw)
+            fprintf(ctx->out, "PlayMark %2d: ", ii);
+        if (plm->play_item_ref < pl->list_count) {
+            pi = &pl->play_item[plm->play_item_ref];
+            clip_id = str_substr(pi->clip_id, 0, 5);
+
+            if (opts->included_files[0]) {
+                // Filter clip id
+                strncpy(temp_clip_id + 1, pi->clip_id, 5);
+                if (strstr(opts->included_files, temp_clip_id) == NULL) {
+                    if (jw) {
+                        json_object_begin(jw, NULL);
+                        json_int(jw, "index", ii);
+                        json_uint(jw, "play_item", plm->play_item_ref);
+                        json_string(jw, "clip_id", clip_id->buf);
+                        json_bool(jw, "skipped", 1);
+                        json_object_end(jw);
+                    } else {
+                        fprintf(ctx->out, "Skipped: %s\n", clip_id->buf);
+                    }
+                    continue;
+                }
+            }
+
+            int new_file = opts->cut_at_new_file && strncmp(clip_id->buf, current_clip_id, 5) != 0;
+            if (current_clip_id[0] == 0 || new_file) {
+                reset_timestamp = 1;
+                if (new_file)
+                    reset_file_timestamp = 1;
+            }
+            strncpy(current_clip_id, clip_id->buf, 5);
+            if (opts->cut_seconds[ctx->cut_seconds_idx] > 0.0) {
+                uint32_t rel_start_current = plm->abs_start - current_timestamp;
+                double sec = rel_start_current / 45000.0;
+                if (sec > opts->cut_seconds[ctx->cut_seconds_idx]) {
+                    reset_timestamp = 1;
+                    if (opts->cut_seconds[ctx->cut_seconds_idx+1] > 0.0)
+                        ctx->cut_seconds_idx++;
+                }
+            }
+            if (!jw)
+                fprintf(ctx->out, "PlayItem: %s\n", clip_id->buf);
+            str_free(clip_id);
+            free(clip_id);
+        } else if (!jw) {
+            fprintf(ctx->out, "PlayItem: Invalid reference\n");
+        }
+
+        if (reset_file_timestamp) {
+            current_file_timestamp = plm->abs_start;
+            reset_file_timestamp = 0;
+        }
+
+        if (reset_timestamp) {
+            if (fp)
+                fclose(fp);
+            if (opts->prefix[0]) {
+                strncpy(filename, opts->prefix, 63);
+                sprintf(filename + strlen(filename), "_%02d_%sm2ts_%0.0f.txt", ctx->item_id, current_clip_id, round((plm->abs_start - current_file_timestamp) * fps / 45000.0));
+                if (!jw)
+                    fprintf(ctx->out, "Opening %s\n", filename);
+                fp = fopen(filename, "wb");
+                if (!fp) {
+                    if (jw) {
+                        str_t error = {0,};
+                        str_printf(&error, "unable to open file %s", filename);
+                        _json_playlist_end(jw, &chapter_files, error.buf);
+                        str_free(&error);
+                    } else {
+                        fprintf(ctx->out, "ERROR: unable to open file %s\n", filename);
+                        str_list_free(&chapter_files);
+                    }
+                    return;
+                }
+                str_list_append(&chapter_files, filename);
+                if (ctx->written)
+                    str_list_append(ctx->written, filename);
+            }
+            current_timestamp = plm->abs_start;
+            reset_timestamp = 0;
+            ctx->item_id++;
+            chapter_id = 1;
+        }
+
+        p_hour = plm->abs_start / (45000*60*60);
+        p_min = plm->abs_start / (45000*60) % 60;
+        p_sec = (double)(plm->abs_start % (45000 * 60)) / 45000;
+
+        uint32_t rel_start = plm->abs_start - current_timestamp;
+        hour = rel_start / (45000*60*60);
+        min = rel_start / (45000*60) % 60;
+        sec = (double)(rel_start % (45000 * 60)) / 45000;
+        if (jw) {
+            json_object_begin(jw, NULL);
+            json_int(jw, "index", ii);
+            if (plm->play_item_ref < pl->list_count) {
+                json_uint(jw, "play_item", plm->play_item_ref);
+                json_stringn(jw, "clip_id", current_clip_id, 5);
+            } else {
+                json_null(jw, "play_item");
+                json_null(jw, "clip_id");
+            }
+            json_uint(jw, "abs_time", plm->abs_start);
+            json_fixed(jw, "abs_seconds", plm->abs_start / 45000.0, 3);
+            json_uint(jw, "rel_time", rel_start);
+            json_fixed(jw, "rel_seconds", rel_start / 45000.0, 3);
+            json_fixed(jw, "frame", round(rel_start * fps / 45000.0), 0);
+            json_int(jw, "chapter", chapter_id);
+            json_string(jw, "chapter_file", fp ? filename : NULL);
+            json_object_end(jw);
+        } else {
+            indent_fprintf(ctx->out, level+1, "Abs Time (mm:ss.ms): %02d:%02d:%06.3f (%02d:%02d:%06.3f) [%0.0f]", p_hour, p_min, p_sec, hour, min, sec, round(rel_start * fps / 45000.0));
+        }
+        if (fp)
+            fprintf(fp, "CHAPTER%02d=%02d:%02d:%06.3f\nCHAPTER%02dNAME=\n", chapter_id, hour, min, sec, chapter_id);
+        chapter_id++;
+    }
+    if (fp)
+        fclose(fp);
+    if (jw)
+        _json_playlist_end(jw, &chapter_files, NULL);
+    else
+        str_list_free(&chapter_files);
+}
+
+int
+dump_filter_dup(dump_ctx_t *ctx, MPLS_PL *pl)
+{
+    uint64_t fingerprint = mpls_fingerprint(pl);
+    int added;
+
+    // Playlists are compared by fingerprint, so nothing but the 64 bit
+    // hash has to be kept around once a playlist has been shown
+    pthread_mutex_lock(&ctx->dup_lock);
+    added = hash_set_add(&ctx->dup_set, fingerprint);
+    pthread_mutex_unlock(&ctx->dup_lock);
+    return added;
+}
+
+// True if a playlist with the same fingerprint was already shown.  The
+// set only grows and is filled in output order, so a playlist found here
+// is certain to be dropped by dump_filter_dup later on.
+int
+dump_seen_dup(dump_ctx_t *ctx, MPLS_PL *pl)
+{
+    uint64_t fingerprint = mpls_fingerprint(pl);
+    int found;
+
+    pthread_mutex_lock(&ctx->dup_lock);
+    found = hash_set_find(&ctx->dup_set, fingerprint);
+    pthread_mutex_unlock(&ctx->dup_lock);
+    return found;
+}
+
+static int
+_filter_accept(void *handle, MPLS_PL *pl)
+{
+    dump_ctx_t *ctx = handle;
+
+    if (ctx->opts->seconds && !dump_filter_short(pl, ctx->opts->seconds)) {
+        return 0;
+    }
+    if (ctx->opts->repeats && !dump_filter_repeats(pl, ctx->opts->repeats)) {
+        return 0;
+    }
+    if (ctx->opts->dups && dump_seen_dup(ctx, pl)) {
+        return 0;
+    }
+    return 1;
+}
+
+// Turns the -s, -r and -d options into a parser filter, so rejected
+// playlists are dropped before their STN tables and marks are decoded.
+// Kept playlists get their STN tables even for text, decoding them is
+// what reports unrecognized stream and coding types.
+void
+dump_filter_init(dump_ctx_t *ctx, MPLS_FILTER *filter)
+{
+    memset(filter, 0, sizeof(*filter));
+    if (ctx->opts->seconds > 0) {
+        filter->min_duration = (uint64_t)(ctx->opts->seconds + 1) * 45000;
+    }
+    filter->accept = _filter_accept;
+    filter->handle = ctx;
+}
+
+int
+dump_filter_short(MPLS_PL *pl, int seconds)
+{
+    // Ignore short playlists
+    if (pl->duration / 45000 <= seconds) {
+        return 0;
+    }
+    return 1;
+}
+
+// Size of the clip id table used by dump_filter_repeats, a power of two.
+// Playlists with more distinct clips than REPEAT_FILL are counted in
+// several passes, each one only looking at a slice of the hash space.
+#define REPEAT_SLOTS 2048
+#define REPEAT_FILL  1536
+
+int
+dump_filter_repeats(MPLS_PL *pl, int repeats)
+{
+    uint64_t key[REPEAT_SLOTS];
+    uint16_t count[REPEAT_SLOTS];
+    int parts, part, used, ii;
+
+    parts = (pl->list_count + REPEAT_FILL - 1) / REPEAT_FILL;
+    if (parts < 1) {
+        parts = 1;
+    }
+
+restart:
+    for (part = 0; part < parts; part++) {
+        memset(key, 0, sizeof(key));
+        used = 0;
+        for (ii = 0; ii < pl->list_count; ii++) {
+            const uint8_t *id = (const uint8_t*)pl->play_item[ii].clip_id;
+            uint64_t k;
+            uint32_t h, slot;
+
+            // Pack the 5 character clip id, the top bit keeps it non-zero
+            k = 1ULL << 40 | (uint64_t)id[0] << 32 | (uint64_t)id[1] << 24 |
+                (uint64_t)id[2] << 16 | (uint64_t)id[3] << 8 | id[4];
+            h = (k * 0x9e3779b97f4a7c15ULL) >> 32;
+            if (h % parts != (uint32_t)part) {
+                continue;
+            }
+            for (slot = h & (REPEAT_SLOTS - 1); key[slot] && key[slot] != k;
+                 slot = (slot + 1) & (REPEAT_SLOTS - 1));
+            if (key[slot] == 0) {
+                if (++used > REPEAT_FILL) {
+                    parts *= 2;
+                    goto restart;
+                }
+                key[slot] = k;
+                count[slot] = 0;
+            }
+            // Ignore titles with repeated segments
+            if (++count[slot] > repeats) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+void
+dump_show_warnings(dump_ctx_t *ctx, const char *name, uint32_t warnings)
+{
+    uint32_t flag;
+
+    for (flag = 1; flag <= MPLS_WARN_SUBPATH; flag <<= 1) {
+        if (!(warnings & flag)) {
+            continue;
+        }
+        if (flag == MPLS_WARN_SUBPATH && !ctx->opts->verbose) {
+            continue;
+        }
+        fprintf(ctx->log, "%s: %s\n", name, mpls_strwarning(flag));
+    }
+}
+
+void
+dump_opts_init(dump_opts_t *opts)
+{
+    int ii;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->jobs = 1;
+    for (ii = 0; ii < MAX_CUTS; ii++) {
+        opts->cut_seconds[ii] = -1.0;
+    }
+}
+
+void
+dump_ctx_init(dump_ctx_t *ctx, const dump_opts_t *opts, FILE *out, FILE *log)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->log = log;
+    pthread_mutex_init(&ctx->dup_lock, NULL);
+    dump_ctx_begin(ctx, opts, out);
+}
+
+void
+dump_ctx_free(dump_ctx_t *ctx)
+{
+    dump_ctx_end(ctx);
+    hash_set_free(&ctx->dup_set);
+    pthread_mutex_destroy(&ctx->dup_lock);
+}
+
+// Starts another run on the context.  Chapter numbering and the cut
+// position start over, playlists already seen stay duplicates.
+void
+dump_ctx_begin(dump_ctx_t *ctx, const dump_opts_t *opts, FILE *out)
+{
+    ctx->opts = opts;
+    ctx->out = out;
+    ctx->cut_seconds_idx = 0;
+    ctx->item_id = 1;
+    if (opts->json) {
+        json_init(&ctx->json, out, JSON_BUF_SIZE);
+    }
+}
+
+// Flushes the output of the current run, "out" may be closed afterwards
+void
+dump_ctx_end(dump_ctx_t *ctx)
+{
+    json_free(&ctx->json);
+}
@@ -0,0 +1,71 @@
+#if !defined(_MPLS_SHOW_H_)
+#define _MPLS_SHOW_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "util.h"
+#include "mpls_parse.h"
+#include "mpls_cache.h"
+#include "mpls_index.h"
+#include "mpls_catalog.h"
+#include "json_writer.h"
+
+#define MAX_CUTS 4096
+#define JSON_BUF_SIZE (4 << 20)
+
+// Options, set up once and only read afterwards so they can be shared
+// by any number of threads
+typedef struct {
+    int         verbose;
+    int         repeats;
+    int         seconds;
+    int         dups;
+    int         cut_at_new_file;
+    int         jobs;
+    int         physical;       // read playlists in on-disk order
+    int         titles_only;    // only playlists the title table reaches
+    int         json;
+    double      cut_seconds[MAX_CUTS];
+    char        included_files[4096];
+    char        prefix[64];
+    MPLS_CACHE *cache;
+    MPLS_INDEX *index;          // emitted playlists go in, output order only
+    MPLS_CATALOG *catalog;      // same, checked before the output
+} dump_opts_t;
+
+// State of one dump run.  Playlists processed through the same context
+// share chapter file numbering, the cut position and duplicate
+// detection, separate contexts never interfere with each other.  Only
+// the duplicate set may be used from parser threads, under dup_lock.
+typedef struct {
+    const dump_opts_t *opts;
+    FILE              *out;
+    FILE              *log;
+    int                cut_seconds_idx;
+    int                item_id;
+    hash_set_t         dup_set;
+    pthread_mutex_t    dup_lock;
+    json_writer_t      json;        // NDJSON records on "out" with --json
+    str_list_t        *written;     // chapter files are also listed here when set
+} dump_ctx_t;
+
+void dump_opts_init(dump_opts_t *opts);
+void dump_ctx_init(dump_ctx_t *ctx, const dump_opts_t *opts, FILE *out, FILE *log);
+void dump_ctx_free(dump_ctx_t *ctx);
+void dump_ctx_begin(dump_ctx_t *ctx, const dump_opts_t *opts, FILE *out);
+void dump_ctx_end(dump_ctx_t *ctx);
+
+// Filters return 1 to keep the playlist, 0 to drop it.  Only
+// dump_filter_dup depends on what was seen before.
+int dump_filter_short(MPLS_PL *pl, int seconds);
+int dump_filter_repeats(MPLS_PL *pl, int repeats);
+int dump_filter_dup(dump_ctx_t *ctx, MPLS_PL *pl);
+int dump_seen_dup(dump_ctx_t *ctx, MPLS_PL *pl);
+void dump_filter_init(dump_ctx_t *ctx, MPLS_FILTER *filter);
+
+void dump_show_warnings(dump_ctx_t *ctx, const char *name, uint32_t warnings);
+void dump_show_error(dump_ctx_t *ctx, const char *name, int err);
+void dump_show_marks(dump_ctx_t *ctx, const char *name, MPLS_PL *pl);
+
+#endif // _MPLS_SHOW_H_
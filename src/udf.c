@@ -0,0 +1,739 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#if defined(_WIN32)
+#include <io.h>
+#include <pthread.h>
+#endif
+#include "util.h"
+#include "udf.h"
+
+#if !defined(O_BINARY)
+#define O_BINARY 0
+#endif
+
+#define UDF_SECTOR          2048
+#define UDF_AVDP_SECTOR     256
+#define UDF_MAX_VDS         64          // sectors of the volume descriptor sequence
+#define UDF_MAX_PARTS       8
+#define UDF_MAX_DEPTH       16          // chained allocation descriptor blocks
+#define UDF_MAX_FILE        (64 << 20)  // playlists and directories are far smaller
+
+// Descriptor tag identifiers, ECMA-167 3/7.2.1 and 4/7.2.1
+#define TAG_AVDP            2
+#define TAG_PD              5
+#define TAG_LVD             6
+#define TAG_TD              8
+#define TAG_FSD             256
+#define TAG_FID             257
+#define TAG_AED             258
+#define TAG_FE              261
+#define TAG_EFE             266
+
+// Allocation descriptor types in the ICB tag flags
+#define AD_SHORT            0
+#define AD_LONG             1
+#define AD_EXTENDED         2
+#define AD_EMBEDDED         3
+
+// Extent types in the top bits of an extent length
+#define EXT_RECORDED        0
+#define EXT_CONTINUATION    3
+
+// File characteristics of a file identifier descriptor
+#define FID_DIRECTORY       0x02
+#define FID_DELETED         0x04
+#define FID_PARENT          0x08
+
+typedef struct
+{
+    uint16_t    part;
+    uint32_t    lbn;
+    uint32_t    len;
+    int         recorded;
+} udf_extent_t;
+
+typedef struct
+{
+    uint16_t        number;
+    uint32_t        start;      // first sector of the physical partition
+    int             phys;       // metadata partitions: index of the physical one
+    udf_extent_t   *ext;        // metadata partitions: extents of the metadata file
+    int             ext_count;
+} udf_part_t;
+
+typedef struct
+{
+    uint64_t        size;
+    uint8_t        *embedded;   // file data held in the entry itself
+    udf_extent_t   *ext;
+    int             ext_count;
+} udf_entry_t;
+
+struct udf_s
+{
+    int             fd;
+#if defined(_WIN32)
+    pthread_mutex_t lock;
+#endif
+    udf_part_t      part[UDF_MAX_PARTS];
+    int             part_count;
+    uint16_t        root_part;
+    uint32_t        root_lbn;
+};
+
+static uint16_t
+_le16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t
+_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t
+_le64(const uint8_t *p)
+{
+    return _le32(p) | (uint64_t)_le32(p + 4) << 32;
+}
+
+static int
+_pread(UDF *udf, uint8_t *buf, size_t len, uint64_t offset)
+{
+    ssize_t got;
+
+#if defined(_WIN32)
+    pthread_mutex_lock(&udf->lock);
+    if (_lseeki64(udf->fd, offset, SEEK_SET) < 0) {
+        pthread_mutex_unlock(&udf->lock);
+        return -1;
+    }
+    while (len > 0) {
+        got = read(udf->fd, buf, len > (1 << 30) ? (1 << 30) : len);
+        if (got <= 0) {
+            break;
+        }
+        buf += got;
+        len -= got;
+    }
+    pthread_mutex_unlock(&udf->lock);
+#else
+    while (len > 0) {
+        got = pread(udf->fd, buf, len, offset);
+        if (got <= 0) {
+            break;
+        }
+        buf += got;
+        len -= got;
+        offset += got;
+    }
+#endif
+    return len == 0 ? 0 : -1;
+}
+
+static int
+_read_sector(UDF *udf, uint32_t sector, uint8_t *buf)
+{
+    return _pread(udf, buf, UDF_SECTOR, (uint64_t)sector * UDF_SECTOR);
+}
+
+// Identifier and checksum of a descriptor tag
+static int
+_check_tag(const uint8_t *buf, uint16_t id)
+{
+    uint8_t sum = 0;
+    int ii;
+
+    for (ii = 0; ii < 16; ii++) {
+        if (ii != 4) {
+            sum += buf[ii];
+        }
+    }
+    return sum == buf[4] && _le16(buf) == id;
+}
+
+// Sector of a logical block of a partition.  Metadata partitions are
+// stored in the extents of their metadata file.
+static int
+_sector(UDF *udf, uint16_t part, uint32_t lbn, uint32_t *sector)
+{
+    udf_part_t *p;
+    uint64_t offset;
+    int ii;
+
+    if (part >= udf->part_count) {
+        return -1;
+    }
+    p = &udf->part[part];
+    if (p->phys < 0) {
+        *sector = p->start + lbn;
+        return 0;
+    }
+    offset = (uint64_t)lbn * UDF_SECTOR;
+    for (ii = 0; ii < p->ext_count; ii++) {
+        if (offset < p->ext[ii].len) {
+            if (!p->ext[ii].recorded) {
+                return -1;
+            }
+            return _sector(udf, p->phys, p->ext[ii].lbn + offset / UDF_SECTOR, sector);
+        }
+        offset -= p->ext[ii].len;
+    }
+    return -1;
+}
+
+static int
+_read_block(UDF *udf, uint16_t part, uint32_t lbn, uint8_t *buf)
+{
+    uint32_t sector;
+
+    if (_sector(udf, part, lbn, &sector) < 0) {
+        return -1;
+    }
+    return _read_sector(udf, sector, buf);
+}
+
+// Reads "len" bytes from consecutive blocks of a partition, with one
+// read for each run of consecutive sectors
+static int
+_read_extent(UDF *udf, uint16_t part, uint32_t lbn, uint8_t *buf, size_t len)
+{
+    uint32_t first = 0, count = 0, sector;
+    size_t done = 0, run;
+
+    while (done < len) {
+        if (_sector(udf, part, lbn++, &sector) < 0) {
+            return -1;
+        }
+        if (count > 0 && sector == first + count) {
+            count++;
+        } else {
+            if (count > 0) {
+                run = (size_t)count * UDF_SECTOR;
+                if (_pread(udf, buf + done, run, (uint64_t)first * UDF_SECTOR) < 0) {
+                    return -1;
+                }
+                done += run;
+            }
+            first = sector;
+            count = 1;
+        }
+        if (done + (size_t)count * UDF_SECTOR >= len) {
+            break;
+        }
+    }
+    if (count > 0 && done < len) {
+        if (_pread(udf, buf + done, len - done, (uint64_t)first * UDF_SECTOR) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+_add_extent(udf_entry_t *e, uint16_t part, uint32_t lbn, uint32_t len, int recorded)
+{
+    udf_extent_t *ext;
+
+    ext = realloc(e->ext, (e->ext_count + 1) * sizeof(udf_extent_t));
+    if (ext == NULL) {
+        return -1;
+    }
+    e->ext = ext;
+    e->ext[e->ext_count].part = part;
+    e->ext[e->ext_count].lbn = lbn;
+    e->ext[e->ext_count].len = len;
+    e->ext[e->ext_count].recorded = recorded;
+    e->ext_count++;
+    return 0;
+}
+
+// Collects the extents of a list of allocation descriptors, following
+// the chain of allocation extent descriptors it may continue in
+static int
+_add_ads(UDF *udf, udf_entry_t *e, const uint8_t *ad, uint32_t len, int type,
+         uint16_t part, int depth)
+{
+    uint8_t buf[UDF_SECTOR];
+    uint32_t size, ext_len, ext_type, lbn, l_ad;
+    uint16_t ext_part;
+
+    size = type == AD_SHORT ? 8 : type == AD_LONG ? 16 : 20;
+    for (; len >= size; ad += size, len -= size) {
+        ext_len = _le32(ad) & 0x3fffffff;
+        ext_type = _le32(ad) >> 30;
+        if (ext_len == 0) {
+            break;
+        }
+        ext_part = part;
+        if (type == AD_SHORT) {
+            lbn = _le32(ad + 4);
+        } else if (type == AD_LONG) {
+            lbn = _le32(ad + 4);
+            ext_part = _le16(ad + 8);
+        } else {
+            lbn = _le32(ad + 12);
+            ext_part = _le16(ad + 16);
+        }
+
+        if (ext_type == EXT_CONTINUATION) {
+            if (depth >= UDF_MAX_DEPTH || _read_block(udf, ext_part, lbn, buf) < 0 ||
+                !_check_tag(buf, TAG_AED)) {
+                return -1;
+            }
+            l_ad = _le32(buf + 20);
+            if (l_ad > UDF_SECTOR - 24) {
+                return -1;
+            }
+            return _add_ads(udf, e, buf + 24, l_ad, type, ext_part, depth + 1);
+        }
+        if (_add_extent(e, ext_part, lbn, ext_len, ext_type == EXT_RECORDED) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+_free_entry(udf_entry_t *e)
+{
+    X_FREE(e->embedded);
+    X_FREE(e->ext);
+    memset(e, 0, sizeof(*e));
+}
+
+// Reads a file entry or extended file entry and its allocation
+static int
+_read_entry(UDF *udf, uint16_t part, uint32_t lbn, udf_entry_t *e)
+{
+    uint8_t buf[UDF_SECTOR];
+    uint32_t l_ea, l_ad, base;
+    int type;
+
+    memset(e, 0, sizeof(*e));
+    if (_read_block(udf, part, lbn, buf) < 0) {
+        return -1;
+    }
+    if (_check_tag(buf, TAG_FE)) {
+        l_ea = _le32(buf + 168);
+        l_ad = _le32(buf + 172);
+        base = 176;
+    } else if (_check_tag(buf, TAG_EFE)) {
+        l_ea = _le32(buf + 208);
+        l_ad = _le32(buf + 212);
+        base = 216;
+    } else {
+        return -1;
+    }
+    if (l_ea > UDF_SECTOR || l_ad > UDF_SECTOR - base - l_ea) {
+        return -1;
+    }
+    e->size = _le64(buf + 56);
+    type = _le16(buf + 34) & 7;
+
+    if (type == AD_EMBEDDED) {
+        if (e->size > l_ad) {
+            e->size = l_ad;
+        }
+        e->embedded = malloc(l_ad ? l_ad : 1);
+        if (e->embedded == NULL) {
+            return -1;
+        }
+        memcpy(e->embedded, buf + base + l_ea, l_ad);
+        return 0;
+    }
+    if (type > AD_EXTENDED ||
+        _add_ads(udf, e, buf + base + l_ea, l_ad, type, part, 0) < 0) {
+        _free_entry(e);
+        return -1;
+    }
+    return 0;
+}
+
+static uint8_t*
+_read_data(UDF *udf, udf_entry_t *e, size_t *len)
+{
+    uint8_t *buf;
+    size_t done = 0, size;
+    int ii;
+
+    if (e->size > UDF_MAX_FILE) {
+        return NULL;
+    }
+    buf = calloc(1, e->size ? e->size : 1);
+    if (buf == NULL) {
+        return NULL;
+    }
+    if (e->embedded != NULL) {
+        memcpy(buf, e->embedded, e->size);
+    }
+    for (ii = 0; e->embedded == NULL && ii < e->ext_count && done < e->size; ii++) {
+        size = e->ext[ii].len;
+        if (size > e->size - done) {
+            size = e->size - done;
+        }
+        // Unrecorded extents read as zeros
+        if (e->ext[ii].recorded &&
+            _read_extent(udf, e->ext[ii].part, e->ext[ii].lbn, buf + done, size) < 0) {
+            free(buf);
+            return NULL;
+        }
+        done += size;
+    }
+    *len = e->size;
+    return buf;
+}
+
+// File identifiers are OSTA compressed unicode, 8 or 16 bits per char
+static void
+_decode_name(const uint8_t *id, int len, char *name, size_t size)
+{
+    size_t out = 0;
+    uint32_t c;
+    int step, ii;
+
+    name[0] = 0;
+    if (len < 1 || (id[0] != 8 && id[0] != 16)) {
+        return;
+    }
+    step = id[0] / 8;
+    for (ii = 1; ii + step <= len; ii += step) {
+        c = step == 1 ? id[ii] : (uint32_t)id[ii] << 8 | id[ii + 1];
+        if (c < 0x80) {
+            if (out + 1 >= size) {
+                break;
+            }
+            name[out++] = c;
+        } else if (c < 0x800) {
+            if (out + 2 >= size) {
+                break;
+            }
+            name[out++] = 0xc0 | c >> 6;
+            name[out++] = 0x80 | (c & 0x3f);
+        } else {
+            if (out + 3 >= size) {
+                break;
+            }
+            name[out++] = 0xe0 | c >> 12;
+            name[out++] = 0x80 | (c >> 6 & 0x3f);
+            name[out++] = 0x80 | (c & 0x3f);
+        }
+    }
+    name[out] = 0;
+}
+
+// Reads the file identifiers of a directory
+static int
+_read_dir(UDF *udf, uint16_t part, uint32_t lbn, UDF_DIRENT **ents)
+{
+    udf_entry_t e;
+    UDF_DIRENT *list = NULL, *tmp;
+    uint8_t *buf, *p;
+    size_t len, size;
+    int count = 0, alloc = 0;
+    uint32_t l_fi, l_iu;
+
+    if (_read_entry(udf, part, lbn, &e) < 0) {
+        return -1;
+    }
+    buf = _read_data(udf, &e, &len);
+    _free_entry(&e);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    for (p = buf; p + 38 <= buf + len; p += size) {
+        if (!_check_tag(p, TAG_FID)) {
+            break;
+        }
+        l_fi = p[19];
+        l_iu = _le16(p + 36);
+        size = (38 + l_iu + l_fi + 3) & ~3;
+        if (p + 38 + l_iu + l_fi > buf + len) {
+            break;
+        }
+        if (p[18] & (FID_DELETED | FID_PARENT)) {
+            continue;
+        }
+        if (count == alloc) {
+            alloc = alloc ? 2 * alloc : 64;
+            tmp = realloc(list, alloc * sizeof(UDF_DIRENT));
+            if (tmp == NULL) {
+                break;
+            }
+            list = tmp;
+        }
+        _decode_name(p + 38 + l_iu, l_fi, list[count].name, sizeof(list[count].name));
+        list[count].is_dir = !!(p[18] & FID_DIRECTORY);
+        list[count].lbn = _le32(p + 24);
+        list[count].part = _le16(p + 28);
+        count++;
+    }
+    free(buf);
+    *ents = list;
+    return count;
+}
+
+typedef struct
+{
+    uint16_t    number;
+    uint32_t    start;
+} udf_pd_t;
+
+// Adds a partition map of the logical volume descriptor.  Metadata
+// partitions only get their location here, see _load_metadata().
+static int
+_add_map(UDF *udf, const uint8_t *map, const udf_pd_t *pd, int pd_count,
+         uint32_t *meta_loc)
+{
+    udf_part_t *p;
+    uint16_t number;
+    int ii;
+
+    if (udf->part_count == UDF_MAX_PARTS) {
+        return -1;
+    }
+    p = &udf->part[udf->part_count];
+    memset(p, 0, sizeof(*p));
+    p->phys = -1;
+
+    if (map[0] == 1) {
+        number = _le16(map + 4);
+    } else if (map[0] == 2 && memcmp(map + 5, "*UDF Metadata Partition", 23) == 0) {
+        number = _le16(map + 38);
+        p->phys = udf->part_count;
+        meta_loc[0] = _le32(map + 40);
+        meta_loc[1] = _le32(map + 44);
+    } else if (map[0] == 2 && memcmp(map + 5, "*UDF Sparable Partition", 23) == 0) {
+        // Pressed discs have nothing to spare, read it as a physical one
+        number = _le16(map + 38);
+    } else {
+        return -1;
+    }
+    for (ii = 0; ii < pd_count; ii++) {
+        if (pd[ii].number == number) {
+            break;
+        }
+    }
+    if (ii == pd_count) {
+        return -1;
+    }
+    p->number = number;
+    p->start = pd[ii].start;
+    udf->part_count++;
+    return 0;
+}
+
+// Reads the metadata file of a metadata partition from the physical
+// partition of the same number, or from its mirror copy
+static int
+_load_metadata(UDF *udf, int part, const uint32_t *meta_loc)
+{
+    udf_part_t *p = &udf->part[part];
+    udf_entry_t e;
+    int ii;
+
+    for (ii = 0; ii < udf->part_count; ii++) {
+        if (udf->part[ii].phys < 0 && udf->part[ii].number == p->number) {
+            break;
+        }
+    }
+    if (ii == udf->part_count) {
+        // Not in the maps, added behind them where no reference reaches
+        if (udf->part_count == UDF_MAX_PARTS) {
+            return -1;
+        }
+        udf->part[ii] = *p;
+        udf->part[ii].phys = -1;
+        udf->part_count++;
+    }
+    p->phys = ii;
+    if (_read_entry(udf, ii, meta_loc[0], &e) < 0 &&
+        _read_entry(udf, ii, meta_loc[1], &e) < 0) {
+        return -1;
+    }
+    p->ext = e.ext;
+    p->ext_count = e.ext_count;
+    X_FREE(e.embedded);
+    return 0;
+}
+
+// Finds the partitions and the root directory from the anchor, the
+// main volume descriptor sequence and the file set descriptor
+static int
+_mount(UDF *udf)
+{
+    uint8_t buf[UDF_SECTOR], lvd[UDF_SECTOR];
+    udf_pd_t pd[UDF_MAX_PARTS];
+    uint32_t meta_loc[UDF_MAX_PARTS][2];
+    uint32_t vds, vds_len, map_len, map_count, off, ii;
+    int pd_count = 0, have_lvd = 0, count;
+    uint16_t fsd_part;
+    uint32_t fsd_lbn;
+
+    if (_read_sector(udf, UDF_AVDP_SECTOR, buf) < 0 || !_check_tag(buf, TAG_AVDP)) {
+        return -1;
+    }
+    vds_len = _le32(buf + 16) / UDF_SECTOR;
+    vds = _le32(buf + 20);
+    for (ii = 0; ii < vds_len && ii < UDF_MAX_VDS; ii++) {
+        if (_read_sector(udf, vds + ii, buf) < 0) {
+            return -1;
+        }
+        if (_check_tag(buf, TAG_TD)) {
+            break;
+        }
+        if (_check_tag(buf, TAG_PD) && pd_count < UDF_MAX_PARTS) {
+            pd[pd_count].number = _le16(buf + 22);
+            pd[pd_count].start = _le32(buf + 188);
+            pd_count++;
+        } else if (_check_tag(buf, TAG_LVD) && !have_lvd) {
+            memcpy(lvd, buf, UDF_SECTOR);
+            have_lvd = 1;
+        }
+    }
+    if (!have_lvd || _le32(lvd + 212) != UDF_SECTOR) {
+        return -1;
+    }
+
+    map_len = _le32(lvd + 264);
+    map_count = _le32(lvd + 268);
+    if (map_len > UDF_SECTOR - 440) {
+        return -1;
+    }
+    for (ii = 0, off = 440; ii < map_count; ii++) {
+        if (off + 2 > 440 + map_len || lvd[off + 1] < 6 ||
+            off + lvd[off + 1] > 440 + map_len ||
+            _add_map(udf, lvd + off, pd, pd_count, meta_loc[ii]) < 0) {
+            return -1;
+        }
+        off += lvd[off + 1];
+    }
+    count = udf->part_count;
+    for (ii = 0; ii < (uint32_t)count; ii++) {
+        if (udf->part[ii].phys >= 0 && _load_metadata(udf, ii, meta_loc[ii]) < 0) {
+            return -1;
+        }
+    }
+
+    fsd_lbn = _le32(lvd + 252);
+    fsd_part = _le16(lvd + 256);
+    if (_read_block(udf, fsd_part, fsd_lbn, buf) < 0 || !_check_tag(buf, TAG_FSD)) {
+        return -1;
+    }
+    udf->root_lbn = _le32(buf + 404);
+    udf->root_part = _le16(buf + 408);
+    return 0;
+}
+
+UDF*
+udf_open(const char *path)
+{
+    UDF *udf;
+
+    udf = calloc(1, sizeof(UDF));
+    if (udf == NULL) {
+        return NULL;
+    }
+    udf->fd = open(path, O_RDONLY | O_BINARY);
+    if (udf->fd < 0) {
+        free(udf);
+        return NULL;
+    }
+#if defined(_WIN32)
+    pthread_mutex_init(&udf->lock, NULL);
+#endif
+    if (_mount(udf) < 0) {
+        udf_close(udf);
+        return NULL;
+    }
+    return udf;
+}
+
+void
+udf_close(UDF *udf)
+{
+    int ii;
+
+    if (udf == NULL) {
+        return;
+    }
+    for (ii = 0; ii < udf->part_count; ii++) {
+        X_FREE(udf->part[ii].ext);
+    }
+    close(udf->fd);
+#if defined(_WIN32)
+    pthread_mutex_destroy(&udf->lock);
+#endif
+    free(udf);
+}
+
+int
+udf_list(UDF *udf, const char *path, UDF_DIRENT **ents)
+{
+    UDF_DIRENT *list;
+    uint16_t part = udf->root_part;
+    uint32_t lbn = udf->root_lbn;
+    char name[256];
+    const char *end;
+    size_t len;
+    int count, ii;
+
+    while (*path) {
+        end = strchr(path, '/');
+        len = end ? (size_t)(end - path) : strlen(path);
+        if (len > 0) {
+            if (len >= sizeof(name)) {
+                return -1;
+            }
+            memcpy(name, path, len);
+            name[len] = 0;
+            count = _read_dir(udf, part, lbn, &list);
+            if (count < 0) {
+                return -1;
+            }
+            for (ii = 0; ii < count; ii++) {
+                if (list[ii].is_dir && strcasecmp(list[ii].name, name) == 0) {
+                    break;
+                }
+            }
+            if (ii == count) {
+                free(list);
+                return -1;
+            }
+            part = list[ii].part;
+            lbn = list[ii].lbn;
+            free(list);
+        }
+        path += len;
+        if (*path == '/') {
+            path++;
+        }
+    }
+    return _read_dir(udf, part, lbn, ents);
+}
+
+uint8_t*
+udf_read(UDF *udf, const UDF_DIRENT *ent, size_t *len)
+{
+    udf_entry_t e;
+    uint8_t *buf;
+
+    if (ent->is_dir || _read_entry(udf, ent->part, ent->lbn, &e) < 0) {
+        return NULL;
+    }
+    buf = _read_data(udf, &e, len);
+    _free_entry(&e);
+    return buf;
+}
@@ -0,0 +1,33 @@
+#if !defined(_UDF_H_)
+#define _UDF_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Read only access to the UDF file system of a disc image, enough to
+// find and read the small files of a BD (UDF 2.50 with a metadata
+// partition) or of an image written with plain physical partitions.
+// Only the sectors that hold the descriptors, directories and requested
+// files are read.  A UDF handle may be read from several threads.
+typedef struct udf_s UDF;
+
+typedef struct
+{
+    char        name[256];      // UTF-8
+    int         is_dir;
+    uint16_t    part;           // file entry location
+    uint32_t    lbn;
+} UDF_DIRENT;
+
+UDF* udf_open(const char *path);
+void udf_close(UDF *udf);
+
+// Lists the directory at "path", '/' separated from the root and
+// matched without regard to case.  Returns the number of entries and
+// the array in "ents", to be released with free(), or -1.
+int udf_list(UDF *udf, const char *path, UDF_DIRENT **ents);
+
+// Reads a whole file, returns a malloc'd buffer or NULL
+uint8_t* udf_read(UDF *udf, const UDF_DIRENT *ent, size_t *len);
+
+#endif // _UDF_H_
@@ -85,6 +85,70 @@ str_free(str_t *str)
     str->buf = NULL;
 }
 
+// Read the next newline or NUL terminated entry of a list file.
+// Returns the entry length or -1 once nothing is left to read.
+int
+str_read_entry(str_t *str, FILE *fp)
+{
+    int c;
+
+    str_realloc(str, 64);
+    str->len = 0;
+    str->buf[0] = 0;
+    for (c = getc(fp); c != EOF; c = getc(fp))
+    {
+        if (c == '\n' || c == 0)
+            break;
+        str_realloc(str, str->len + 2);
+        str->buf[str->len++] = c;
+    }
+    if (str->len > 0 && str->buf[str->len - 1] == '\r')
+        str->len--;
+    str->buf[str->len] = 0;
+    if (c == EOF && str->len == 0)
+        return -1;
+    return str->len;
+}
+
+void
+str_list_append(str_list_t *list, const char *item)
+{
+    if (list->count == list->alloc)
+    {
+        list->alloc = list->alloc ? 2 * list->alloc : 64;
+        list->item = realloc(list->item, list->alloc * sizeof(char*));
+    }
+    list->item[list->count++] = strdup(item);
+}
+
+static int
+str_list_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+void
+str_list_sort(str_list_t *list)
+{
+    if (list->count > 1)
+        qsort(list->item, list->count, sizeof(char*), str_list_cmp);
+}
+
+void
+str_list_free(str_list_t *list)
+{
+    int ii;
+
+    for (ii = 0; ii < list->count; ii++)
+    {
+        free(list->item[ii]);
+    }
+    X_FREE(list->item);
+    list->item = NULL;
+    list->alloc = 0;
+    list->count = 0;
+}
+
 void
 hex_dump(uint8_t *buf, int count)
 {
@@ -120,3 +184,114 @@ indent_printf(int level, char *fmt, ...)
     wrote = fwrite("\n", 1, 1, stdout);
 }
 
+void
+indent_fprintf(FILE *fp, int level, char *fmt, ...)
+{
+    va_list ap;
+    int ii;
+
+    for (ii = 0; ii < level; ii++)
+    {
+        fwrite("    ", 1, 4, fp);
+    }
+    va_start(ap, fmt);
+    vfprintf(fp, fmt, ap);
+    va_end(ap);
+    fwrite("\n", 1, 1, fp);
+}
+
+static uint64_t*
+hash_set_slot(hash_set_t *set, uint64_t key)
+{
+    int mask = set->alloc - 1;
+    int ii = (key ^ (key >> 32)) & mask;
+
+    while (set->slot[ii] != 0 && set->slot[ii] != key)
+    {
+        ii = (ii + 1) & mask;
+    }
+    return &set->slot[ii];
+}
+
+static void
+hash_set_grow(hash_set_t *set)
+{
+    hash_set_t old = *set;
+    int ii;
+
+    set->alloc = old.alloc ? old.alloc * 2 : 64;
+    set->slot = calloc(set->alloc, sizeof(uint64_t));
+    for (ii = 0; ii < old.alloc; ii++)
+    {
+        if (old.slot[ii])
+            *hash_set_slot(set, old.slot[ii]) = old.slot[ii];
+    }
+    X_FREE(old.slot);
+}
+
+// Returns 1 if the key was added, 0 if it was already present
+int
+hash_set_add(hash_set_t *set, uint64_t key)
+{
+    uint64_t *slot;
+
+    if (key == 0)
+        key = 1;
+    if (2 * (set->count + 1) > set->alloc)
+        hash_set_grow(set);
+    slot = hash_set_slot(set, key);
+    if (*slot == key)
+        return 0;
+    *slot = key;
+    set->count++;
+    return 1;
+}
+
+int
+hash_set_find(hash_set_t *set, uint64_t key)
+{
+    if (set->alloc == 0)
+        return 0;
+    if (key == 0)
+        key = 1;
+    return *hash_set_slot(set, key) == key;
+}
+
+// Returns 1 if the key was removed.  The keys after it in the same run
+// of slots are moved back so that no lookup stops at the hole.
+int
+hash_set_remove(hash_set_t *set, uint64_t key)
+{
+    int mask, ii, jj, home;
+
+    if (set->alloc == 0)
+        return 0;
+    if (key == 0)
+        key = 1;
+    mask = set->alloc - 1;
+    ii = hash_set_slot(set, key) - set->slot;
+    if (set->slot[ii] != key)
+        return 0;
+    for (jj = (ii + 1) & mask; set->slot[jj] != 0; jj = (jj + 1) & mask)
+    {
+        home = (set->slot[jj] ^ (set->slot[jj] >> 32)) & mask;
+        // Keys whose home slot lies cyclically in (ii, jj] stay put
+        if ((ii <= jj) ? (home <= ii || home > jj) : (home <= ii && home > jj))
+        {
+            set->slot[ii] = set->slot[jj];
+            ii = jj;
+        }
+    }
+    set->slot[ii] = 0;
+    set->count--;
+    return 1;
+}
+
+void
+hash_set_free(hash_set_t *set)
+{
+    X_FREE(set->slot);
+    set->slot = NULL;
+    set->alloc = 0;
+    set->count = 0;
+}
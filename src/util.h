@@ -1,3 +1,6 @@
+#if !defined(_UTIL_H_)
+#define _UTIL_H_
+
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -31,6 +34,21 @@ typedef struct
     int    len;
 } str_t;
 
+typedef struct
+{
+    char ** item;
+    int     alloc;
+    int     count;
+} str_list_t;
+
+// Open addressing set of 64 bit keys, zero is used as the empty marker
+typedef struct
+{
+    uint64_t * slot;
+    int        alloc;
+    int        count;
+} hash_set_t;
+
 void bdt_hex_dump(uint8_t *buf, int count);
 
 void str_append_sub(str_t *str, char *append, int start, int app_len);
@@ -38,5 +56,39 @@ str_t* str_substr(char *str, int start, int len);
 void str_append(str_t *str, char *append);
 void str_printf(str_t *str, const char *fmt, ...);
 void str_free(str_t *str);
+int str_read_entry(str_t *str, FILE *fp);
+void str_list_append(str_list_t *list, const char *item);
+void str_list_sort(str_list_t *list);
+void str_list_free(str_list_t *list);
 void hex_dump(uint8_t *buf, int count);
 void indent_printf(int level, char *fmt, ...);
+void indent_fprintf(FILE *fp, int level, char *fmt, ...);
+
+int hash_set_add(hash_set_t *set, uint64_t key);
+int hash_set_find(hash_set_t *set, uint64_t key);
+int hash_set_remove(hash_set_t *set, uint64_t key);
+void hash_set_free(hash_set_t *set);
+
+#define HASH64_INIT   0xcbf29ce484222325ULL
+#define HASH64_PRIME  0x100000001b3ULL
+
+// FNV-1a, pass 0 to start a new hash or a previous result to continue it.
+// Inline so libmpls, which needs nothing else from here, exports none of
+// these helpers.
+static inline uint64_t
+hash64(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t ii;
+
+    if (hash == 0)
+        hash = HASH64_INIT;
+    for (ii = 0; ii < len; ii++)
+    {
+        hash ^= p[ii];
+        hash *= HASH64_PRIME;
+    }
+    return hash;
+}
+
+#endif // _UTIL_H_
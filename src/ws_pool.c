@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ws_pool.h"
+
+typedef struct {
+    pthread_mutex_t   lock;
+    void            **task;
+    int               head;     // oldest task, taken by thieves
+    int               tail;     // one past the newest, taken by the owner
+    int               alloc;
+} ws_deque_t;
+
+typedef struct {
+    ws_pool_t *pool;
+    int        index;
+} ws_worker_t;
+
+struct ws_pool_s {
+    ws_fn_t          fn;
+    void            *handle;
+    int              threads;   // workers that started
+    int              deques;
+    pthread_t       *thread;
+    ws_worker_t     *worker;
+    ws_deque_t      *deque;
+
+    // "queued" counts the tasks sitting in a deque, "pending" those not
+    // finished yet, running ones included
+    pthread_mutex_t  lock;
+    pthread_cond_t   work;
+    pthread_cond_t   idle;
+    int              queued;
+    int              pending;
+    int              next;      // round robin for outside pushes
+    int              stop;
+};
+
+static int
+_deque_push(ws_deque_t *dq, void *task)
+{
+    void **tmp;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head > 0 && dq->tail == dq->alloc) {
+        memmove(dq->task, dq->task + dq->head, (dq->tail - dq->head) * sizeof(void*));
+        dq->tail -= dq->head;
+        dq->head = 0;
+    }
+    if (dq->tail == dq->alloc) {
+        tmp = realloc(dq->task, (dq->alloc ? dq->alloc * 2 : 64) * sizeof(void*));
+        if (tmp == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        dq->task = tmp;
+        dq->alloc = dq->alloc ? dq->alloc * 2 : 64;
+    }
+    dq->task[dq->tail++] = task;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+static int
+_deque_take(ws_deque_t *dq, int steal, void **task)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail) {
+        *task = steal ? dq->task[dq->head++] : dq->task[--dq->tail];
+        if (dq->head == dq->tail) {
+            dq->head = dq->tail = 0;
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+// Own deque first, then the others starting next to it
+static int
+_take(ws_pool_t *pool, int index, void **task)
+{
+    int ii;
+
+    for (ii = 0; ii < pool->deques; ii++) {
+        if (_deque_take(&pool->deque[(index + ii) % pool->deques], ii > 0, task)) {
+            pthread_mutex_lock(&pool->lock);
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void*
+_worker(void *arg)
+{
+    ws_worker_t *worker = arg;
+    ws_pool_t *pool = worker->pool;
+    void *task;
+
+    while (1) {
+        if (_take(pool, worker->index, &task)) {
+            pool->fn(pool->handle, task, worker->index);
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->pending == 0) {
+                pthread_cond_broadcast(&pool->idle);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->queued == 0 && pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+ws_pool_t*
+ws_pool_create(int threads, ws_fn_t fn, void *handle)
+{
+    ws_pool_t *pool;
+    int ii;
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    pool = calloc(1, sizeof(ws_pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->fn = fn;
+    pool->handle = handle;
+    pool->thread = calloc(threads, sizeof(pthread_t));
+    pool->worker = calloc(threads, sizeof(ws_worker_t));
+    pool->deque = calloc(threads, sizeof(ws_deque_t));
+    if (pool->thread == NULL || pool->worker == NULL || pool->deque == NULL) {
+        free(pool->thread);
+        free(pool->worker);
+        free(pool->deque);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    for (ii = 0; ii < threads; ii++) {
+        pthread_mutex_init(&pool->deque[ii].lock, NULL);
+    }
+    pool->deques = threads;
+
+    for (ii = 0; ii < threads; ii++) {
+        pool->worker[ii].pool = pool;
+        pool->worker[ii].index = ii;
+        if (pthread_create(&pool->thread[ii], NULL, _worker, &pool->worker[ii])) {
+            break;
+        }
+    }
+    if (ii == 0) {
+        pool->threads = 0;
+        ws_pool_destroy(pool);
+        return NULL;
+    }
+    pool->threads = ii;
+    return pool;
+}
+
+void
+ws_pool_push(ws_pool_t *pool, int worker, void *arg)
+{
+    int index;
+
+    pthread_mutex_lock(&pool->lock);
+    index = worker >= 0 ? worker : pool->next++ % pool->threads;
+    pool->pending++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (_deque_push(&pool->deque[index], arg) < 0) {
+        // Out of memory, run it here rather than lose it
+        pool->fn(pool->handle, arg, worker);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+ws_pool_wait(ws_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+ws_pool_destroy(ws_pool_t *pool)
+{
+    int ii;
+
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (ii = 0; ii < pool->threads; ii++) {
+        pthread_join(pool->thread[ii], NULL);
+    }
+
+    for (ii = 0; ii < pool->deques; ii++) {
+        pthread_mutex_destroy(&pool->deque[ii].lock);
+        free(pool->deque[ii].task);
+    }
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->deque);
+    free(pool->worker);
+    free(pool->thread);
+    free(pool);
+}
@@ -0,0 +1,25 @@
+#if !defined(_WS_POOL_H_)
+#define _WS_POOL_H_
+
+// Work stealing thread pool.  Every worker has its own deque: it pushes
+// and pops the tasks it creates at the back, so a directory walk stays
+// depth first and close to what the worker just read, while idle
+// workers steal the oldest tasks from the front of the others.
+typedef struct ws_pool_s ws_pool_t;
+
+// "worker" is the index of the thread running the task, to be passed
+// back to ws_pool_push() for the tasks it creates
+typedef void (*ws_fn_t)(void *handle, void *arg, int worker);
+
+ws_pool_t* ws_pool_create(int threads, ws_fn_t fn, void *handle);
+
+// Queues a task for "fn".  Outside of a task "worker" is -1 and the
+// tasks are spread over the workers.
+void ws_pool_push(ws_pool_t *pool, int worker, void *arg);
+
+// Waits until every queued task, and every task they queued, has run
+void ws_pool_wait(ws_pool_t *pool);
+
+void ws_pool_destroy(ws_pool_t *pool);
+
+#endif // _WS_POOL_H_